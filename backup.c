@@ -0,0 +1,659 @@
+#include "backup.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HEADER_SIZE 16
+#define RECORD_SIZE 16
+#define RECORD_STRIPE 'S'
+#define RECORD_END 'E'
+#define RECORD_COMPRESSED 1
+
+// LZ77 with byte-aligned tokens. A control byte below 0x80 is followed by
+// that many literals plus one; otherwise it is a match of (c & 0x7f) + 4
+// bytes at the 16-bit little-endian distance that follows.
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 0x7f)
+#define LZ_MAX_LITERALS 0x80
+#define LZ_WINDOW 0xffff
+
+static void put16(unsigned char *p, size_t v) {
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+static size_t get16(const unsigned char *p) {
+  return (size_t)p[0] | (size_t)p[1] << 8;
+}
+
+static uint32_t get32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Slicing-by-8: crc_table[k] advances the CRC of a byte followed by k zero
+// bytes, so eight bytes are folded in with eight independent lookups.
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void crc_table_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    }
+    crc_table[0][i] = c;
+  }
+  for (uint32_t i = 0; i < 256; i++) {
+    for (int k = 1; k < 8; k++) {
+      crc_table[k][i] = crc_table[0][crc_table[k - 1][i] & 0xff] ^ (crc_table[k - 1][i] >> 8);
+    }
+  }
+}
+
+uint32_t backup_crc32(const void *data, size_t len) {
+  pthread_once(&crc_table_once, crc_table_init);
+
+  const unsigned char *p = data;
+  uint32_t crc = 0xffffffffu;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint32_t low = crc ^ get32(p);
+    uint32_t high = get32(p + 4);
+    crc = crc_table[7][low & 0xff] ^ crc_table[6][(low >> 8) & 0xff] ^ crc_table[5][(low >> 16) & 0xff] ^
+          crc_table[4][low >> 24] ^ crc_table[3][high & 0xff] ^ crc_table[2][(high >> 8) & 0xff] ^
+          crc_table[1][(high >> 16) & 0xff] ^ crc_table[0][high >> 24];
+  }
+  for (size_t i = 0; i < len; i++) {
+    crc = crc_table[0][(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc ^ 0xffffffffu;
+}
+
+static int lz_literals(const unsigned char *src, size_t from, size_t to, unsigned char *dst, size_t cap, size_t *op) {
+  while (from < to) {
+    size_t n = to - from < LZ_MAX_LITERALS ? to - from : LZ_MAX_LITERALS;
+    if (*op + 1 + n > cap) {
+      return 1;
+    }
+    dst[(*op)++] = (unsigned char)(n - 1);
+    memcpy(dst + *op, src + from, n);
+    *op += n;
+    from += n;
+  }
+  return 0;
+}
+
+// Compresses src into at most cap bytes. Returns the compressed size, 0 if
+// it does not fit.
+static size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap) {
+  uint32_t table[1 << LZ_HASH_BITS] = {0};
+  size_t ip = 0;
+  size_t op = 0;
+  size_t literals = 0;
+
+  while (ip + LZ_MIN_MATCH <= len) {
+    uint32_t word;
+    memcpy(&word, src + ip, sizeof(word));
+    size_t h = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+    size_t candidate = table[h];
+    table[h] = (uint32_t)(ip + 1);
+
+    if (candidate == 0 || ip - (candidate - 1) > LZ_WINDOW || memcmp(src + candidate - 1, src + ip, LZ_MIN_MATCH) != 0) {
+      ip++;
+      continue;
+    }
+    candidate--;
+
+    size_t match = LZ_MIN_MATCH;
+    while (ip + match < len && match < LZ_MAX_MATCH && src[candidate + match] == src[ip + match]) {
+      match++;
+    }
+
+    if (lz_literals(src, literals, ip, dst, cap, &op) || op + 3 > cap) {
+      return 0;
+    }
+    dst[op++] = (unsigned char)(0x80 | (match - LZ_MIN_MATCH));
+    put16(dst + op, ip - candidate);
+    op += 2;
+
+    ip += match;
+    literals = ip;
+  }
+
+  if (lz_literals(src, literals, len, dst, cap, &op)) {
+    return 0;
+  }
+  return op;
+}
+
+static int lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t out_len) {
+  size_t ip = 0;
+  size_t op = 0;
+
+  while (ip < len) {
+    size_t c = src[ip++];
+    if (c & 0x80) {
+      size_t match = (c & 0x7f) + LZ_MIN_MATCH;
+      if (ip + 2 > len) return 1;
+      size_t distance = get16(src + ip);
+      ip += 2;
+      if (distance == 0 || distance > op || op + match > out_len) return 1;
+      if (distance >= match) {
+        memcpy(dst + op, dst + op - distance, match);
+        op += match;
+      } else {
+        // Byte by byte: the match overlaps the bytes it produces
+        for (size_t k = 0; k < match; k++, op++) {
+          dst[op] = dst[op - distance];
+        }
+      }
+    } else {
+      size_t n = c + 1;
+      if (ip + n > len || op + n > out_len) return 1;
+      memcpy(dst + op, src + ip, n);
+      ip += n;
+      op += n;
+    }
+  }
+
+  return op != out_len;
+}
+
+void backup_chain_init(BackupChain *chain) {
+  pthread_mutex_init(&chain->lock, NULL);
+  pthread_cond_init(&chain->idle, NULL);
+  chain->writing = 0;
+  chain->last = 0;
+  chain->deltas = 0;
+}
+
+void backup_chain_destroy(BackupChain *chain) {
+  pthread_mutex_lock(&chain->lock);
+  while (chain->writing > 0) {
+    pthread_cond_wait(&chain->idle, &chain->lock);
+  }
+  pthread_mutex_unlock(&chain->lock);
+  pthread_cond_destroy(&chain->idle);
+  pthread_mutex_destroy(&chain->lock);
+}
+
+void backup_chain_next(BackupChain *chain, int number, int *base, int *depth, unsigned base_versions[KVS_STRIPES]) {
+  pthread_mutex_lock(&chain->lock);
+  if (chain->last == 0 || chain->deltas + 1 >= BACKUP_FULL_EVERY) {
+    *base = number;
+    *depth = 0;
+  } else {
+    *base = chain->last;
+    *depth = chain->deltas + 1;
+    memcpy(base_versions, chain->versions, sizeof(chain->versions));
+  }
+  chain->writing++;
+  pthread_mutex_unlock(&chain->lock);
+}
+
+void backup_chain_done(BackupChain *chain, int number, int depth, const TableSnapshot *snap, int failed) {
+  pthread_mutex_lock(&chain->lock);
+  if (failed) {
+    chain->last = 0;
+  } else if (number > chain->last) {
+    // Backups finish out of order; an older one would not carry the
+    // changes of the newer
+    chain->last = number;
+    chain->deltas = depth;
+    memcpy(chain->versions, snap->versions, sizeof(chain->versions));
+  }
+  if (--chain->writing == 0) {
+    pthread_cond_broadcast(&chain->idle);
+  }
+  pthread_mutex_unlock(&chain->lock);
+}
+
+// Pairs of a stripe encoded as a 16-bit length and the bytes of the key,
+// then the same for the value.
+typedef struct Payload {
+  unsigned char *data;
+  size_t len;
+  size_t capacity;
+  int failed;
+} Payload;
+
+static int payload_reserve(Payload *p, size_t needed) {
+  if (needed <= p->capacity) {
+    return 0;
+  }
+  size_t capacity = p->capacity ? p->capacity * 2 : 4096;
+  while (capacity < needed) {
+    capacity *= 2;
+  }
+  unsigned char *data = realloc(p->data, capacity);
+  if (!data) {
+    return 1;
+  }
+  p->data = data;
+  p->capacity = capacity;
+  return 0;
+}
+
+static void encode_pair(const char *key, const char *value, void *ctx) {
+  Payload *p = ctx;
+  size_t key_len = strlen(key);
+  size_t value_len = strlen(value);
+
+  if (p->failed || key_len > 0xffff || value_len > 0xffff || payload_reserve(p, p->len + 4 + key_len + value_len)) {
+    p->failed = 1;
+    return;
+  }
+
+  put16(p->data + p->len, key_len);
+  memcpy(p->data + p->len + 2, key, key_len);
+  p->len += 2 + key_len;
+  put16(p->data + p->len, value_len);
+  memcpy(p->data + p->len + 2, value, value_len);
+  p->len += 2 + value_len;
+}
+
+static void write_record(Writer *out, int stripe, const Payload *raw, Payload *packed) {
+  unsigned char record[RECORD_SIZE];
+  const unsigned char *stored = raw->data;
+  size_t stored_len = raw->len;
+  int flags = 0;
+
+  if (BACKUP_COMPRESS && raw->len > 0 && payload_reserve(packed, raw->len) == 0) {
+    size_t len = lz_compress(raw->data, raw->len, packed->data, raw->len - 1);
+    if (len > 0) {
+      stored = packed->data;
+      stored_len = len;
+      flags = RECORD_COMPRESSED;
+    }
+  }
+
+  record[0] = RECORD_STRIPE;
+  record[1] = (unsigned char)flags;
+  put16(record + 2, (size_t)stripe);
+  put32(record + 4, (uint32_t)raw->len);
+  put32(record + 8, (uint32_t)stored_len);
+  put32(record + 12, backup_crc32(raw->data, raw->len));
+
+  writer_put(out, (const char *)record, RECORD_SIZE);
+  if (stored_len > 0) {
+    writer_put(out, (const char *)stored, stored_len);
+  }
+}
+
+int backup_write(HashTable *ht, TableSnapshot *snap, int number, int base, const unsigned base_versions[KVS_STRIPES],
+                 Writer *out) {
+  int kind = base == number ? BACKUP_FULL : BACKUP_DELTA;
+  unsigned char header[HEADER_SIZE] = {0};
+  Payload raw = {NULL, 0, 0, 0};
+  Payload packed = {NULL, 0, 0, 0};
+  uint32_t records = 0;
+  int failed = 0;
+
+  memcpy(header, BACKUP_MAGIC, 4);
+  header[4] = BACKUP_VERSION;
+  header[5] = (unsigned char)kind;
+  put32(header + 8, (uint32_t)number);
+  put32(header + 12, (uint32_t)base);
+  writer_put(out, (const char *)header, HEADER_SIZE);
+
+  for (int i = 0; i < KVS_STRIPES; i++) {
+    // Unchanged stripes are taken from the base; snapshot_release drops
+    // the copies a writer may have made of them
+    if (kind == BACKUP_DELTA && snap->versions[i] == base_versions[i]) {
+      continue;
+    }
+
+    raw.len = 0;
+    failed |= snapshot_stripe(ht, snap, i, encode_pair, &raw);
+    failed |= raw.failed;
+
+    // A full backup starts from an empty table, so empty stripes are left
+    // out; in a delta they record that the stripe was emptied
+    if (kind == BACKUP_FULL && raw.len == 0) {
+      continue;
+    }
+
+    write_record(out, i, &raw, &packed);
+    records++;
+  }
+
+  unsigned char end[RECORD_SIZE] = {0};
+  end[0] = RECORD_END;
+  put32(end + 4, records);
+  put32(end + 12, backup_crc32(header, HEADER_SIZE));
+  writer_put(out, (const char *)end, RECORD_SIZE);
+
+  free(raw.data);
+  free(packed.data);
+  return failed | out->failed;
+}
+
+// Stripe record of a mapped backup file. Its checksum is only verified, and
+// its pairs decompressed, when the stripe is unpacked.
+typedef struct StripeRef {
+  const unsigned char *data;
+  size_t raw_len;
+  size_t stored_len;
+  uint32_t crc;
+  int compressed;
+} StripeRef;
+
+// Stripes of a chain of backups, each taken from the newest file that
+// stores it. The files stay mapped until the restore is done.
+typedef struct Restore {
+  StripeRef stripes[KVS_STRIPES];
+  void *maps[BACKUP_FULL_EVERY + 1];
+  size_t map_lens[BACKUP_FULL_EVERY + 1];
+  int mapped;
+} Restore;
+
+static const unsigned char *map_file(const char *path, Restore *state, size_t *len) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return NULL;
+  }
+
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) != 0) {
+    perror(path);
+  } else if (st.st_size == 0) {
+    fprintf(stderr, "%s: not a backup file\n", path);
+  } else if ((data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    perror(path);
+  }
+  close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+
+  // The whole file is about to be read, most of it by other threads
+  posix_madvise(data, (size_t)st.st_size, POSIX_MADV_WILLNEED);
+  *len = (size_t)st.st_size;
+  state->maps[state->mapped] = data;
+  state->map_lens[state->mapped] = *len;
+  state->mapped++;
+  return data;
+}
+
+static void unmap_files(Restore *state) {
+  for (int i = 0; i < state->mapped; i++) {
+    munmap(state->maps[i], state->map_lens[i]);
+  }
+  state->mapped = 0;
+}
+
+// Path of backup `number` of the job a backup file belongs to.
+static char *sibling_path(const char *path, int number) {
+  const char *dash = strrchr(path, '-');
+  if (dash == NULL) {
+    return NULL;
+  }
+
+  size_t prefix = (size_t)(dash - path);
+  size_t size = prefix + 32;
+  char *result = malloc(size);
+  if (result) {
+    snprintf(result, size, "%.*s-%d.bck", (int)prefix, path, number);
+  }
+  return result;
+}
+
+// Maps a backup and its bases and indexes their stripe records.
+static int load(const char *path, Restore *state, int depth) {
+  size_t len = 0;
+  const unsigned char *data = map_file(path, state, &len);
+  if (data == NULL) {
+    return 1;
+  }
+
+  if (len < HEADER_SIZE || memcmp(data, BACKUP_MAGIC, 4) != 0 || data[4] != BACKUP_VERSION) {
+    fprintf(stderr, "%s: not a backup file\n", path);
+    return 1;
+  }
+
+  uint32_t number = get32(data + 8);
+  uint32_t base = get32(data + 12);
+  if (data[5] == BACKUP_DELTA) {
+    char *base_path = sibling_path(path, (int)base);
+    if (base >= number || depth >= BACKUP_FULL_EVERY || base_path == NULL) {
+      fprintf(stderr, "%s: invalid base backup %u\n", path, base);
+      free(base_path);
+      return 1;
+    }
+    int base_failed = load(base_path, state, depth + 1);
+    free(base_path);
+    if (base_failed) return 1;
+  } else if (data[5] != BACKUP_FULL || base != number) {
+    fprintf(stderr, "%s: unknown backup kind\n", path);
+    return 1;
+  }
+
+  size_t pos = HEADER_SIZE;
+  uint32_t records = 0;
+  while (pos + RECORD_SIZE <= len) {
+    const unsigned char *record = data + pos;
+    pos += RECORD_SIZE;
+
+    if (record[0] == RECORD_END) {
+      if (get32(record + 4) != records || get32(record + 12) != backup_crc32(data, HEADER_SIZE)) {
+        fprintf(stderr, "%s: corrupted end record\n", path);
+        return 1;
+      }
+      return 0;
+    }
+
+    size_t stripe = get16(record + 2);
+    size_t stored_len = get32(record + 8);
+    if (record[0] != RECORD_STRIPE || stripe >= KVS_STRIPES || stored_len > len - pos) {
+      fprintf(stderr, "%s: corrupted record\n", path);
+      return 1;
+    }
+
+    state->stripes[stripe] = (StripeRef){data + pos, get32(record + 4), stored_len, get32(record + 12),
+                                         record[1] & RECORD_COMPRESSED};
+    pos += stored_len;
+    records++;
+  }
+
+  fprintf(stderr, "%s: truncated backup\n", path);
+  return 1;
+}
+
+// Checks a stripe record and returns its pairs: straight from the mapped
+// file if they are stored as is, decompressed into scratch otherwise.
+static const unsigned char *unpack(const StripeRef *ref, Payload *scratch) {
+  const unsigned char *pairs = ref->data;
+  if (ref->compressed) {
+    if (payload_reserve(scratch, ref->raw_len + 1) ||
+        lz_decompress(ref->data, ref->stored_len, scratch->data, ref->raw_len)) {
+      return NULL;
+    }
+    pairs = scratch->data;
+  } else if (ref->stored_len != ref->raw_len) {
+    return NULL;
+  }
+
+  return backup_crc32(pairs, ref->raw_len) == ref->crc ? pairs : NULL;
+}
+
+// Pairs of a stripe as null-terminated keys and values, copied into
+// `strings`.
+typedef struct Split {
+  Payload strings;
+  const char **keys;
+  const char **values;
+  size_t count;
+  size_t capacity;
+} Split;
+
+static int split_pairs(Split *split, const unsigned char *p, size_t len) {
+  // Each string replaces its two-byte length with a terminator, so `len`
+  // bytes hold them all and the pointers stay valid
+  split->count = 0;
+  if (payload_reserve(&split->strings, len + 1)) {
+    return 1;
+  }
+
+  char *s = (char *)split->strings.data;
+  size_t pos = 0;
+  while (pos < len) {
+    if (split->count == split->capacity) {
+      size_t capacity = split->capacity ? split->capacity * 2 : 256;
+      const char **keys = realloc(split->keys, capacity * sizeof(char *));
+      if (keys) split->keys = keys;
+      const char **values = realloc(split->values, capacity * sizeof(char *));
+      if (values) split->values = values;
+      if (!keys || !values) return 1;
+      split->capacity = capacity;
+    }
+
+    for (int field = 0; field < 2; field++) {
+      if (len - pos < 2 || get16(p + pos) > len - pos - 2) {
+        return 1;
+      }
+      size_t n = get16(p + pos);
+      memcpy(s, p + pos + 2, n);
+      s[n] = '\0';
+      if (field == 0) split->keys[split->count] = s;
+      else split->values[split->count] = s;
+      s += n + 1;
+      pos += 2 + n;
+    }
+    split->count++;
+  }
+  return 0;
+}
+
+static void split_free(Split *split) {
+  free(split->strings.data);
+  free(split->keys);
+  free(split->values);
+}
+
+int backup_restore(const char *path, pair_visitor visit, void *ctx) {
+  Restore state;
+  memset(&state, 0, sizeof(state));
+  Split *splits = calloc(KVS_STRIPES, sizeof(Split));
+  Payload scratch = {NULL, 0, 0, 0};
+
+  int failed = splits == NULL || load(path, &state, 0);
+
+  // Every stripe is checked before the first pair is visited
+  for (int i = 0; i < KVS_STRIPES && !failed; i++) {
+    const StripeRef *ref = &state.stripes[i];
+    if (ref->data == NULL) continue;
+    const unsigned char *pairs = unpack(ref, &scratch);
+    if (pairs == NULL || split_pairs(&splits[i], pairs, ref->raw_len)) {
+      fprintf(stderr, "%s: checksum mismatch in stripe %d\n", path, i);
+      failed = 1;
+    }
+  }
+
+  for (int i = 0; i < KVS_STRIPES && splits != NULL; i++) {
+    for (size_t k = 0; k < splits[i].count && !failed; k++) {
+      visit(splits[i].keys[k], splits[i].values[k], ctx);
+    }
+    split_free(&splits[i]);
+  }
+
+  free(splits);
+  free(scratch.data);
+  unmap_files(&state);
+  return failed;
+}
+
+// Stripes of a backup loaded into a table by several threads, each taking
+// the next stripe nobody took yet.
+typedef struct LoadTask {
+  HashTable *ht;
+  const char *path;
+  const Restore *state;
+  int next;
+  int failed;
+} LoadTask;
+
+static void *load_stripes(void *arg) {
+  LoadTask *task = arg;
+  Payload scratch = {NULL, 0, 0, 0};
+  Split split;
+  memset(&split, 0, sizeof(split));
+
+  int i;
+  while ((i = __atomic_fetch_add(&task->next, 1, __ATOMIC_RELAXED)) < KVS_STRIPES) {
+    const StripeRef *ref = &task->state->stripes[i];
+    if (ref->data == NULL || ref->raw_len == 0) continue;
+
+    const unsigned char *pairs = unpack(ref, &scratch);
+    if (pairs == NULL || split_pairs(&split, pairs, ref->raw_len)) {
+      fprintf(stderr, "%s: checksum mismatch in stripe %d\n", task->path, i);
+      __atomic_store_n(&task->failed, 1, __ATOMIC_RELAXED);
+    } else if (load_stripe(task->ht, i, split.count, split.keys, split.values)) {
+      fprintf(stderr, "%s: cannot load stripe %d\n", task->path, i);
+      __atomic_store_n(&task->failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  split_free(&split);
+  free(scratch.data);
+  return NULL;
+}
+
+int backup_load(const char *path, HashTable *ht, int threads) {
+  Restore state;
+  memset(&state, 0, sizeof(state));
+
+  int failed = load(path, &state, 0);
+  if (!failed) {
+    if (threads <= 0) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = cpus > 0 ? (int)cpus : 1;
+    }
+    if (threads > KVS_STRIPES) {
+      threads = KVS_STRIPES;
+    }
+
+    LoadTask task = {ht, path, &state, 0, 0};
+    pthread_t helpers[threads];
+    int started = 0;
+    while (started < threads - 1 && pthread_create(&helpers[started], NULL, load_stripes, &task) == 0) {
+      started++;
+    }
+    // The calling thread loads stripes too
+    load_stripes(&task);
+    for (int i = 0; i < started; i++) {
+      pthread_join(helpers[i], NULL);
+    }
+    failed = task.failed;
+  }
+
+  unmap_files(&state);
+  return failed;
+}
+
+static void write_text(const char *key, const char *value, void *ctx) {
+  Writer *out = ctx;
+
+  writer_puts(out, "(");
+  writer_puts(out, key);
+  writer_puts(out, ", ");
+  writer_puts(out, value);
+  writer_puts(out, ")\n");
+}
+
+int backup_materialize(const char *path, Writer *out) {
+  return backup_restore(path, write_text, out);
+}
@@ -0,0 +1,122 @@
+#ifndef KVS_BACKUP_H
+#define KVS_BACKUP_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "kvs.h"
+#include "writer.h"
+
+// Backup files are binary:
+//
+//   header   "KVSB", version, kind (full or delta), number, base number
+//   stripe   one record per stripe stored, with the length of its pairs,
+//            a CRC-32 of them and, if it made them smaller, LZ compression
+//   end      number of stripe records, CRC-32 of the header
+//
+// A full backup stores every stripe. A delta stores the stripes that changed
+// since the backup it is based on, which is the last backup of the job that
+// was written successfully; the other stripes are taken from the base.
+
+#define BACKUP_MAGIC "KVSB"
+#define BACKUP_VERSION 1
+#define BACKUP_FULL 0
+#define BACKUP_DELTA 1
+
+// Every BACKUP_FULL_EVERY backups of a job, one is written in full so that
+// restoring never reads more than BACKUP_FULL_EVERY files.
+#define BACKUP_FULL_EVERY 8
+
+// Whether stripe records are compressed when that makes them smaller.
+#ifndef BACKUP_COMPRESS
+#define BACKUP_COMPRESS 1
+#endif
+
+// Backups written so far by a job: the last one written successfully and
+// the stripe versions of its snapshot, which tell the stripes the next delta
+// has to store. Backup threads report back to it, hence the lock.
+typedef struct BackupChain {
+  pthread_mutex_t lock;
+  pthread_cond_t idle;
+  // Backups of the job still being written
+  int writing;
+  int last;
+  int deltas;
+  unsigned versions[KVS_STRIPES];
+} BackupChain;
+
+/// Initializes the chain of a job that wrote no backup yet.
+/// @param chain Chain to initialize.
+void backup_chain_init(BackupChain *chain);
+
+/// Waits for the backups of a job still being written, then destroys its
+/// chain.
+/// @param chain Chain of the job.
+void backup_chain_destroy(BackupChain *chain);
+
+/// Decides whether the next backup of a job is a delta, and on which base.
+/// Every call is followed by backup_chain_done once the backup is written.
+/// @param chain Chain of the job.
+/// @param number Number of the new backup.
+/// @param base Receives the number of the base backup, or number itself
+///             for a full backup.
+/// @param depth Receives the number of deltas the new backup ends, 0 for a
+///              full backup.
+/// @param base_versions Receives the stripe versions of the base backup.
+void backup_chain_next(BackupChain *chain, int number, int *base, int *depth, unsigned base_versions[KVS_STRIPES]);
+
+/// Advances the chain to a backup once it is written. A backup that failed
+/// makes the next one full, since its file cannot serve as a base.
+/// @param chain Chain of the job.
+/// @param number Number of the backup.
+/// @param depth Depth given by backup_chain_next.
+/// @param snap Snapshot the backup was written from.
+/// @param failed Whether the file could not be written.
+void backup_chain_done(BackupChain *chain, int number, int depth, const TableSnapshot *snap, int failed);
+
+/// Writes a snapshot as a backup file.
+/// @param ht Hash table the snapshot was taken from.
+/// @param snap Snapshot to write.
+/// @param number Number of the backup.
+/// @param base Number of the base backup, number itself for a full backup.
+/// @param base_versions Stripe versions of the base; ignored for a full
+///                      backup.
+/// @param out Writer on the backup file.
+/// @return 0 on success, 1 if the snapshot or a record could not be copied
+///         or the writer failed.
+int backup_write(HashTable *ht, TableSnapshot *snap, int number, int base, const unsigned base_versions[KVS_STRIPES],
+                 Writer *out);
+
+/// Rebuilds the pairs of a backup from its file and those of its bases.
+/// @param path Path of the backup file, named <job>-<number>.bck.
+/// @param visit Function called for each pair, in the order of SHOW.
+/// @param ctx Pointer passed to every call of visit.
+/// @return 0 on success, 1 if a file is missing, truncated or corrupted.
+///         Pairs are only visited if every file is valid.
+int backup_restore(const char *path, pair_visitor visit, void *ctx);
+
+/// Loads a backup into a table that no other thread uses yet. The files are
+/// memory-mapped and the stripes are split between threads, each filling
+/// its stripes with load_stripe, without locks.
+/// @param path Path of the backup file, named <job>-<number>.bck.
+/// @param ht Hash table to fill, normally empty.
+/// @param threads Number of threads, 0 for one per online CPU.
+/// @return 0 on success, 1 if a file is missing, truncated or corrupted, or
+///         if a stripe could not be loaded. The table may then be partly
+///         filled.
+int backup_load(const char *path, HashTable *ht, int threads);
+
+/// Rebuilds the pairs of a backup like backup_restore and writes them in the
+/// text format of SHOW.
+/// @param path Path of the backup file, named <job>-<number>.bck.
+/// @param out Writer that receives the text.
+/// @return 0 on success, 1 if a file is missing, truncated or corrupted.
+int backup_materialize(const char *path, Writer *out);
+
+/// Computes the CRC-32 (IEEE) of a buffer.
+/// @param data Bytes to checksum.
+/// @param len Number of bytes.
+/// @return The checksum.
+uint32_t backup_crc32(const void *data, size_t len);
+
+#endif  // KVS_BACKUP_H
@@ -0,0 +1,48 @@
+#!/bin/bash
+# Compares two outputs of bench/run.sh. Lines are matched on every field
+# except the measured ones, and the change of their time is printed; a
+# positive change means the new run was slower. Repeated runs of the same
+# measurement are averaged.
+#
+# Usage: bench/compare.sh <old_results> <new_results>
+
+if [ $# -ne 2 ]; then
+    echo "Usage: $0 <old_results> <new_results>" >&2
+    exit 1
+fi
+
+awk '
+    # Key of a measurement: the line without the fields that vary between runs
+    function key(   i, k, name) {
+        k = $1
+        for (i = 2; i <= NF; i++) {
+            name = substr($i, 1, index($i, "=") - 1)
+            if (name == "seconds" || name == "rep" || name == "hits" || name == "mops" || name ~ /_per_(s|op)$/) {
+                continue
+            }
+            k = k " " $i
+        }
+        return k
+    }
+    function seconds(   i) {
+        for (i = 2; i <= NF; i++) {
+            if ($i ~ /^seconds=/) return substr($i, 9) + 0
+        }
+        return -1
+    }
+    $1 == "meta" { next }
+    FNR == NR { s = seconds(); if (s >= 0) { k = key(); old[k] += s; old_n[k]++ } next }
+    {
+        s = seconds(); if (s < 0) next
+        k = key(); new[k] += s; new_n[k]++
+        if (!(k in order)) { order[k] = ++count; keys[count] = k }
+    }
+    END {
+        for (i = 1; i <= count; i++) {
+            k = keys[i]
+            if (!(k in old)) { printf "%s new=%.3f\n", k, new[k] / new_n[k]; continue }
+            o = old[k] / old_n[k]; n = new[k] / new_n[k]
+            printf "%s old=%.3f new=%.3f change=%+.1f%%\n", k, o, n, (o > 0 ? (n - o) / o * 100 : 0)
+        }
+    }
+' "$1" "$2"
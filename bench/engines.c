@@ -0,0 +1,76 @@
+// Compares the chained and open-addressing stripe engines on the same keys:
+// inserts, overwrites, lookups that hit, lookups that miss and deletes.
+//
+// Usage: bench/engines [keys]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "kvs.h"
+#include "constants.h"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void report(const char *engine, const char *phase, long ops, double start) {
+    double elapsed = now_seconds() - start;
+    printf("engines engine=%s phase=%s ops=%ld seconds=%.3f ns_per_op=%.1f\n",
+           engine, phase, ops, elapsed, elapsed * 1e9 / (double)ops);
+}
+
+static void run(const char *name, enum TableEngine engine, long keys) {
+    TableOptions options = {engine, 0};
+    HashTable *ht = create_hash_table_with(&options);
+    char key[MAX_STRING_SIZE];
+    double start;
+
+    start = now_seconds();
+    for (long i = 0; i < keys; i++) {
+        snprintf(key, sizeof(key), "user:%ld", i);
+        write_pair(ht, key, "value");
+    }
+    report(name, "insert", keys, start);
+
+    start = now_seconds();
+    for (long i = 0; i < keys; i++) {
+        snprintf(key, sizeof(key), "user:%ld", i);
+        write_pair(ht, key, "other");
+    }
+    report(name, "overwrite", keys, start);
+
+    start = now_seconds();
+    for (long i = 0; i < keys; i++) {
+        snprintf(key, sizeof(key), "user:%ld", i);
+        free(read_pair(ht, key));
+    }
+    report(name, "read_hit", keys, start);
+
+    start = now_seconds();
+    for (long i = 0; i < keys; i++) {
+        snprintf(key, sizeof(key), "missing:%ld", i);
+        free(read_pair(ht, key));
+    }
+    report(name, "read_miss", keys, start);
+
+    start = now_seconds();
+    for (long i = 0; i < keys; i++) {
+        snprintf(key, sizeof(key), "user:%ld", i);
+        delete_pair(ht, key);
+    }
+    report(name, "delete", keys, start);
+
+    free_table(ht);
+}
+
+int main(int argc, char *argv[]) {
+    long keys = argc > 1 ? atol(argv[1]) : 1000000;
+
+    run("chained", ENGINE_CHAINED, keys);
+    run("open", ENGINE_OPEN, keys);
+
+    return 0;
+}
@@ -0,0 +1,111 @@
+// Writes a directory of synthetic job files of WRITE, READ and DELETE
+// commands. Keys are drawn from a shared set, uniformly or with a Zipf
+// skew; the same arguments always produce the same files.
+//
+// Usage: bench/jobgen <dir> [files] [commands_per_file] [keys] [read_pct] [write_pct] [skew] [max_pairs] [seed]
+//        Deletes make up what is left of 100% after reads and writes.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "constants.h"
+
+static double uniform(unsigned *seed) {
+    return (double)rand_r(seed) / ((double)RAND_MAX + 1);
+}
+
+// Index of the first cdf entry not below u.
+static long pick(const double *cdf, long keys, double u) {
+    if (cdf == NULL) {
+        return (long)(u * (double)keys);
+    }
+    long lo = 0;
+    long hi = keys - 1;
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <dir> [files] [commands_per_file] [keys] [read_pct] [write_pct] [skew] "
+                        "[max_pairs] [seed]\n", argv[0]);
+        return 1;
+    }
+    const char *dir = argv[1];
+    long files = argc > 2 ? atol(argv[2]) : 8;
+    long commands = argc > 3 ? atol(argv[3]) : 100000;
+    long keys = argc > 4 ? atol(argv[4]) : 100000;
+    int read_pct = argc > 5 ? atoi(argv[5]) : 50;
+    int write_pct = argc > 6 ? atoi(argv[6]) : 40;
+    double skew = argc > 7 ? atof(argv[7]) : 0;
+    int max_pairs = argc > 8 ? atoi(argv[8]) : 4;
+    unsigned seed = argc > 9 ? (unsigned)atol(argv[9]) : 1;
+
+    if (files < 1 || commands < 1 || keys < 1 || read_pct < 0 || write_pct < 0 || read_pct + write_pct > 100 ||
+        max_pairs < 1 || max_pairs > MAX_WRITE_SIZE) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+    if (mkdir(dir, 0755) != 0) {
+        perror("Failed to create the directory");
+        return 1;
+    }
+
+    double *cdf = NULL;
+    if (skew > 0) {
+        cdf = malloc((size_t)keys * sizeof(double));
+        double sum = 0;
+        for (long i = 0; i < keys; i++) {
+            sum += 1.0 / pow((double)(i + 1), skew);
+            cdf[i] = sum;
+        }
+        for (long i = 0; i < keys; i++) {
+            cdf[i] /= sum;
+        }
+    }
+
+    long long bytes = 0;
+    char path[MAX_PATH + 32];
+    for (long f = 0; f < files; f++) {
+        snprintf(path, sizeof(path), "%s/job%04ld.job", dir, f);
+        FILE *out = fopen(path, "w");
+        if (out == NULL) {
+            perror("Failed to create a job file");
+            free(cdf);
+            return 1;
+        }
+
+        for (long c = 0; c < commands; c++) {
+            int kind = rand_r(&seed) % 100;
+            int pairs = 1 + rand_r(&seed) % max_pairs;
+            if (kind < write_pct) {
+                bytes += fprintf(out, "WRITE [");
+                for (int p = 0; p < pairs; p++) {
+                    bytes += fprintf(out, "(key%ld,value%d)", pick(cdf, keys, uniform(&seed)), rand_r(&seed) % 100000);
+                }
+                bytes += fprintf(out, "]\n");
+            } else {
+                bytes += fprintf(out, "%s [", kind < write_pct + read_pct ? "READ" : "DELETE");
+                for (int p = 0; p < pairs; p++) {
+                    bytes += fprintf(out, "%skey%ld", p ? "," : "", pick(cdf, keys, uniform(&seed)));
+                }
+                bytes += fprintf(out, "]\n");
+            }
+        }
+        fclose(out);
+    }
+
+    printf("jobgen dir=%s files=%ld commands=%ld keys=%ld read_pct=%d write_pct=%d skew=%.2f max_pairs=%d "
+           "bytes=%lld\n", dir, files, files * commands, keys, read_pct, write_pct, skew, max_pairs, bytes);
+    free(cdf);
+    return 0;
+}
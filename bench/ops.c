@@ -0,0 +1,174 @@
+// Throughput of write_pair, read_pair and delete_pair for both engines, a
+// uniform and a Zipf key distribution, and 1 to max_threads threads. Keys
+// are drawn before the clock starts, with a fixed seed per thread, so every
+// run times the same operations.
+//
+// Usage: bench/ops [max_threads] [ops_per_thread] [keys] [skew]
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "kvs.h"
+#include "constants.h"
+
+enum Op { OP_WRITE, OP_READ, OP_DELETE };
+
+static const char *op_names[] = {"write", "read", "delete"};
+
+typedef struct {
+    HashTable *ht;
+    enum Op op;
+    const char (*keys)[MAX_STRING_SIZE];
+    const int *picks;
+    long ops;
+    long hits;
+} worker_args;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void count_hit(const char *key, const char *value, void *ctx) {
+    (void)key;
+    (void)value;
+    (*(long *)ctx)++;
+}
+
+// Fills picks with key indices. With skew > 0, index i is drawn with a
+// probability proportional to 1 / (i + 1)^skew.
+static void draw(int *picks, long ops, long keys, double skew, unsigned seed) {
+    double *cdf = NULL;
+    if (skew > 0) {
+        cdf = malloc((size_t)keys * sizeof(double));
+        double sum = 0;
+        for (long i = 0; i < keys; i++) {
+            sum += 1.0 / pow((double)(i + 1), skew);
+            cdf[i] = sum;
+        }
+        for (long i = 0; i < keys; i++) {
+            cdf[i] /= sum;
+        }
+    }
+
+    for (long i = 0; i < ops; i++) {
+        double u = (double)rand_r(&seed) / ((double)RAND_MAX + 1);
+        if (cdf == NULL) {
+            picks[i] = (int)(u * (double)keys);
+            continue;
+        }
+        long lo = 0;
+        long hi = keys - 1;
+        while (lo < hi) {
+            long mid = (lo + hi) / 2;
+            if (cdf[mid] < u) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        picks[i] = (int)lo;
+    }
+
+    free(cdf);
+}
+
+static void *worker(void *arg) {
+    worker_args *w = arg;
+
+    for (long i = 0; i < w->ops; i++) {
+        const char *key = w->keys[w->picks[i]];
+        switch (w->op) {
+            case OP_WRITE:
+                write_pair(w->ht, key, "value");
+                break;
+            case OP_READ:
+                read_pair_with(w->ht, key, count_hit, &w->hits);
+                break;
+            case OP_DELETE:
+                w->hits += delete_pair(w->ht, key) == 0;
+                break;
+        }
+    }
+
+    return NULL;
+}
+
+static void run(const char *engine, TableOptions options, const char *dist, double skew, enum Op op, int threads,
+                long ops, long keys, const char (*names)[MAX_STRING_SIZE], int *const picks[]) {
+    HashTable *ht = create_hash_table_with(&options);
+    pthread_t tids[threads];
+    worker_args args[threads];
+
+    // Reads and deletes find every key until it is deleted
+    if (op != OP_WRITE) {
+        for (long i = 0; i < keys; i++) {
+            write_pair(ht, names[i], "value");
+        }
+    }
+
+    double start = now_seconds();
+    for (int i = 0; i < threads; i++) {
+        args[i] = (worker_args){ht, op, names, picks[i], ops, 0};
+        pthread_create(&tids[i], NULL, worker, &args[i]);
+    }
+    long hits = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        hits += args[i].hits;
+    }
+    double elapsed = now_seconds() - start;
+
+    long total = ops * threads;
+    printf("ops engine=%s dist=%s skew=%.2f op=%s threads=%d ops=%ld hits=%ld seconds=%.3f mops=%.3f "
+           "ns_per_op=%.1f\n",
+           engine, dist, skew, op_names[op], threads, total, op == OP_WRITE ? total : hits, elapsed,
+           (double)total / elapsed / 1e6, elapsed * 1e9 / (double)ops);
+
+    free_table(ht);
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    long ops = argc > 2 ? atol(argv[2]) : 1000000;
+    long keys = argc > 3 ? atol(argv[3]) : 100000;
+    double skew = argc > 4 ? atof(argv[4]) : 0.99;
+
+    char (*names)[MAX_STRING_SIZE] = malloc((size_t)keys * MAX_STRING_SIZE);
+    int *uniform[max_threads];
+    int *zipf[max_threads];
+    for (long i = 0; i < keys; i++) {
+        snprintf(names[i], MAX_STRING_SIZE, "key%08ld", i);
+    }
+    for (int t = 0; t < max_threads; t++) {
+        uniform[t] = malloc((size_t)ops * sizeof(int));
+        zipf[t] = malloc((size_t)ops * sizeof(int));
+        draw(uniform[t], ops, keys, 0, (unsigned)t + 1);
+        draw(zipf[t], ops, keys, skew, (unsigned)t + 1);
+    }
+
+    const char *engines[] = {"chained", "open"};
+    TableOptions options[] = {{ENGINE_CHAINED, 0}, {ENGINE_OPEN, 0}};
+
+    for (int e = 0; e < 2; e++) {
+        for (int d = 0; d < 2; d++) {
+            for (int op = OP_WRITE; op <= OP_DELETE; op++) {
+                for (int t = 1; t <= max_threads; t *= 2) {
+                    run(engines[e], options[e], d ? "zipf" : "uniform", d ? skew : 0, (enum Op)op, t, ops, keys,
+                        (const char (*)[MAX_STRING_SIZE])names, d ? zipf : uniform);
+                }
+            }
+        }
+    }
+
+    for (int t = 0; t < max_threads; t++) {
+        free(uniform[t]);
+        free(zipf[t]);
+    }
+    free(names);
+    return 0;
+}
@@ -0,0 +1,133 @@
+// Parser throughput: generates a job file with a mix of WRITE, READ, DELETE,
+// SHOW, WAIT and comment lines, then parses it `rounds` times without
+// executing the commands and reports the MB/s of job file parsed with every
+// tokenizer the CPU supports.
+//
+// Usage: bench/parse [megabytes] [pairs_per_line] [rounds]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "parser.h"
+#include "reader.h"
+#include "tokenizer.h"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static size_t write_line(FILE *f, unsigned *seed, long pairs) {
+    int kind = rand_r(seed) % 8;
+    int written = 0;
+
+    if (kind < 4) {
+        written += fprintf(f, "WRITE [");
+        for (long i = 0; i < pairs; i++) {
+            written += fprintf(f, "(key%05d,value%d)", rand_r(seed) % 100000, rand_r(seed));
+        }
+        written += fprintf(f, "]\n");
+    } else if (kind < 6) {
+        written += fprintf(f, "%s [", kind == 4 ? "READ" : "DELETE");
+        for (long i = 0; i < pairs; i++) {
+            written += fprintf(f, "%skey%05d", i ? "," : "", rand_r(seed) % 100000);
+        }
+        written += fprintf(f, "]\n");
+    } else if (kind == 6) {
+        written += fprintf(f, "WAIT 0\n");
+    } else {
+        written += fprintf(f, "# comment line\nSHOW\n");
+    }
+
+    return (size_t)written;
+}
+
+// Parses the whole file once. Returns the number of commands seen.
+static long parse_file(const char *path) {
+    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    unsigned int delay;
+    long commands = 0;
+
+    int fd = open(path, O_RDONLY);
+    Reader reader;
+    if (fd < 0 || reader_init(&reader, fd)) {
+        perror("open");
+        exit(1);
+    }
+
+    while (1) {
+        enum Command cmd = get_next(&reader);
+        if (cmd == EOC) {
+            break;
+        }
+        commands++;
+
+        if (cmd == CMD_WRITE) {
+            parse_write(&reader, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+        } else if (cmd == CMD_READ || cmd == CMD_DELETE) {
+            parse_read_delete(&reader, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+        } else if (cmd == CMD_WAIT) {
+            parse_wait(&reader, &delay, NULL);
+        }
+    }
+
+    reader_destroy(&reader);
+    close(fd);
+    return commands;
+}
+
+int main(int argc, char *argv[]) {
+    long megabytes = argc > 1 ? atol(argv[1]) : 32;
+    long pairs = argc > 2 ? atol(argv[2]) : 16;
+    long rounds = argc > 3 ? atol(argv[3]) : 3;
+
+    if (pairs >= MAX_WRITE_SIZE) {
+        pairs = MAX_WRITE_SIZE - 1;
+    }
+
+    char path[] = "/tmp/kvs-parse-XXXXXX";
+    int fd = mkstemp(path);
+    FILE *f = fd < 0 ? NULL : fdopen(fd, "w");
+    if (f == NULL) {
+        perror("mkstemp");
+        return 1;
+    }
+
+    unsigned seed = 1;
+    size_t size = 0;
+    while (size < (size_t)megabytes << 20) {
+        size += write_line(f, &seed, pairs);
+    }
+    fclose(f);
+
+    static const char *names[] = {"scalar", "sse2", "avx2"};
+    for (int kind = TOKENIZER_SCALAR; kind <= TOKENIZER_AVX2; kind++) {
+        if (tokenizer_select((enum TokenizerKind)kind)) {
+            continue;
+        }
+
+        double best = 0;
+        long commands = 0;
+        for (long round = 0; round < rounds; round++) {
+            double start = now_seconds();
+            commands = parse_file(path);
+            double elapsed = now_seconds() - start;
+            if (best == 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+
+        printf("parse tokenizer=%s bytes=%zu pairs_per_line=%ld commands=%ld seconds=%.3f mb_per_s=%.1f\n",
+               names[kind], size, pairs, commands, best, (double)size / (1 << 20) / best);
+    }
+
+    unlink(path);
+    return 0;
+}
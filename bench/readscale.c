@@ -0,0 +1,93 @@
+// Read-heavy scaling: every thread reads a small set of hot keys while one
+// write in `write_every` operations updates them. Runs the locked and the
+// optimistic read modes of both engines from 1 to max_threads threads.
+//
+// Usage: bench/readscale [max_threads] [ops_per_thread] [write_every]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "kvs.h"
+#include "constants.h"
+
+#define HOT_KEYS 64
+
+typedef struct {
+    HashTable *ht;
+    long ops;
+    long write_every;
+    unsigned seed;
+} worker_args;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void count_hit(const char *key, const char *value, void *ctx) {
+    (void)key;
+    (void)value;
+    (*(long *)ctx)++;
+}
+
+static void *worker(void *arg) {
+    worker_args *w = arg;
+    char key[MAX_STRING_SIZE];
+    long hits = 0;
+
+    for (long i = 0; i < w->ops; i++) {
+        snprintf(key, sizeof(key), "hot:%d", rand_r(&w->seed) % HOT_KEYS);
+        if (w->write_every > 0 && i % w->write_every == 0) {
+            write_pair(w->ht, key, "updated");
+        } else {
+            read_pair_with(w->ht, key, count_hit, &hits);
+        }
+    }
+
+    return NULL;
+}
+
+static void run(const char *name, TableOptions options, int threads, long ops, long write_every) {
+    HashTable *ht = create_hash_table_with(&options);
+    char key[MAX_STRING_SIZE];
+    pthread_t tids[threads];
+    worker_args args[threads];
+
+    for (int i = 0; i < HOT_KEYS; i++) {
+        snprintf(key, sizeof(key), "hot:%d", i);
+        write_pair(ht, key, "value");
+    }
+
+    double start = now_seconds();
+    for (int i = 0; i < threads; i++) {
+        args[i] = (worker_args){ht, ops, write_every, (unsigned)i + 1};
+        pthread_create(&tids[i], NULL, worker, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+
+    printf("readscale mode=%s threads=%d ops=%ld seconds=%.3f mops=%.3f\n",
+           name, threads, ops * threads, elapsed, (double)(ops * threads) / elapsed / 1e6);
+
+    free_table(ht);
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    long ops = argc > 2 ? atol(argv[2]) : 2000000;
+    long write_every = argc > 3 ? atol(argv[3]) : 100;
+
+    for (int t = 1; t <= max_threads; t *= 2) {
+        run("chained-locked", (TableOptions){ENGINE_CHAINED, 0}, t, ops, write_every);
+        run("chained-optimistic", (TableOptions){ENGINE_CHAINED, 1}, t, ops, write_every);
+        run("open-locked", (TableOptions){ENGINE_OPEN, 0}, t, ops, write_every);
+        run("open-optimistic", (TableOptions){ENGINE_OPEN, 1}, t, ops, write_every);
+    }
+
+    return 0;
+}
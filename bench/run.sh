@@ -0,0 +1,70 @@
+#!/bin/bash
+# Runs the benchmark suite and prints one line per measurement, as
+# "<bench> key=value ...", preceded by a "meta" line naming the commit.
+# bench/compare.sh compares two such outputs.
+#
+# Usage: bench/run.sh
+#        BENCH_SCALE    multiplies the work of every run (default 1)
+#        BENCH_THREADS  largest thread count (default: online CPUs)
+#        BENCH_REPS     runs of every end-to-end workload (default 3)
+#
+# Expects the binaries built by `make bench`.
+# The "e2e" lines of the debug and the release build show what the
+# release profile gains; run `make pgo` first to include PGO.
+
+set -e
+cd "$(dirname "$0")/.."
+
+scale=${BENCH_SCALE:-1}
+cpus=$(getconf _NPROCESSORS_ONLN)
+threads=${BENCH_THREADS:-$cpus}
+reps=${BENCH_REPS:-3}
+
+echo "meta commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)" \
+     "dirty=$(git status --porcelain --untracked-files=no 2>/dev/null | grep -q . && echo 1 || echo 0)" \
+     "date=$(date -u +%Y-%m-%dT%H:%M:%SZ) cpus=$cpus threads=$threads scale=$scale reps=$reps"
+
+# Microbenchmarks of the table, the parser and the log
+bench/ops "$threads" $((200000 * scale)) 100000 0.99
+bench/engines $((200000 * scale))
+bench/readscale "$threads" $((500000 * scale)) 100
+bench/parse $((8 * scale)) 16 3
+bench/walreplay $((50000 * scale)) 4 "$threads"
+bench/snapload $((500000 * scale)) "$threads"
+
+# End to end: job directories run by the sanitizer build (kvs) and the
+# release build (kvs-release, trained with make pgo if it was run since)
+builds=("debug ./kvs" "release ./kvs-release")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# name read_pct write_pct skew
+workloads=(
+    "read_heavy 80 15 0"
+    "read_heavy_skewed 80 15 0.99"
+    "write_heavy 20 70 0"
+    "write_heavy_skewed 20 70 0.99"
+)
+files=8
+commands=$((20000 * scale))
+
+for workload in "${workloads[@]}"; do
+    read -r name read_pct write_pct skew <<< "$workload"
+    bench/jobgen "$tmp/$name" "$files" "$commands" 100000 "$read_pct" "$write_pct" "$skew" 4 1 > /dev/null
+
+    for build in "${builds[@]}"; do
+        read -r label kvs <<< "$build"
+        for ((t = 1; t <= threads; t *= 2)); do
+            for ((rep = 1; rep <= reps; rep++)); do
+                rm -f "$tmp/$name"/*.out
+                start=$(date +%s%N)
+                "$kvs" -t "$t" "$tmp/$name" > /dev/null
+                end=$(date +%s%N)
+                awk -v name="$name" -v build="$label" -v t="$t" -v rep="$rep" -v n=$((files * commands)) \
+                    -v ns=$((end - start)) \
+                    'BEGIN { printf "e2e workload=%s build=%s threads=%d rep=%d commands=%d seconds=%.3f " \
+                                    "commands_per_s=%.0f\n", name, build, t, rep, n, ns / 1e9, n / (ns / 1e9) }'
+            done
+        done
+    done
+done
@@ -0,0 +1,109 @@
+// Startup from a snapshot: writes a table of `pairs` pairs as a full backup,
+// then rebuilds it by visiting the pairs with write_pair and with
+// backup_load from 1 to max_threads threads, for both engines. Reports the
+// pairs/s and the MB/s of backup file loaded.
+//
+// Usage: bench/snapload [pairs] [max_threads]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kvs.h"
+#include "backup.h"
+#include "constants.h"
+#include "writer.h"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void count_pair(const char *key, const char *value, void *ctx) {
+    (void)key;
+    (void)value;
+    (*(long *)ctx)++;
+}
+
+static long count_pairs(HashTable *ht) {
+    long count = 0;
+    foreach_pair(ht, count_pair, &count);
+    return count;
+}
+
+static void put_pair(const char *key, const char *value, void *ctx) {
+    write_pair(ctx, key, value);
+}
+
+static void report(const char *name, const char *engine, int threads, long pairs, double bytes, double seconds) {
+    printf("snapload mode=%s engine=%s threads=%d pairs=%ld seconds=%.3f pairs_per_s=%.0f mb_per_s=%.1f\n", name,
+           engine, threads, pairs, seconds, (double)pairs / seconds, bytes / (1 << 20) / seconds);
+}
+
+int main(int argc, char *argv[]) {
+    long pairs = argc > 1 ? atol(argv[1]) : 2000000;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+
+    char path[] = "/tmp/kvs-snapload-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+
+    HashTable *ht = create_hash_table();
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];
+    unsigned seed = 1;
+    for (long i = 0; i < pairs; i++) {
+        snprintf(key, sizeof(key), "key%08ld", i);
+        snprintf(value, sizeof(value), "value%d", rand_r(&seed));
+        write_pair(ht, key, value);
+    }
+
+    Writer out;
+    TableSnapshot *snap = snapshot_table(ht);
+    if (snap == NULL || writer_init(&out, fd) || backup_write(ht, snap, 1, 1, NULL, &out) || writer_destroy(&out)) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        return 1;
+    }
+    snapshot_release(ht, snap);
+    free_table(ht);
+    close(fd);
+
+    struct stat st;
+    stat(path, &st);
+    double bytes = (double)st.st_size;
+    int failed = 0;
+
+    static const char *names[] = {"chained", "open"};
+    for (int engine = ENGINE_CHAINED; engine <= ENGINE_OPEN; engine++) {
+        TableOptions options = {(enum TableEngine)engine, 0};
+
+        ht = create_hash_table_with(&options);
+        double start = now_seconds();
+        failed |= backup_restore(path, put_pair, ht);
+        report("write_pair", names[engine], 1, pairs, bytes, now_seconds() - start);
+        failed |= count_pairs(ht) != pairs;
+        free_table(ht);
+
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            ht = create_hash_table_with(&options);
+            start = now_seconds();
+            failed |= backup_load(path, ht, threads);
+            report("load", names[engine], threads, pairs, bytes, now_seconds() - start);
+            failed |= count_pairs(ht) != pairs;
+            free_table(ht);
+        }
+    }
+
+    unlink(path);
+    if (failed) {
+        fprintf(stderr, "A loaded table did not match the snapshot\n");
+    }
+    return failed;
+}
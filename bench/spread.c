@@ -0,0 +1,113 @@
+// Shows how keys sharing a prefix are spread over the stripes and buckets of
+// the hash table, and how write/read throughput scales with threads when all
+// of them use the same prefix.
+//
+// Usage: bench/spread [keys] [max_threads]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "kvs.h"
+#include "constants.h"
+
+static const char *prefixes[] = {"user:", "session:", "_tmp", "/path/"};
+
+typedef struct {
+    HashTable *ht;
+    const char *prefix;
+    int thread_id;
+    long ops;
+} worker_args;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void report_spread(const char *prefix, long keys) {
+    HashTable *ht = create_hash_table();
+    char key[MAX_STRING_SIZE];
+
+    for (long i = 0; i < keys; i++) {
+        snprintf(key, sizeof(key), "%s%ld", prefix, i);
+        write_pair(ht, key, "x");
+    }
+
+    size_t min = (size_t)-1, max = 0, longest_chain = 0, used = 0, buckets = 0;
+    for (int i = 0; i < KVS_STRIPES; i++) {
+        Stripe *s = &ht->stripes[i];
+        if (s->count < min) min = s->count;
+        if (s->count > max) max = s->count;
+        if (s->count > 0) used++;
+
+        buckets += s->mask + 1;
+        for (size_t b = 0; b <= s->mask; b++) {
+            size_t chain = 0;
+            for (KeyNode *n = s->buckets[b]; n != NULL; n = n->next) chain++;
+            if (chain > longest_chain) longest_chain = chain;
+        }
+    }
+
+    double mean = (double)keys / KVS_STRIPES;
+    printf("spread prefix=%s keys=%ld stripes_used=%zu/%d stripe_min=%zu stripe_max=%zu "
+           "max_over_mean=%.3f buckets=%zu longest_chain=%zu\n",
+           prefix, keys, used, KVS_STRIPES, min, max, (double)max / mean, buckets, longest_chain);
+
+    free_table(ht);
+}
+
+static void *worker(void *arg) {
+    worker_args *w = arg;
+    char key[MAX_STRING_SIZE];
+
+    for (long i = 0; i < w->ops; i++) {
+        snprintf(key, sizeof(key), "%s%d:%ld", w->prefix, w->thread_id, i % 4096);
+        if (i % 4 == 0) {
+            write_pair(w->ht, key, "value");
+        } else {
+            free(read_pair(w->ht, key));
+        }
+    }
+
+    return NULL;
+}
+
+static void report_scaling(const char *prefix, int threads, long ops) {
+    HashTable *ht = create_hash_table();
+    pthread_t tids[threads];
+    worker_args args[threads];
+
+    double start = now_seconds();
+    for (int i = 0; i < threads; i++) {
+        args[i] = (worker_args){ht, prefix, i, ops};
+        pthread_create(&tids[i], NULL, worker, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+
+    printf("scaling prefix=%s threads=%d ops=%ld seconds=%.3f mops=%.3f\n",
+           prefix, threads, ops * threads, elapsed, (double)(ops * threads) / elapsed / 1e6);
+
+    free_table(ht);
+}
+
+int main(int argc, char *argv[]) {
+    long keys = argc > 1 ? atol(argv[1]) : 1000000;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+        report_spread(prefixes[i], keys);
+    }
+
+    for (int t = 1; t <= max_threads; t *= 2) {
+        report_scaling(prefixes[0], t, 1000000);
+    }
+
+    return 0;
+}
@@ -0,0 +1,49 @@
+#!/bin/bash
+# Training run of make pgo: drives a kvs binary over generated job
+# directories that cover both engines, locked and optimistic reads, read-
+# and write-heavy mixes, skewed keys, several workers, split job files,
+# SHOW and BACKUP.
+#
+# Usage: bench/train.sh <kvs>
+
+set -e
+cd "$(dirname "$0")/.."
+
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 <kvs>" >&2
+    exit 1
+fi
+kvs=$1
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# name read_pct write_pct skew
+workloads=(
+    "read_heavy 80 15 0"
+    "write_heavy 20 70 0"
+    "skewed 50 40 0.99"
+)
+for workload in "${workloads[@]}"; do
+    read -r name read_pct write_pct skew <<< "$workload"
+    bench/jobgen "$tmp/$name" 8 20000 100000 "$read_pct" "$write_pct" "$skew" 4 1 > /dev/null
+done
+
+mkdir "$tmp/misc"
+for ((i = 0; i < 200; i++)); do
+    echo "WRITE [(k$i,v$i)(k$((i + 1)),w$i)]"
+    echo "READ [k$i,missing$i]"
+    if ((i % 50 == 0)); then
+        echo "SHOW"
+        echo "BACKUP"
+    fi
+    echo "DELETE [k$((i / 2))]"
+done > "$tmp/misc/misc.job"
+
+for dir in "$tmp"/*/; do
+    for flags in "-t 1" "-t 4" "-t 4 -e open" "-t 4 -o" "-t 4 -j 64" "-t 2 -b 2"; do
+        rm -f "$dir"/*.out "$dir"/*.bck
+        # shellcheck disable=SC2086
+        "$kvs" $flags "$dir" > /dev/null
+    done
+done
@@ -0,0 +1,147 @@
+// Write-ahead log: `threads` threads log `batches` WRITE or DELETE batches of
+// `pairs` keys each with group commit, then the log is closed without a
+// checkpoint, as a crash would leave it, and replayed into an empty table.
+// Reports the logging rate and the replay rate in records/s and MB/s.
+//
+// Usage: bench/walreplay [batches] [pairs] [threads]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "kvs.h"
+#include "constants.h"
+#include "wal.h"
+
+typedef struct {
+    HashTable *ht;
+    long batches;
+    long pairs;
+    unsigned seed;
+} worker_args;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void count_pair(const char *key, const char *value, void *ctx) {
+    (void)key;
+    (void)value;
+    (*(long *)ctx)++;
+}
+
+static long count_pairs(HashTable *ht) {
+    long count = 0;
+    foreach_pair(ht, count_pair, &count);
+    return count;
+}
+
+static void *worker(void *arg) {
+    worker_args *w = arg;
+    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    const char *key_ptrs[MAX_WRITE_SIZE];
+    const char *value_ptrs[MAX_WRITE_SIZE];
+
+    for (long i = 0; i < w->batches; i++) {
+        for (long k = 0; k < w->pairs; k++) {
+            snprintf(keys[k], MAX_STRING_SIZE, "key%06d", rand_r(&w->seed) % 200000);
+            snprintf(values[k], MAX_STRING_SIZE, "value%d", rand_r(&w->seed));
+            key_ptrs[k] = keys[k];
+            value_ptrs[k] = values[k];
+        }
+        if (i % 8 == 7) {
+            delete_pairs(w->ht, (size_t)w->pairs, key_ptrs, NULL);
+        } else {
+            write_pairs(w->ht, (size_t)w->pairs, key_ptrs, value_ptrs, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    long batches = argc > 1 ? atol(argv[1]) : 200000;
+    long pairs = argc > 2 ? atol(argv[2]) : 4;
+    int threads = argc > 3 ? atoi(argv[3]) : 4;
+
+    if (pairs < 1) pairs = 1;
+    if (pairs > MAX_WRITE_SIZE) pairs = MAX_WRITE_SIZE;
+    if (threads < 1) threads = 1;
+
+    char dir[] = "/tmp/kvs-wal-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char path[64];
+    char snap_path[64];
+    snprintf(path, sizeof(path), "%s/kvs.wal", dir);
+    snprintf(snap_path, sizeof(snap_path), "%s/kvs.wal.snap", dir);
+
+    WalOptions options;
+    wal_options_default(&options);
+    options.checkpoint_bytes = (size_t)-1;
+
+    HashTable *ht = create_hash_table();
+    Wal *wal = ht ? wal_open(path, ht, &options) : NULL;
+    if (wal == NULL) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return 1;
+    }
+
+    pthread_t tids[threads];
+    worker_args args[threads];
+    double start = now_seconds();
+    for (int t = 0; t < threads; t++) {
+        args[t] = (worker_args){ht, batches / threads, pairs, (unsigned)t + 1};
+        pthread_create(&tids[t], NULL, worker, &args[t]);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    // Closing without a checkpoint leaves the whole history in the log
+    int failed = wal_close(wal, 0);
+    double logged = now_seconds() - start;
+
+    struct stat st;
+    if (failed || stat(path, &st) != 0) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        return 1;
+    }
+    long records = batches / threads * threads;
+    double megabytes = (double)st.st_size / (1 << 20);
+    printf("walreplay phase=log threads=%d pairs=%ld records=%ld bytes=%lld seconds=%.3f records_per_s=%.0f "
+           "mb_per_s=%.1f\n",
+           threads, pairs, records, (long long)st.st_size, logged, (double)records / logged, megabytes / logged);
+
+    HashTable *restored = create_hash_table();
+    start = now_seconds();
+    wal = restored ? wal_open(path, restored, &options) : NULL;
+    double replayed = now_seconds() - start;
+    if (wal == NULL) {
+        fprintf(stderr, "Failed to replay %s\n", path);
+        return 1;
+    }
+
+    long expected = count_pairs(ht);
+    long found = count_pairs(restored);
+    printf("walreplay phase=replay records=%llu bytes=%lld seconds=%.3f records_per_s=%.0f mb_per_s=%.1f "
+           "pairs=%ld expected=%ld\n",
+           (unsigned long long)wal->replayed, (long long)st.st_size, replayed, (double)wal->replayed / replayed,
+           megabytes / replayed, found, expected);
+
+    wal_close(wal, 0);
+    free_table(restored);
+    free_table(ht);
+    unlink(path);
+    unlink(snap_path);
+    rmdir(dir);
+    return found != expected;
+}
@@ -0,0 +1,126 @@
+#include "client.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Closes the request and response FIFOs and removes all three.
+static void close_pipes(KvsClient *client) {
+  if (client->resp >= 0) close(client->resp);
+  if (client->req >= 0) close(client->req);
+  client->req = client->resp = -1;
+  unlink(client->request_path);
+  unlink(client->response_path);
+  unlink(client->notification_path);
+}
+
+// Reads a frame header and its text from a response or notification FIFO.
+// The text is discarded when reply is NULL.
+static int read_frame(int fd, enum KvsOp op, char **reply, size_t *length) {
+  ResponseHeader header;
+  if (read_exact(fd, &header, sizeof(header)) || header.op != op) {
+    return -1;
+  }
+
+  char *text = malloc((size_t)header.length + 1);
+  if (text == NULL || read_exact(fd, text, header.length)) {
+    free(text);
+    return -1;
+  }
+  text[header.length] = '\0';
+
+  if (reply != NULL) {
+    *reply = text;
+    *length = header.length;
+  } else {
+    free(text);
+  }
+  return header.status == STATUS_OK ? 0 : 1;
+}
+
+static int read_response(KvsClient *client, enum KvsOp op, char **reply, size_t *length) {
+  return read_frame(client->resp, op, reply, length);
+}
+
+int client_connect(KvsClient *client, const char *server_fifo, const char *prefix) {
+  ConnectRequest request;
+  memset(&request, 0, sizeof(request));
+  memset(client, 0, sizeof(*client));
+  client->req = client->resp = client->notif = -1;
+
+  int length = snprintf(client->notification_path, KVS_PIPE_PATH_SIZE, "%s.notif", prefix);
+  if (length < 0 || length >= KVS_PIPE_PATH_SIZE) {
+    fprintf(stderr, "Pipe prefix too long: %s\n", prefix);
+    return 1;
+  }
+  snprintf(client->request_path, KVS_PIPE_PATH_SIZE, "%s.req", prefix);
+  snprintf(client->response_path, KVS_PIPE_PATH_SIZE, "%s.resp", prefix);
+
+  unlink(client->request_path);
+  unlink(client->response_path);
+  unlink(client->notification_path);
+  if (mkfifo(client->request_path, 0640) || mkfifo(client->response_path, 0640) ||
+      mkfifo(client->notification_path, 0640)) {
+    perror("Failed to create the client FIFOs");
+    close_pipes(client);
+    return 1;
+  }
+
+  // One write, below PIPE_BUF, so it never mixes with other clients
+  request.op = OP_CONNECT;
+  memcpy(request.request_path, client->request_path, KVS_PIPE_PATH_SIZE);
+  memcpy(request.response_path, client->response_path, KVS_PIPE_PATH_SIZE);
+  memcpy(request.notification_path, client->notification_path, KVS_PIPE_PATH_SIZE);
+  int server = open(server_fifo, O_WRONLY);
+  if (server < 0 || write_exact(server, &request, sizeof(request))) {
+    perror("Failed to reach the server");
+    if (server >= 0) close(server);
+    close_pipes(client);
+    return 1;
+  }
+  close(server);
+
+  // Same order as the server, which opens each one once ours is open or
+  // waiting for it
+  client->req = open(client->request_path, O_WRONLY);
+  client->resp = client->req < 0 ? -1 : open(client->response_path, O_RDONLY);
+  client->notif = client->resp < 0 ? -1 : open(client->notification_path, O_RDONLY);
+  if (client->notif < 0 || read_response(client, OP_CONNECT, NULL, NULL) != 0) {
+    fprintf(stderr, "Failed to connect to the server\n");
+    close_pipes(client);
+    client_close(client);
+    return 1;
+  }
+  return 0;
+}
+
+int client_request(KvsClient *client, enum KvsOp op, size_t count, char keys[][MAX_STRING_SIZE],
+                   char values[][MAX_STRING_SIZE], char **reply, size_t *length) {
+  RequestHeader header = {(uint8_t)op, 0, (uint16_t)count};
+  if (write_exact(client->req, &header, sizeof(header)) ||
+      write_exact(client->req, keys, count * MAX_STRING_SIZE) ||
+      (op == OP_WRITE && write_exact(client->req, values, count * MAX_STRING_SIZE))) {
+    return -1;
+  }
+  return read_response(client, op, reply, length);
+}
+
+int client_next_notification(KvsClient *client, char **text, size_t *length) {
+  return read_frame(client->notif, OP_NOTIFY, text, length) != 0;
+}
+
+int client_disconnect(KvsClient *client) {
+  RequestHeader header = {OP_DISCONNECT, 0, 0};
+  int failed = write_exact(client->req, &header, sizeof(header)) ||
+               read_response(client, OP_DISCONNECT, NULL, NULL) != 0;
+  close_pipes(client);
+  return failed;
+}
+
+void client_close(KvsClient *client) {
+  if (client->notif >= 0) close(client->notif);
+  client->notif = -1;
+}
@@ -0,0 +1,59 @@
+#ifndef KVS_CLIENT_H
+#define KVS_CLIENT_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+// Connection of a client to kvs in server mode.
+typedef struct KvsClient {
+  int req;
+  int resp;
+  int notif;
+  char request_path[KVS_PIPE_PATH_SIZE];
+  char response_path[KVS_PIPE_PATH_SIZE];
+  char notification_path[KVS_PIPE_PATH_SIZE];
+} KvsClient;
+
+/// Creates the FIFOs of a client and connects them to the server.
+/// @param client Client to connect.
+/// @param server_fifo Path of the server FIFO.
+/// @param prefix Prefix of the client FIFOs, which end in .req, .resp and
+/// .notif.
+/// @return 0 on success, 1 otherwise. Nothing is left behind on failure.
+int client_connect(KvsClient *client, const char *server_fifo, const char *prefix);
+
+/// Sends a WRITE, READ or DELETE request and waits for its response.
+/// @param client Connected client.
+/// @param op OP_WRITE, OP_READ or OP_DELETE.
+/// @param count Number of keys, between 1 and MAX_WRITE_SIZE.
+/// @param keys Keys of the request.
+/// @param values Values of a WRITE, NULL otherwise.
+/// @param reply Set to the text of the response, to be freed by the caller.
+/// @param length Set to the bytes of that text.
+/// @return 0 on success, 1 if the server failed the request, -1 if the
+/// connection is lost.
+int client_request(KvsClient *client, enum KvsOp op, size_t count, char keys[][MAX_STRING_SIZE],
+                   char values[][MAX_STRING_SIZE], char **reply, size_t *length);
+
+/// Waits for the next batch of changes to subscribed keys. Meant for a
+/// thread of its own, since notifications arrive at any time.
+/// @param client Connected client.
+/// @param text Set to the "(key,value)" lines of the batch, to be freed by
+/// the caller.
+/// @param length Set to the bytes of that text.
+/// @return 0 on success, 1 once the server closed the notification FIFO.
+int client_next_notification(KvsClient *client, char **text, size_t *length);
+
+/// Disconnects from the server, closes the request and response FIFOs and
+/// removes all three. The notification FIFO stays open until client_close,
+/// so a thread reading it sees the server close its end.
+/// @param client Connected client.
+/// @return 0 if the server acknowledged the disconnection, 1 otherwise.
+int client_disconnect(KvsClient *client);
+
+/// Closes the notification FIFO of a disconnected client.
+/// @param client Disconnected client.
+void client_close(KvsClient *client);
+
+#endif  // KVS_CLIENT_H
@@ -3,3 +3,4 @@
 #define MAX_JOB_FILE_NAME_SIZE 256
 #define MAX_PATH 1024
 #define EXTENSION 5
+#define MAX_WORKERS 1024
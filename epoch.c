@@ -0,0 +1,162 @@
+#include "epoch.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+// Epoch based reclamation. A block retired during global epoch e can be
+// released once the global epoch reaches e + 2: by then every thread that was
+// reading when it was retired has left its read region. The global epoch only
+// advances when every thread inside a read region has observed it.
+
+typedef struct Retired {
+    void *ptr;
+    size_t size;
+    epoch_release release;
+    uint64_t epoch;
+} Retired;
+
+// One record per thread, kept in a global list and reused after the thread
+// exits. `active` is 0 outside read regions, otherwise the epoch observed.
+typedef struct Record {
+    _Alignas(64) uint64_t active;
+    int in_use;
+    Retired *retired;
+    size_t first;
+    size_t count;
+    size_t capacity;
+    struct Record *next;
+} Record;
+
+static uint64_t global_epoch = 1;
+
+static pthread_mutex_t records_lock = PTHREAD_MUTEX_INITIALIZER;
+static Record *records = NULL;
+
+static _Thread_local Record *self = NULL;
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+
+// The record of an exiting thread keeps its retired blocks; the next thread
+// that claims the record releases them.
+static void record_release(void *arg) {
+    Record *record = arg;
+    __atomic_store_n(&record->active, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&record->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void record_key_create(void) {
+    pthread_key_create(&record_key, record_release);
+}
+
+static Record *record_get(void) {
+    if (self != NULL) {
+        return self;
+    }
+
+    pthread_once(&record_key_once, record_key_create);
+    pthread_mutex_lock(&records_lock);
+
+    Record *record = records;
+    while (record != NULL && __atomic_load_n(&record->in_use, __ATOMIC_ACQUIRE)) {
+        record = record->next;
+    }
+
+    if (record == NULL) {
+        record = aligned_alloc(_Alignof(Record), sizeof(Record));
+        if (!record) abort();
+        record->active = 0;
+        record->retired = NULL;
+        record->first = 0;
+        record->count = 0;
+        record->capacity = 0;
+        record->next = records;
+        records = record;
+    }
+    record->in_use = 1;
+
+    pthread_mutex_unlock(&records_lock);
+
+    pthread_setspecific(record_key, record);
+    self = record;
+    return record;
+}
+
+// Advances the global epoch if every thread in a read region observed it.
+static uint64_t try_advance(void) {
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&records_lock);
+    for (Record *record = records; record != NULL; record = record->next) {
+        uint64_t active = __atomic_load_n(&record->active, __ATOMIC_SEQ_CST);
+        if (active != 0 && active != epoch) {
+            pthread_mutex_unlock(&records_lock);
+            return epoch;
+        }
+    }
+    pthread_mutex_unlock(&records_lock);
+
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+}
+
+// Releases the retired blocks of a record that are at least two epochs old.
+// Blocks are retired in epoch order, so they are released from the front.
+static void reclaim(Record *record, uint64_t epoch) {
+    while (record->count > 0) {
+        Retired *entry = &record->retired[record->first];
+        if (entry->epoch + 2 > epoch) {
+            break;
+        }
+        entry->release(entry->ptr, entry->size);
+        record->first++;
+        record->count--;
+    }
+
+    if (record->count == 0) {
+        record->first = 0;
+    }
+}
+
+void epoch_enter(void) {
+    Record *record = record_get();
+    __atomic_store_n(&record->active, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void) {
+    __atomic_store_n(&self->active, 0, __ATOMIC_RELEASE);
+}
+
+void epoch_retire(void *ptr, size_t size, epoch_release release) {
+    Record *record = record_get();
+
+    if (record->first + record->count == record->capacity) {
+        if (record->first > 0) {
+            for (size_t i = 0; i < record->count; i++) {
+                record->retired[i] = record->retired[record->first + i];
+            }
+            record->first = 0;
+        } else {
+            size_t capacity = record->capacity ? record->capacity * 2 : EPOCH_RECLAIM_BATCH;
+            Retired *retired = realloc(record->retired, capacity * sizeof(Retired));
+            if (!retired) abort();
+            record->retired = retired;
+            record->capacity = capacity;
+        }
+    }
+
+    record->retired[record->first + record->count++] = (Retired){
+        ptr, size, release, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST)};
+
+    if (record->count % EPOCH_RECLAIM_BATCH == 0) {
+        reclaim(record, try_advance());
+    }
+}
+
+void epoch_reclaim_all(void) {
+    pthread_mutex_lock(&records_lock);
+    for (Record *record = records; record != NULL; record = record->next) {
+        reclaim(record, UINT64_MAX);
+    }
+    pthread_mutex_unlock(&records_lock);
+}
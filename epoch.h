@@ -0,0 +1,32 @@
+#ifndef KVS_EPOCH_H
+#define KVS_EPOCH_H
+
+#include <stddef.h>
+
+// Retired blocks a thread accumulates before it tries to reclaim them.
+#define EPOCH_RECLAIM_BATCH 64
+
+/// Frees a retired block.
+/// @param ptr Block that was retired.
+/// @param size Size given to epoch_retire.
+typedef void (*epoch_release)(void *ptr, size_t size);
+
+/// Marks the calling thread as reading shared memory without locks. Blocks
+/// retired from now on are not released until the thread calls epoch_exit.
+/// Only stores to a record owned by the calling thread.
+void epoch_enter(void);
+
+/// Ends the region started by epoch_enter.
+void epoch_exit(void);
+
+/// Releases a block once no thread can still be reading it.
+/// @param ptr Block to release.
+/// @param size Passed to release.
+/// @param release Function that frees the block.
+void epoch_retire(void *ptr, size_t size, epoch_release release);
+
+/// Releases every retired block right away.
+/// The caller must make sure no thread is between epoch_enter and epoch_exit.
+void epoch_reclaim_all(void);
+
+#endif  // KVS_EPOCH_H
@@ -1,136 +1,1238 @@
 #include "kvs.h"
+#include "slab.h"
+#include "epoch.h"
+#include "constants.h"
+#include "metrics.h"
 #include "string.h"
 
 #include <stdlib.h>
-#include <ctype.h>
 #include <pthread.h>
+#include <time.h>
 
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
-// @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of the project
-int hash(const char *key) {
-    int firstLetter = tolower(key[0]);
-    if (firstLetter >= 'a' && firstLetter <= 'z') {
-        return firstLetter - 'a';
-    } else if (firstLetter >= '0' && firstLetter <= '9') {
-        return firstLetter - '0';
+// FNV-1a, then the murmur3 finalizer.
+uint64_t hash_key(const char *key) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (const unsigned char *p = (const unsigned char *)key; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ULL;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static Stripe *stripe_of(HashTable *ht, uint64_t h) {
+    return &ht->stripes[h & (KVS_STRIPES - 1)];
+}
+
+// Bucket index inside a stripe. The stripe bits are dropped so that every
+// bucket of a stripe can be reached.
+static size_t bucket_of(uint64_t h, size_t mask) {
+    return (size_t)(h >> KVS_STRIPE_BITS) & mask;
+}
+
+// Returns the chain a key lives in. Buckets of the old array that were not
+// drained yet are still authoritative for their keys.
+static KeyNode **chain_of(Stripe *s, uint64_t h) {
+    if (s->old_buckets != NULL) {
+        size_t old_index = bucket_of(h, s->old_mask);
+        if (old_index >= s->migrated) {
+            return &s->old_buckets[old_index];
+        }
+    }
+
+    return &s->buckets[bucket_of(h, s->mask)];
+}
+
+static void release_array(void *ptr, size_t size) {
+    (void)size;
+    free(ptr);
+}
+
+static void release_node(void *ptr, size_t size) {
+    KeyNode *keyNode = ptr;
+    slab_free_string(keyNode->key);
+    slab_free_string(keyNode->value);
+    slab_free(keyNode, size);
+}
+
+// Frees a block right away, or once no optimistic reader can still see it.
+static void release(HashTable *ht, void *ptr, size_t size, epoch_release fn) {
+    if (ht->optimistic_reads) {
+        epoch_retire(ptr, size, fn);
+    } else {
+        fn(ptr, size);
+    }
+}
+
+// Moves up to `steps` buckets of the old array into the current one.
+// Must be called with the stripe write lock held.
+static void migrate_buckets(HashTable *ht, Stripe *s, size_t steps) {
+    while (s->old_buckets != NULL && steps-- > 0) {
+        KeyNode *keyNode = s->old_buckets[s->migrated];
+
+        while (keyNode != NULL) {
+            KeyNode *next = keyNode->next;
+            size_t index = bucket_of(keyNode->hash, s->mask);
+            keyNode->next = s->buckets[index];
+            s->buckets[index] = keyNode;
+            keyNode = next;
+        }
+
+        if (s->migrated++ == s->old_mask) {
+            KeyNode **old_buckets = s->old_buckets;
+            __atomic_store_n(&s->old_buckets, NULL, __ATOMIC_RELEASE);
+            release(ht, old_buckets, 0, release_array);
+        }
+    }
+}
+
+// Starts doubling the bucket array once the load factor is exceeded. Only
+// the allocation happens here; the chains are moved by later writes.
+static void maybe_grow(HashTable *ht, Stripe *s) {
+    if (s->count <= (s->mask + 1) * KVS_MAX_LOAD) {
+        return;
     }
-    return -1; 
+
+    if (s->old_buckets != NULL) {
+        migrate_buckets(ht, s, s->old_mask + 1);
+    }
+
+    size_t size = (s->mask + 1) * 2;
+    KeyNode **buckets = calloc(size, sizeof(KeyNode *));
+    if (!buckets) return;
+
+    // The mask is published after the array, so an optimistic reader that
+    // sees the new mask also sees the larger array.
+    s->old_mask = s->mask;
+    s->migrated = 0;
+    __atomic_store_n(&s->old_buckets, s->buckets, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->buckets, buckets, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->mask, size - 1, __ATOMIC_RELEASE);
+}
+
+// Inserts the pair or replaces the value of an existing key in a chained
+// stripe. Must be called with the stripe write lock held.
+static int chain_put(HashTable *ht, Stripe *s, uint64_t h, const char *key, const char *value, int *inserted) {
+    migrate_buckets(ht, s, KVS_MIGRATE_STEP);
+
+    KeyNode **chain = chain_of(s, h);
+    KeyNode *keyNode = *chain;
+
+    while (keyNode != NULL) {
+        if (keyNode->hash == h && strcmp(keyNode->key, key) == 0) {
+            // Values stay in their block while the size class does not change,
+            // unless optimistic readers may be copying it right now
+            size_t size = strlen(value) + 1;
+            size_t old_size = strlen(keyNode->value) + 1;
+            if (!ht->optimistic_reads && slab_capacity(size) == slab_capacity(old_size)) {
+                memcpy(keyNode->value, value, size);
+            } else {
+                char *copy = slab_strdup(value);
+                if (!copy) return 1;
+                char *old_value = keyNode->value;
+                __atomic_store_n(&keyNode->value, copy, __ATOMIC_RELEASE);
+                release(ht, old_value, old_size, slab_free);
+            }
+            *inserted = 0;
+            return 0;
+        }
+        keyNode = keyNode->next;
+    }
+
+    keyNode = slab_alloc(sizeof(KeyNode));
+    if (!keyNode) return 1;
+    keyNode->key = slab_strdup(key);
+    keyNode->value = slab_strdup(value);
+    if (!keyNode->key || !keyNode->value) {
+        slab_free_string(keyNode->key);
+        slab_free_string(keyNode->value);
+        slab_free(keyNode, sizeof(KeyNode));
+        return 1;
+    }
+    keyNode->hash = h;
+    keyNode->next = *chain;
+    __atomic_store_n(chain, keyNode, __ATOMIC_RELEASE);
+    *inserted = 1;
+    return 0;
+}
+
+static KeyNode *chain_find(Stripe *s, uint64_t h, const char *key) {
+    size_t walked = 0;
+    KeyNode *keyNode = *chain_of(s, h);
+
+    for (; keyNode != NULL; keyNode = keyNode->next) {
+        walked++;
+        if (keyNode->hash == h && strcmp(keyNode->key, key) == 0) {
+            break;
+        }
+    }
+    metrics_chain(walked);
+    return keyNode;
+}
+
+// Lock-free lookup used by optimistic reads. Copies the value and returns 1
+// if the key was found, 0 if not, and -1 if the value does not fit or the
+// chain is longer than the stripe (a writer relinked it meanwhile). The
+// result only counts if the stripe sequence number did not change.
+static int chain_peek(Stripe *s, uint64_t h, const char *key, char value[MAX_STRING_SIZE]) {
+    KeyNode **old_buckets = __atomic_load_n(&s->old_buckets, __ATOMIC_ACQUIRE);
+    KeyNode *keyNode;
+
+    if (old_buckets != NULL && bucket_of(h, s->old_mask) >= __atomic_load_n(&s->migrated, __ATOMIC_RELAXED)) {
+        keyNode = __atomic_load_n(&old_buckets[bucket_of(h, s->old_mask)], __ATOMIC_ACQUIRE);
+    } else {
+        size_t mask = __atomic_load_n(&s->mask, __ATOMIC_ACQUIRE);
+        KeyNode **buckets = __atomic_load_n(&s->buckets, __ATOMIC_ACQUIRE);
+        keyNode = __atomic_load_n(&buckets[bucket_of(h, mask)], __ATOMIC_ACQUIRE);
+    }
+
+    size_t limit = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+    for (size_t steps = 0; keyNode != NULL; steps++) {
+        if (steps > limit) {
+            return -1;
+        }
+        if (keyNode->hash == h && strcmp(keyNode->key, key) == 0) {
+            const char *stored = __atomic_load_n(&keyNode->value, __ATOMIC_ACQUIRE);
+            size_t length = strnlen(stored, MAX_STRING_SIZE);
+            if (length == MAX_STRING_SIZE) {
+                return -1;
+            }
+            memcpy(value, stored, length + 1);
+            return 1;
+        }
+        keyNode = __atomic_load_n(&keyNode->next, __ATOMIC_ACQUIRE);
+    }
+
+    return 0;
+}
+
+static int chain_remove(HashTable *ht, Stripe *s, uint64_t h, const char *key) {
+    migrate_buckets(ht, s, KVS_MIGRATE_STEP);
+
+    KeyNode **link = chain_of(s, h);
+
+    while (*link != NULL) {
+        KeyNode *keyNode = *link;
+        if (keyNode->hash == h && strcmp(keyNode->key, key) == 0) {
+            *link = keyNode->next;
+            release(ht, keyNode, sizeof(KeyNode), release_node);
+            return 0;
+        }
+        link = &keyNode->next;
+    }
+
+    return 1;
+}
+
+static void visit_buckets(KeyNode **buckets, size_t from, size_t to, pair_visitor visit, void *ctx) {
+    for (size_t i = from; i < to; i++) {
+        for (KeyNode *keyNode = buckets[i]; keyNode != NULL; keyNode = keyNode->next) {
+            visit(keyNode->key, keyNode->value, ctx);
+        }
+    }
+}
+
+static void chain_foreach(Stripe *s, pair_visitor visit, void *ctx) {
+    if (s->old_buckets != NULL) {
+        visit_buckets(s->old_buckets, s->migrated, s->old_mask + 1, visit, ctx);
+    }
+    visit_buckets(s->buckets, 0, s->mask + 1, visit, ctx);
+}
+
+static void free_buckets(KeyNode **buckets, size_t from, size_t to) {
+    for (size_t i = from; i < to; i++) {
+        KeyNode *keyNode = buckets[i];
+        while (keyNode != NULL) {
+            KeyNode *temp = keyNode;
+            keyNode = keyNode->next;
+            release_node(temp, sizeof(KeyNode));
+        }
+    }
+    free(buckets);
+}
+
+static void chain_free(Stripe *s) {
+    if (s->old_buckets != NULL) {
+        free_buckets(s->old_buckets, s->migrated, s->old_mask + 1);
+    }
+    free_buckets(s->buckets, 0, s->mask + 1);
+}
+
+static int chain_init(Stripe *s) {
+    s->buckets = calloc(KVS_INITIAL_BUCKETS, sizeof(KeyNode *));
+    if (!s->buckets) return 1;
+    s->mask = KVS_INITIAL_BUCKETS - 1;
+    s->old_buckets = NULL;
+    s->old_mask = 0;
+    s->migrated = 0;
+    return 0;
 }
 
-// Added a read-write lock for each keynode on the hashTable
 struct HashTable* create_hash_table() {
-    HashTable *ht = malloc(sizeof(HashTable));
+    TableOptions options = {KVS_DEFAULT_ENGINE, KVS_DEFAULT_OPTIMISTIC_READS};
+    return create_hash_table_with(&options);
+}
+
+// Added a read-write lock for each stripe on the hashTable
+struct HashTable* create_hash_table_with(const TableOptions *options) {
+    HashTable *ht = aligned_alloc(_Alignof(HashTable), sizeof(HashTable));
     if (!ht) return NULL;
+    enum TableEngine engine = options->engine;
+    ht->engine = engine;
+    ht->optimistic_reads = options->optimistic_reads;
 
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        ht->table[i] = NULL;
-        pthread_rwlock_init(&ht->locks[i], NULL); 
+    for (int i = 0; i < KVS_STRIPES; i++) {
+        Stripe *s = &ht->stripes[i];
+        int failed = engine == ENGINE_OPEN ? slots_init(&s->slots, ht->optimistic_reads) : chain_init(s);
+        if (failed) {
+            while (i-- > 0) {
+                if (engine == ENGINE_OPEN) {
+                    slots_free(&ht->stripes[i].slots);
+                } else {
+                    chain_free(&ht->stripes[i]);
+                }
+                pthread_rwlock_destroy(&ht->stripes[i].lock);
+#ifdef KVS_LOCK_PROFILE
+                pthread_mutex_destroy(&ht->stripes[i].profile.keys_lock);
+#endif
+            }
+            free(ht);
+            return NULL;
+        }
+        s->count = 0;
+        s->seq = 0;
+        s->pending = 0;
+        memset(&s->subs, 0, sizeof(s->subs));
+        pthread_rwlock_init(&s->lock, NULL);
+#ifdef KVS_LOCK_PROFILE
+        memset(&s->profile, 0, sizeof(s->profile));
+        s->profile.index = i;
+        pthread_mutex_init(&s->profile.keys_lock, NULL);
+#endif
     }
 
+    pthread_mutex_init(&ht->snapshots_lock, NULL);
+    ht->snapshot_slots = 0;
+    ht->log = NULL;
+    ht->log_ctx = NULL;
+    ht->notify = NULL;
+    ht->watched = 0;
+
     return ht;
 }
 
+// Writers make the stripe sequence number odd while they modify the stripe,
+// so optimistic readers can tell their copy may be torn.
+static void write_begin(Stripe *s) {
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(Stripe *s) {
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+_Static_assert(KVS_STRIPES <= 64, "stripe sets are 64-bit masks");
+_Static_assert(KVS_MAX_SNAPSHOTS <= 64, "pending snapshots are 64-bit masks");
+
+// Adds `size` bytes to the strings of a saved set. Returns their offset, or
+// SIZE_MAX if they could not be allocated.
+static size_t saved_string(SavedPairs *saved, const char *string, size_t size) {
+    if (saved->len + size > saved->capacity) {
+        size_t capacity = saved->capacity ? saved->capacity * 2 : 256;
+        while (capacity < saved->len + size) {
+            capacity *= 2;
+        }
+        char *strings = realloc(saved->strings, capacity);
+        if (!strings) return SIZE_MAX;
+        saved->strings = strings;
+        saved->capacity = capacity;
+    }
+
+    size_t offset = saved->len;
+    memcpy(saved->strings + offset, string, size);
+    saved->len += size;
+    return offset;
+}
+
+static SavedPair *saved_find(const SavedPairs *saved, uint64_t h, const char *key) {
+    if (saved->count == 0) return NULL;
+
+    for (size_t i = (size_t)h & saved->mask;; i = (i + 1) & saved->mask) {
+        SavedPair *pair = &saved->slots[i];
+        if (!pair->used) return NULL;
+        if (pair->hash == h && strcmp(saved->strings + pair->key, key) == 0) return pair;
+    }
+}
+
+// Doubles the slots of a saved set, keeping it at most half full.
+static int saved_grow(SavedPairs *saved) {
+    size_t size = saved->slots ? (saved->mask + 1) * 2 : 16;
+    SavedPair *slots = calloc(size, sizeof(SavedPair));
+    if (!slots) return 1;
+
+    for (size_t i = 0; saved->slots && i <= saved->mask; i++) {
+        if (!saved->slots[i].used) continue;
+        size_t j = (size_t)saved->slots[i].hash & (size - 1);
+        while (slots[j].used) {
+            j = (j + 1) & (size - 1);
+        }
+        slots[j] = saved->slots[i];
+    }
+
+    free(saved->slots);
+    saved->slots = slots;
+    saved->mask = size - 1;
+    return 0;
+}
+
+// Records the value a key had when the snapshot was taken; `value` is NULL
+// if the key did not exist.
+static int saved_add(SavedPairs *saved, uint64_t h, const char *key, const char *value) {
+    if ((saved->count + 1) * 2 > (saved->slots ? saved->mask + 1 : 0) && saved_grow(saved)) return 1;
+
+    SavedPair pair = {h, 0, 0, 1, value != NULL};
+    pair.key = saved_string(saved, key, strlen(key) + 1);
+    if (pair.key == SIZE_MAX) return 1;
+    if (value != NULL) {
+        pair.value = saved_string(saved, value, strlen(value) + 1);
+        if (pair.value == SIZE_MAX) return 1;
+    }
+
+    size_t i = (size_t)h & saved->mask;
+    while (saved->slots[i].used) {
+        i = (i + 1) & saved->mask;
+    }
+    saved->slots[i] = pair;
+    saved->count++;
+    return 0;
+}
+
+static void saved_free(SavedPairs *saved) {
+    free(saved->slots);
+    free(saved->strings);
+    *saved = (SavedPairs){NULL, 0, 0, NULL, 0, 0};
+}
+
+typedef struct CopyContext {
+    StripeCopy *copy;
+    const SavedPairs *skip;
+    int failed;
+} CopyContext;
+
+static void copy_pair(const char *key, const char *value, void *ctx) {
+    CopyContext *c = ctx;
+    StripeCopy *copy = c->copy;
+    size_t key_size = strlen(key) + 1;
+    size_t value_size = strlen(value) + 1;
+    size_t needed = copy->len + key_size + value_size;
+
+    if (c->failed) return;
+    if (c->skip != NULL && saved_find(c->skip, hash_key(key), key) != NULL) return;
+
+    if (needed > copy->capacity) {
+        size_t capacity = copy->capacity ? copy->capacity * 2 : 1024;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char *pairs = realloc(copy->pairs, capacity);
+        if (!pairs) {
+            c->failed = 1;
+            return;
+        }
+        copy->pairs = pairs;
+        copy->capacity = capacity;
+    }
+
+    memcpy(copy->pairs + copy->len, key, key_size);
+    memcpy(copy->pairs + copy->len + key_size, value, value_size);
+    copy->len = needed;
+}
+
+// Copies every pair of a stripe, except the keys in `skip` if it has any.
+// Must be called with the stripe locked.
+static int copy_stripe(HashTable *ht, Stripe *s, const SavedPairs *skip, StripeCopy *copy) {
+    CopyContext c = {copy, skip->count != 0 ? skip : NULL, 0};
+    copy->len = 0;
+
+    if (ht->engine == ENGINE_OPEN) {
+        slots_foreach(&s->slots, copy_pair, &c);
+    } else {
+        chain_foreach(s, copy_pair, &c);
+    }
+
+    return c.failed;
+}
+
+static void visit_copy(const StripeCopy *copy, pair_visitor visit, void *ctx) {
+    size_t pos = 0;
+    while (pos < copy->len) {
+        const char *key = copy->pairs + pos;
+        pos += strlen(key) + 1;
+        const char *value = copy->pairs + pos;
+        pos += strlen(value) + 1;
+        visit(key, value, ctx);
+    }
+}
+
+// Set of stripes used by a batch of keys. Walking its bits from the lowest
+// visits the stripes in ascending order, which is the order every caller
+// that holds more than one stripe lock acquires them in.
+static uint64_t stripes_of(size_t count, const uint64_t hashes[]) {
+    uint64_t set = 0;
+    for (size_t i = 0; i < count; i++) {
+        set |= (uint64_t)1 << (hashes[i] & (KVS_STRIPES - 1));
+    }
+    return set;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+#ifdef KVS_LOCK_PROFILE
+// When the calling thread took each stripe lock it holds. A thread holds
+// the locks of one table at a time.
+static _Thread_local uint64_t held_since[KVS_STRIPES];
+
+// Counts the keys used on their stripes, keeping the most used ones.
+static void profile_keys(HashTable *ht, size_t count, const char *const keys[], const uint64_t hashes[]) {
+    for (size_t k = 0; k < count; k++) {
+        LockProfile *p = &stripe_of(ht, hashes[k])->profile;
+        pthread_mutex_lock(&p->keys_lock);
+
+        ProfiledKey *least = &p->keys[0];
+        ProfiledKey *found = NULL;
+        for (int i = 0; i < KVS_PROFILE_KEYS && found == NULL; i++) {
+            if (p->keys[i].hits > 0 && strcmp(p->keys[i].key, keys[k]) == 0) {
+                found = &p->keys[i];
+            } else if (p->keys[i].hits < least->hits) {
+                least = &p->keys[i];
+            }
+        }
+
+        if (found != NULL) {
+            found->hits++;
+        } else {
+            size_t length = strnlen(keys[k], MAX_STRING_SIZE - 1);
+            memcpy(least->key, keys[k], length);
+            least->key[length] = '\0';
+            least->hits++;
+        }
+        pthread_mutex_unlock(&p->keys_lock);
+    }
+}
+#else
+#define profile_keys(ht, count, keys, hashes) ((void)0)
+#endif
+
+// Takes the lock of a stripe. While metrics are recorded, or in a lock
+// profiling build, a lock that is not free right away is timed; a free one
+// costs no clock read.
+static void stripe_lock(Stripe *s, int exclusive) {
+#ifndef KVS_LOCK_PROFILE
+    if (!metrics_on()) {
+        if (exclusive) {
+            pthread_rwlock_wrlock(&s->lock);
+        } else {
+            pthread_rwlock_rdlock(&s->lock);
+        }
+        return;
+    }
+#endif
+
+    uint64_t wait = 0;
+    if ((exclusive ? pthread_rwlock_trywrlock(&s->lock) : pthread_rwlock_tryrdlock(&s->lock)) != 0) {
+        uint64_t start = now_ns();
+        if (exclusive) {
+            pthread_rwlock_wrlock(&s->lock);
+        } else {
+            pthread_rwlock_rdlock(&s->lock);
+        }
+        wait = now_ns() - start;
+        if (wait == 0) wait = 1;
+    }
+    metrics_lock(wait);
+
+#ifdef KVS_LOCK_PROFILE
+    LockProfile *p = &s->profile;
+    __atomic_fetch_add(&p->taken[exclusive], 1, __ATOMIC_RELAXED);
+    if (wait > 0) {
+        __atomic_fetch_add(&p->contended[exclusive], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&p->wait_ns[exclusive], wait, __ATOMIC_RELAXED);
+    }
+    held_since[p->index] = now_ns();
+#endif
+}
+
+static void stripe_unlock(Stripe *s, int exclusive) {
+#ifdef KVS_LOCK_PROFILE
+    uint64_t held = now_ns() - held_since[s->profile.index];
+    __atomic_fetch_add(&s->profile.held_ns[exclusive], held, __ATOMIC_RELAXED);
+#else
+    (void)exclusive;
+#endif
+    pthread_rwlock_unlock(&s->lock);
+}
+
+static void lock_stripes(HashTable *ht, uint64_t set, int exclusive) {
+    for (int i = 0; i < KVS_STRIPES; i++) {
+        if ((set >> i) & 1) {
+            stripe_lock(&ht->stripes[i], exclusive);
+            if (exclusive) {
+                write_begin(&ht->stripes[i]);
+            }
+        }
+    }
+}
+
+static void unlock_stripes(HashTable *ht, uint64_t set, int exclusive) {
+    for (int i = KVS_STRIPES - 1; i >= 0; i--) {
+        if ((set >> i) & 1) {
+            if (exclusive) {
+                write_end(&ht->stripes[i]);
+            }
+            stripe_unlock(&ht->stripes[i], exclusive);
+        }
+    }
+}
+
+// Must be called with the stripe read or write lock held.
+static const char *find_locked(HashTable *ht, Stripe *s, uint64_t h, const char *key) {
+    if (ht->engine == ENGINE_OPEN) {
+        Slot *slot = slots_find(&s->slots, h, key);
+        return slot != NULL ? slot->value : NULL;
+    }
+
+    KeyNode *keyNode = chain_find(s, h, key);
+    return keyNode != NULL ? keyNode->value : NULL;
+}
+
+// Saves the value of a key about to change for every snapshot that has not
+// read the stripe yet, unless an earlier write saved it already. Must be
+// called with the stripe write lock held.
+static void save_pending(HashTable *ht, Stripe *s, uint64_t h, const char *key) {
+    uint64_t pending = __atomic_load_n(&s->pending, __ATOMIC_RELAXED);
+    size_t index = (size_t)(s - ht->stripes);
+    const char *value = NULL;
+    int found = 0;
+
+    while (pending != 0) {
+        TableSnapshot *snap = ht->snapshots[__builtin_ctzll(pending)];
+        SavedPairs *saved = &snap->saved[index];
+        if (saved_find(saved, h, key) == NULL) {
+            if (!found) {
+                value = find_locked(ht, s, h, key);
+                found = 1;
+            }
+            if (saved_add(saved, h, key, value)) {
+                __atomic_store_n(&snap->failed, 1, __ATOMIC_RELAXED);
+            }
+        }
+        pending &= pending - 1;
+    }
+}
+
+// Must be called with the stripe write lock held.
+static int put_locked(HashTable *ht, Stripe *s, uint64_t h, const char *key, const char *value) {
+    int inserted = 0;
+    int result;
+
+    if (__atomic_load_n(&s->pending, __ATOMIC_RELAXED) != 0) {
+        save_pending(ht, s, h, key);
+    }
+
+    if (ht->engine == ENGINE_OPEN) {
+        result = slots_put(&s->slots, h, key, value, &inserted);
+    } else {
+        result = chain_put(ht, s, h, key, value, &inserted);
+    }
+
+    if (inserted) {
+        s->count++;
+        if (ht->engine == ENGINE_CHAINED) {
+            maybe_grow(ht, s);
+        }
+    }
+
+    return result;
+}
+
+// Must be called with the stripe write lock held.
+static int remove_locked(HashTable *ht, Stripe *s, uint64_t h, const char *key) {
+    int result;
+
+    if (__atomic_load_n(&s->pending, __ATOMIC_RELAXED) != 0) {
+        save_pending(ht, s, h, key);
+    }
+
+    if (ht->engine == ENGINE_OPEN) {
+        result = slots_remove(&s->slots, h, key);
+    } else {
+        result = chain_remove(ht, s, h, key);
+    }
+
+    if (result == 0) {
+        s->count--;
+    }
+
+    return result;
+}
+
+// Reads keys without touching the stripe locks: the lookups are retried
+// until no writer ran on any of the stripes involved, so the values seen
+// are those of a single instant. Only the calling thread's epoch record is
+// written. Returns the number of missing keys, or -1 when the caller should
+// fall back to the read locks.
+static int read_optimistic(HashTable *ht, size_t count, const char *const keys[], const uint64_t hashes[],
+                           uint64_t set, pair_visitor visit, void *ctx, int report_missing) {
+    char values[count][MAX_STRING_SIZE];
+    int found[count];
+    unsigned seqs[KVS_STRIPES];
+    int valid = 0;
+
+    epoch_enter();
+    for (int attempt = 0; attempt < KVS_OPTIMISTIC_RETRIES && !valid; attempt++) {
+        valid = 1;
+
+        for (int i = 0; i < KVS_STRIPES && valid; i++) {
+            if ((set >> i) & 1) {
+                seqs[i] = __atomic_load_n(&ht->stripes[i].seq, __ATOMIC_ACQUIRE);
+                valid = (seqs[i] & 1) == 0;
+            }
+        }
+
+        for (size_t k = 0; k < count && valid; k++) {
+            Stripe *s = stripe_of(ht, hashes[k]);
+            if (ht->engine == ENGINE_OPEN) {
+                found[k] = slots_peek(&s->slots, hashes[k], keys[k], values[k]);
+            } else {
+                found[k] = chain_peek(s, hashes[k], keys[k], values[k]);
+            }
+            valid = found[k] >= 0;
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        for (int i = 0; i < KVS_STRIPES && valid; i++) {
+            if ((set >> i) & 1) {
+                valid = __atomic_load_n(&ht->stripes[i].seq, __ATOMIC_RELAXED) == seqs[i];
+            }
+        }
+    }
+    epoch_exit();
+
+    if (!valid) {
+        return -1;
+    }
+
+    int missing = 0;
+    for (size_t k = 0; k < count; k++) {
+        if (found[k]) {
+            visit(keys[k], values[k], ctx);
+        } else {
+            missing++;
+            if (report_missing) visit(keys[k], NULL, ctx);
+        }
+    }
+    return missing;
+}
+
+static int read_batch(HashTable *ht, size_t count, const char *const keys[], pair_visitor visit, void *ctx,
+                      int report_missing) {
+    if (count == 0) return 0;
+
+    uint64_t hashes[count];
+    for (size_t k = 0; k < count; k++) {
+        hashes[k] = hash_key(keys[k]);
+    }
+    uint64_t set = stripes_of(count, hashes);
+    profile_keys(ht, count, keys, hashes);
+
+    if (ht->optimistic_reads && count <= KVS_OPTIMISTIC_BATCH) {
+        int missing = read_optimistic(ht, count, keys, hashes, set, visit, ctx, report_missing);
+        if (missing >= 0) {
+            return missing;
+        }
+    }
+
+    int missing = 0;
+    lock_stripes(ht, set, 0);
+    for (size_t k = 0; k < count; k++) {
+        const char *value = find_locked(ht, stripe_of(ht, hashes[k]), hashes[k], keys[k]);
+        if (value != NULL) {
+            visit(keys[k], value, ctx);
+        } else {
+            missing++;
+            if (report_missing) visit(keys[k], NULL, ctx);
+        }
+    }
+    unlock_stripes(ht, set, 0);
+
+    return missing;
+}
+
+// Hands the keys a batch changed to their subscribers, in batch order. Must
+// be called with the stripes of the keys write-locked; only reached while
+// some key of the table has subscribers.
+static void notify_locked(HashTable *ht, size_t count, const char *const keys[], const uint64_t hashes[],
+                          const char *const values[], const int results[]) {
+    if (ht->notify == NULL) return;
+
+    for (size_t k = 0; k < count; k++) {
+        if (results[k] != 0) continue;
+        const Watched *w = subs_find(&stripe_of(ht, hashes[k])->subs, hashes[k], keys[k]);
+        if (w == NULL) continue;
+        for (size_t i = 0; i < w->count; i++) {
+            ht->notify(w->subscribers[i], keys[k], values != NULL ? values[k] : NULL);
+        }
+    }
+}
+
+// Hands a batch to the change logger, leaving out the keys it did not
+// change: replay must not apply a write the table rejected. Must be called
+// with the stripes of the keys write-locked, so the log keeps their order.
+static void log_changes(HashTable *ht, enum ChangeKind kind, size_t count, const char *const keys[],
+                        const char *const values[], const int results[], int all_applied) {
+    if (all_applied) {
+        ht->log(ht->log_ctx, kind, count, keys, values);
+        return;
+    }
+
+    const char *applied_keys[count];
+    const char *applied_values[count];
+    size_t applied = 0;
+    for (size_t k = 0; k < count; k++) {
+        if (results[k] != 0) continue;
+        applied_keys[applied] = keys[k];
+        applied_values[applied] = values != NULL ? values[k] : NULL;
+        applied++;
+    }
+    if (applied > 0) {
+        ht->log(ht->log_ctx, kind, applied, applied_keys, values != NULL ? applied_values : NULL);
+    }
+}
+
+int write_pairs(HashTable *ht, size_t count, const char *const keys[], const char *const values[], int results[]) {
+    if (count == 0) return 0;
+
+    uint64_t hashes[count];
+    for (size_t k = 0; k < count; k++) {
+        hashes[k] = hash_key(keys[k]);
+    }
+    uint64_t set = stripes_of(count, hashes);
+    int failed = 0;
+    int local[count];
+    if (results == NULL) results = local;
+    profile_keys(ht, count, keys, hashes);
+
+    lock_stripes(ht, set, 1);
+    for (size_t k = 0; k < count; k++) {
+        results[k] = put_locked(ht, stripe_of(ht, hashes[k]), hashes[k], keys[k], values[k]);
+        failed |= results[k];
+    }
+    if (ht->log != NULL) {
+        log_changes(ht, CHANGE_WRITE, count, keys, values, results, !failed);
+    }
+    if (__atomic_load_n(&ht->watched, __ATOMIC_RELAXED) != 0) {
+        notify_locked(ht, count, keys, hashes, values, results);
+    }
+    unlock_stripes(ht, set, 1);
+
+    return failed;
+}
+
+int delete_pairs(HashTable *ht, size_t count, const char *const keys[], int results[]) {
+    if (count == 0) return 0;
+
+    uint64_t hashes[count];
+    for (size_t k = 0; k < count; k++) {
+        hashes[k] = hash_key(keys[k]);
+    }
+    uint64_t set = stripes_of(count, hashes);
+    int missing = 0;
+    int local[count];
+    if (results == NULL) results = local;
+    profile_keys(ht, count, keys, hashes);
+
+    lock_stripes(ht, set, 1);
+    for (size_t k = 0; k < count; k++) {
+        results[k] = remove_locked(ht, stripe_of(ht, hashes[k]), hashes[k], keys[k]);
+        missing += results[k];
+    }
+    if (ht->log != NULL) {
+        log_changes(ht, CHANGE_DELETE, count, keys, NULL, results, missing == 0);
+    }
+    if (__atomic_load_n(&ht->watched, __ATOMIC_RELAXED) != 0) {
+        notify_locked(ht, count, keys, hashes, NULL, results);
+    }
+    unlock_stripes(ht, set, 1);
+
+    return missing;
+}
+
+int read_pairs(HashTable *ht, size_t count, const char *const keys[], pair_visitor visit, void *ctx) {
+    return read_batch(ht, count, keys, visit, ctx, 1);
+}
+
 // Read-write Locks and Unlocks added to critical zones
 int write_pair(HashTable *ht, const char *key, const char *value) {
-    int index = hash(key);
-    pthread_rwlock_wrlock(&ht->locks[index]); 
+    return write_pairs(ht, 1, &key, &value, NULL);
+}
 
-    KeyNode *keyNode = ht->table[index];
+int read_pair_with(HashTable *ht, const char *key, pair_visitor visit, void *ctx) {
+    return read_batch(ht, 1, &key, visit, ctx, 0);
+}
 
-    
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            free(keyNode->value);
-            keyNode->value = strdup(value);
-            pthread_rwlock_unlock(&ht->locks[index]);
-            return 0;
+static void copy_value(const char *key, const char *value, void *ctx) {
+    (void)key;
+    *(char **)ctx = strdup(value);
+}
+
+// Kept for callers that need to own the value; allocates a copy.
+char* read_pair(HashTable *ht, const char *key) {
+    char *value = NULL;
+    read_pair_with(ht, key, copy_value, &value);
+    return value;
+}
+
+int delete_pair(HashTable *ht, const char *key) {
+    return delete_pairs(ht, 1, &key, NULL);
+}
+
+void foreach_pair(HashTable *ht, pair_visitor visit, void *ctx) {
+    for (int i = 0; i < KVS_STRIPES; i++) {
+        Stripe *s = &ht->stripes[i];
+        stripe_lock(s, 0);
+
+        if (ht->engine == ENGINE_OPEN) {
+            slots_foreach(&s->slots, visit, ctx);
+        } else {
+            chain_foreach(s, visit, ctx);
         }
-        keyNode = keyNode->next;
+
+        stripe_unlock(s, 0);
     }
+}
 
-    
-    keyNode = malloc(sizeof(KeyNode));
-    keyNode->key = strdup(key); 
-    keyNode->value = strdup(value); 
-    keyNode->next = ht->table[index];
-    ht->table[index] = keyNode; 
+// Fills an empty chained stripe. The bucket array is sized for every key up
+// front, so no migration starts, and keys are pushed without being looked up.
+static int chain_load(Stripe *s, size_t count, const uint64_t hashes[], const char *const keys[],
+                      const char *const values[]) {
+    size_t size = s->mask + 1;
+    while (count > size * KVS_MAX_LOAD) {
+        size *= 2;
+    }
+    if (size != s->mask + 1) {
+        KeyNode **buckets = calloc(size, sizeof(KeyNode *));
+        if (!buckets) return 1;
+        free(s->buckets);
+        s->buckets = buckets;
+        s->mask = size - 1;
+    }
 
-    pthread_rwlock_unlock(&ht->locks[index]);
+    for (size_t k = 0; k < count; k++) {
+        KeyNode *keyNode = slab_alloc(sizeof(KeyNode));
+        if (!keyNode) return 1;
+        keyNode->key = slab_strdup(keys[k]);
+        keyNode->value = slab_strdup(values[k]);
+        if (!keyNode->key || !keyNode->value) {
+            slab_free_string(keyNode->key);
+            slab_free_string(keyNode->value);
+            slab_free(keyNode, sizeof(KeyNode));
+            return 1;
+        }
+        keyNode->hash = hashes[k];
+        KeyNode **chain = &s->buckets[bucket_of(hashes[k], s->mask)];
+        keyNode->next = *chain;
+        *chain = keyNode;
+        s->count++;
+    }
     return 0;
 }
 
-char* read_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    pthread_rwlock_rdlock(&ht->locks[index]);
+int load_stripe(HashTable *ht, int stripe, size_t count, const char *const keys[], const char *const values[]) {
+    if (count == 0) return 0;
 
-    KeyNode *keyNode = ht->table[index];
-    char* value;
+    Stripe *s = &ht->stripes[stripe];
+    uint64_t *hashes = malloc(count * sizeof(uint64_t));
+    if (!hashes) return 1;
 
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
-            pthread_rwlock_unlock(&ht->locks[index]); 
-            return value; 
+    for (size_t k = 0; k < count; k++) {
+        hashes[k] = hash_key(keys[k]);
+        if (stripe_of(ht, hashes[k]) != s) {
+            // The pairs were stored by a table with other stripes
+            free(hashes);
+            return 1;
         }
-        keyNode = keyNode->next; 
     }
 
-    pthread_rwlock_unlock(&ht->locks[index]); 
-    return NULL; 
+    int failed = 0;
+    if (s->count != 0) {
+        for (size_t k = 0; k < count; k++) {
+            failed |= write_pair(ht, keys[k], values[k]);
+        }
+    } else if (ht->engine == ENGINE_OPEN) {
+        failed = slots_load(&s->slots, count, hashes, keys, values);
+        s->count = s->slots.count;
+    } else {
+        failed = chain_load(s, count, hashes, keys, values);
+    }
+
+    free(hashes);
+    return failed;
 }
 
-int delete_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    pthread_rwlock_wrlock(&ht->locks[index]); 
+void set_change_logger(HashTable *ht, change_logger log, void *ctx) {
+    ht->log_ctx = ctx;
+    ht->log = log;
+}
 
-    KeyNode *keyNode = ht->table[index];
-    KeyNode *prevNode = NULL;
+void set_change_notifier(HashTable *ht, change_notifier notify) {
+    ht->notify = notify;
+}
 
-    
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            
-            if (prevNode == NULL) {
-                
-                ht->table[index] = keyNode->next; 
-            } else {
-                
-                prevNode->next = keyNode->next; 
+// Subscriptions change the index only, so they take the write lock without
+// marking the stripe as modified for optimistic readers and snapshots.
+int subscribe_key(HashTable *ht, const char *key, void *subscriber, pair_visitor visit, void *ctx) {
+    uint64_t h = hash_key(key);
+    Stripe *s = stripe_of(ht, h);
+    int watched;
+
+    stripe_lock(s, 1);
+    int failed = subs_add(&s->subs, h, key, subscriber, &watched);
+    if (watched) {
+        __atomic_fetch_add(&ht->watched, 1, __ATOMIC_RELAXED);
+    }
+    visit(key, find_locked(ht, s, h, key), ctx);
+    stripe_unlock(s, 1);
+
+    return failed;
+}
+
+int unsubscribe_key(HashTable *ht, const char *key, void *subscriber) {
+    uint64_t h = hash_key(key);
+    Stripe *s = stripe_of(ht, h);
+    int unwatched;
+
+    stripe_lock(s, 1);
+    int missing = subs_remove(&s->subs, h, key, subscriber, &unwatched);
+    if (unwatched) {
+        __atomic_fetch_sub(&ht->watched, 1, __ATOMIC_RELAXED);
+    }
+    stripe_unlock(s, 1);
+
+    return missing;
+}
+
+TableSnapshot *snapshot_table(HashTable *ht) {
+    TableSnapshot *snap = calloc(1, sizeof(TableSnapshot));
+    if (!snap) return NULL;
+
+    pthread_mutex_lock(&ht->snapshots_lock);
+    if (ht->snapshot_slots == UINT64_MAX) {
+        pthread_mutex_unlock(&ht->snapshots_lock);
+        free(snap);
+        return NULL;
+    }
+    snap->slot = __builtin_ctzll(~ht->snapshot_slots);
+    ht->snapshot_slots |= (uint64_t)1 << snap->slot;
+    ht->snapshots[snap->slot] = snap;
+    pthread_mutex_unlock(&ht->snapshots_lock);
+
+    // With every stripe read-locked no batch is half applied, so the bits
+    // set here mark the same instant in all stripes
+    lock_table(ht);
+    for (int i = 0; i < KVS_STRIPES; i++) {
+        __atomic_fetch_or(&ht->stripes[i].pending, (uint64_t)1 << snap->slot, __ATOMIC_RELAXED);
+        snap->versions[i] = ht->stripes[i].seq;
+    }
+    unlock_table(ht);
+
+    return snap;
+}
+
+// Visits one stripe of a snapshot, copied into `scratch` so that visit runs
+// without the lock.
+static int snapshot_visit(HashTable *ht, TableSnapshot *snap, int stripe, StripeCopy *scratch, pair_visitor visit,
+                          void *ctx) {
+    uint64_t bit = (uint64_t)1 << snap->slot;
+    Stripe *s = &ht->stripes[stripe];
+    SavedPairs *saved = &snap->saved[stripe];
+
+    // The keys nobody saved still have their value from the snapshot; the
+    // saved ones are put back as they were
+    scratch->len = 0;
+    stripe_lock(s, 0);
+    if (__atomic_load_n(&s->pending, __ATOMIC_RELAXED) & bit) {
+        CopyContext c = {scratch, NULL, copy_stripe(ht, s, saved, scratch)};
+        for (size_t i = 0; saved->count != 0 && i <= saved->mask; i++) {
+            const SavedPair *pair = &saved->slots[i];
+            if (pair->used && pair->existed) {
+                copy_pair(saved->strings + pair->key, saved->strings + pair->value, &c);
             }
-            
-            free(keyNode->key);
-            free(keyNode->value);
-            free(keyNode); 
+        }
+        if (c.failed) {
+            __atomic_store_n(&snap->failed, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_and(&s->pending, ~bit, __ATOMIC_RELAXED);
+    }
+    stripe_unlock(s, 0);
 
-            pthread_rwlock_unlock(&ht->locks[index]); 
-            return 0;
+    // With the bit cleared no writer adds to the saved pairs anymore
+    saved_free(saved);
+    visit_copy(scratch, visit, ctx);
+
+    return __atomic_load_n(&snap->failed, __ATOMIC_RELAXED);
+}
+
+int snapshot_stripe(HashTable *ht, TableSnapshot *snap, int stripe, pair_visitor visit, void *ctx) {
+    StripeCopy scratch = {NULL, 0, 0};
+    int failed = snapshot_visit(ht, snap, stripe, &scratch, visit, ctx);
+    free(scratch.pairs);
+    return failed;
+}
+
+int snapshot_foreach(HashTable *ht, TableSnapshot *snap, pair_visitor visit, void *ctx) {
+    StripeCopy scratch = {NULL, 0, 0};
+    int failed = 0;
+
+    for (int i = 0; i < KVS_STRIPES; i++) {
+        failed = snapshot_visit(ht, snap, i, &scratch, visit, ctx);
+    }
+
+    free(scratch.pairs);
+    return failed;
+}
+
+void snapshot_release(HashTable *ht, TableSnapshot *snap) {
+    uint64_t bit = (uint64_t)1 << snap->slot;
+
+    // Taking each lock also waits for a writer that may be saving a key
+    // into this snapshot
+    for (int i = 0; i < KVS_STRIPES; i++) {
+        Stripe *s = &ht->stripes[i];
+        stripe_lock(s, 0);
+        __atomic_fetch_and(&s->pending, ~bit, __ATOMIC_RELAXED);
+        stripe_unlock(s, 0);
+        saved_free(&snap->saved[i]);
+    }
+
+    pthread_mutex_lock(&ht->snapshots_lock);
+    ht->snapshot_slots &= ~bit;
+    ht->snapshots[snap->slot] = NULL;
+    pthread_mutex_unlock(&ht->snapshots_lock);
+
+    free(snap);
+}
+
+void lock_table(HashTable *ht) {
+    for (int i = 0; i < KVS_STRIPES; i++) {
+        stripe_lock(&ht->stripes[i], 0);
+    }
+}
+
+void unlock_table(HashTable *ht) {
+    for (int i = KVS_STRIPES - 1; i >= 0; i--) {
+        stripe_unlock(&ht->stripes[i], 0);
+    }
+}
+
+#ifdef KVS_LOCK_PROFILE
+static uint64_t profile_wait(const LockProfile *p) {
+    return p->wait_ns[0] + p->wait_ns[1];
+}
+
+void lock_profile_report(HashTable *ht, FILE *out, int top) {
+    const LockProfile *order[KVS_STRIPES];
+    uint64_t taken[2] = {0, 0};
+    uint64_t contended[2] = {0, 0};
+    uint64_t wait[2] = {0, 0};
+
+    // Longest waited for first, then most taken
+    for (int i = 0; i < KVS_STRIPES; i++) {
+        const LockProfile *p = &ht->stripes[i].profile;
+        for (int m = 0; m < 2; m++) {
+            taken[m] += p->taken[m];
+            contended[m] += p->contended[m];
+            wait[m] += p->wait_ns[m];
         }
-        prevNode = keyNode; 
-        keyNode = keyNode->next; 
+
+        int j = i;
+        while (j > 0 && (profile_wait(order[j - 1]) < profile_wait(p) ||
+                         (profile_wait(order[j - 1]) == profile_wait(p) &&
+                          order[j - 1]->taken[0] + order[j - 1]->taken[1] < p->taken[0] + p->taken[1]))) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = p;
     }
 
-    pthread_rwlock_unlock(&ht->locks[index]); 
-    return 1;
+    fprintf(out, "lock profile: %llu read locks (%llu contended, %.3f ms waited), "
+                 "%llu write locks (%llu contended, %.3f ms waited)\n",
+            (unsigned long long)taken[0], (unsigned long long)contended[0], (double)wait[0] / 1e6,
+            (unsigned long long)taken[1], (unsigned long long)contended[1], (double)wait[1] / 1e6);
+    fprintf(out, "%6s %10s %9s %10s %10s %10s %9s %10s %10s  %s\n", "stripe", "reads", "contended", "wait_ms",
+            "held_ms", "writes", "contended", "wait_ms", "held_ms", "hottest keys");
+
+    for (int n = 0; n < top && n < KVS_STRIPES; n++) {
+        const LockProfile *p = order[n];
+        if (p->taken[0] + p->taken[1] == 0) {
+            break;
+        }
+        fprintf(out, "%6d %10llu %9llu %10.3f %10.3f %10llu %9llu %10.3f %10.3f ", p->index,
+                (unsigned long long)p->taken[0], (unsigned long long)p->contended[0], (double)p->wait_ns[0] / 1e6,
+                (double)p->held_ns[0] / 1e6, (unsigned long long)p->taken[1], (unsigned long long)p->contended[1],
+                (double)p->wait_ns[1] / 1e6, (double)p->held_ns[1] / 1e6);
+
+        // Most used keys first
+        int used[KVS_PROFILE_KEYS] = {0};
+        for (int k = 0; k < KVS_PROFILE_KEYS; k++) {
+            int best = -1;
+            for (int i = 0; i < KVS_PROFILE_KEYS; i++) {
+                if (!used[i] && p->keys[i].hits > 0 && (best < 0 || p->keys[i].hits > p->keys[best].hits)) {
+                    best = i;
+                }
+            }
+            if (best < 0) break;
+            used[best] = 1;
+            fprintf(out, " %s:%llu", p->keys[best].key, (unsigned long long)p->keys[best].hits);
+        }
+        fprintf(out, "\n");
+    }
 }
+#endif
 
 void free_table(HashTable *ht) {
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        pthread_rwlock_wrlock(&ht->locks[i]); 
+    for (int i = 0; i < KVS_STRIPES; i++) {
+        Stripe *s = &ht->stripes[i];
+        stripe_lock(s, 1);
 
-        KeyNode *keyNode = ht->table[i];
-        while (keyNode != NULL) {
-            KeyNode *temp = keyNode;
-            keyNode = keyNode->next;
-            free(temp->key);
-            free(temp->value);
-            free(temp);
+        if (ht->engine == ENGINE_OPEN) {
+            slots_free(&s->slots);
+        } else {
+            chain_free(s);
         }
+        subs_free(&s->subs);
+
+        stripe_unlock(s, 1);
+        pthread_rwlock_destroy(&s->lock);
+#ifdef KVS_LOCK_PROFILE
+        pthread_mutex_destroy(&s->profile.keys_lock);
+#endif
+    }
 
-        pthread_rwlock_unlock(&ht->locks[i]); 
-        pthread_rwlock_destroy(&ht->locks[i]); 
+    if (ht->optimistic_reads) {
+        epoch_reclaim_all();
     }
 
+    pthread_mutex_destroy(&ht->snapshots_lock);
     free(ht);
 }
@@ -1,27 +1,223 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
 
-#define TABLE_SIZE 26
-
 #include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
 
+#include "slots.h"
+#include "subs.h"
+
+// Number of lock stripes. Must be a power of two. A key's stripe is chosen
+// from the low bits of its hash and never changes, so the stripes are
+// independent from how many buckets the table currently has.
+#define KVS_STRIPE_BITS 6
+#define KVS_STRIPES (1 << KVS_STRIPE_BITS)
+
+// Buckets each stripe starts with. Must be a power of two.
+#define KVS_INITIAL_BUCKETS 4
+
+// Average chain length that makes a stripe double its bucket array.
+#define KVS_MAX_LOAD 2
+
+// Old buckets moved to the new array on every write while a stripe grows.
+#define KVS_MIGRATE_STEP 4
+
+// Attempts of a lock-free read before it falls back to the stripe read lock.
+#define KVS_OPTIMISTIC_RETRIES 8
+
+// Largest batch read_pairs serves without locks; larger ones take the locks.
+#define KVS_OPTIMISTIC_BATCH 64
+
+// Snapshots that can be open on a table at the same time.
+#define KVS_MAX_SNAPSHOTS 64
+
 typedef struct KeyNode {
 
     char *key;
     char *value;
+    uint64_t hash;
     struct KeyNode *next;
 } KeyNode;
 
+// Storage used inside every stripe. Chained buckets are the default; open
+// addressing keeps keys and values inline in the bucket array.
+enum TableEngine {
+    ENGINE_CHAINED,
+    ENGINE_OPEN
+};
+
+#ifndef KVS_DEFAULT_ENGINE
+#define KVS_DEFAULT_ENGINE ENGINE_CHAINED
+#endif
+
+#ifndef KVS_DEFAULT_OPTIMISTIC_READS
+#define KVS_DEFAULT_OPTIMISTIC_READS 0
+#endif
+
+typedef struct TableOptions {
+    enum TableEngine engine;
+    // Readers validate against the stripe sequence number instead of taking
+    // the read lock, and writers defer frees until those readers are done.
+    int optimistic_reads;
+} TableOptions;
+
+#ifdef KVS_LOCK_PROFILE
+#include <stdio.h>
+
+// Keys the lock profiler remembers per stripe.
+#define KVS_PROFILE_KEYS 8
+
+typedef struct ProfiledKey {
+    char key[MAX_STRING_SIZE];
+    uint64_t hits;
+} ProfiledKey;
+
+// Lock statistics of a stripe, kept when built with KVS_LOCK_PROFILE.
+// Index 0 of every array counts read locks, index 1 write locks. `keys`
+// holds the keys used most on the stripe, counted approximately with the
+// space-saving algorithm: a new key replaces the least used one.
+typedef struct LockProfile {
+    int index;
+    uint64_t taken[2];
+    uint64_t contended[2];
+    uint64_t wait_ns[2];
+    uint64_t held_ns[2];
+    pthread_mutex_t keys_lock;
+    ProfiledKey keys[KVS_PROFILE_KEYS];
+} LockProfile;
+#endif
+
+// Every stripe owns the buckets of the keys hashed to it and the lock that
+// protects them. While growing, the previous bucket array is drained a few
+// buckets at a time by the writers of that stripe only. `seq` is odd while a
+// writer is modifying the stripe. `pending` has a bit set for every open
+// snapshot that has not read the stripe yet, for which writers save the
+// pairs they change. `subs` holds the subscribers of its keys and is
+// protected by the same lock.
+typedef struct Stripe {
+    _Alignas(64) pthread_rwlock_t lock;
+    unsigned seq;
+    uint64_t pending;
+    union {
+        struct {
+            KeyNode **buckets;
+            size_t mask;
+            KeyNode **old_buckets;
+            size_t old_mask;
+            size_t migrated;
+        };
+        SlotTable slots;
+    };
+    size_t count;
+    SubscriberIndex subs;
+#ifdef KVS_LOCK_PROFILE
+    LockProfile profile;
+#endif
+} Stripe;
+
+// Pairs of a stripe copied for a snapshot, stored as consecutive
+// null-terminated keys and values.
+typedef struct StripeCopy {
+    char *pairs;
+    size_t len;
+    size_t capacity;
+} StripeCopy;
+
+// A key a writer changed after a snapshot was taken, and its value at the
+// time of the snapshot. `key` and `value` are offsets in the strings of the
+// SavedPairs it belongs to.
+typedef struct SavedPair {
+    uint64_t hash;
+    size_t key;
+    size_t value;
+    int used;
+    int existed;
+} SavedPair;
+
+// Keys of a stripe saved for a snapshot, in an open-addressing table so that
+// only the first writer of a key saves it.
+typedef struct SavedPairs {
+    SavedPair *slots;
+    size_t mask;
+    size_t count;
+    char *strings;
+    size_t len;
+    size_t capacity;
+} SavedPairs;
+
+// Point-in-time view of a table. Writers save the value a key had before
+// they first change it, and the snapshot is read from the live stripes with
+// those values put back. `versions` holds the sequence number of every
+// stripe at the time of the snapshot: a stripe with the same version in two
+// snapshots did not change between them.
+typedef struct TableSnapshot {
+    int slot;
+    int failed;
+    unsigned versions[KVS_STRIPES];
+    SavedPairs saved[KVS_STRIPES];
+} TableSnapshot;
+
+enum ChangeKind {
+    CHANGE_WRITE,
+    CHANGE_DELETE
+};
+
+/// Receives every batch of changes made to a table. Keys a batch did not
+/// change, rejected writes and deletes of missing keys, are left out.
+/// @param ctx Pointer given to set_change_logger.
+/// @param kind Whether the keys were written or deleted.
+/// @param count Number of keys.
+/// @param keys Keys changed, in the order they were applied.
+/// @param values Values written, NULL for deletes.
+typedef void (*change_logger)(void *ctx, enum ChangeKind kind, size_t count, const char *const keys[],
+                              const char *const values[]);
+
+/// Receives a change to a key somebody subscribed to, once per subscriber.
+/// Called with the stripe of the key write-locked, so it must not block or
+/// call back into the table.
+/// @param subscriber Subscriber given to subscribe_key.
+/// @param key Key changed.
+/// @param value New value of the key, NULL if it was deleted.
+typedef void (*change_notifier)(void *subscriber, const char *key, const char *value);
+
 typedef struct HashTable {
-    KeyNode *table[TABLE_SIZE];
-    pthread_rwlock_t locks[TABLE_SIZE];
+    Stripe stripes[KVS_STRIPES];
+    enum TableEngine engine;
+    int optimistic_reads;
+    change_logger log;
+    void *log_ctx;
+    change_notifier notify;
+    // Keys with subscribers in all stripes; writes only look further when
+    // it is not 0
+    size_t watched;
+    pthread_mutex_t snapshots_lock;
+    uint64_t snapshot_slots;
+    TableSnapshot *snapshots[KVS_MAX_SNAPSHOTS];
 } HashTable;
 
-/// Creates a new event hash table.
+/// Called once for every pair stored in the hash table.
+/// @param key Key of the pair.
+/// @param value Value of the pair.
+/// @param ctx Pointer given to the iteration function.
+typedef void (*pair_visitor)(const char *key, const char *value, void *ctx);
+
+/// Hashes a key the way the table does: 64-bit FNV-1a over the whole key,
+/// followed by a murmur3 finalizer so that the low bits (used to pick the
+/// stripe) depend on every byte of the key.
+/// @param key Null-terminated string.
+/// @return hash.
+uint64_t hash_key(const char *key);
+
+/// Creates a new event hash table using the default options.
 /// @return Newly created hash table, NULL on failure
 struct HashTable *create_hash_table();
 
+/// Creates a new event hash table.
+/// @param options Storage engine and read mode of the table.
+/// @return Newly created hash table, NULL on failure
+struct HashTable *create_hash_table_with(const TableOptions *options);
+
 /// Appends a new key value pair to the hash table.
 /// @param ht Hash table to be modified.
 /// @param key Key of the pair to be written.
@@ -35,12 +231,160 @@ int write_pair(HashTable *ht, const char *key, const char *value);
 /// @return 0 if the node was deleted successfully, 1 otherwise.
 char* read_pair(HashTable *ht, const char *key);
 
+/// Calls visit with the value of a key while the stripe is still locked,
+/// so the value can be consumed without being copied.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to read.
+/// @param visit Function called with the key and value if the key exists.
+///              It must not call back into the hash table.
+/// @param ctx Pointer passed to visit.
+/// @return 0 if the key was found, 1 otherwise.
+int read_pair_with(HashTable *ht, const char *key, pair_visitor visit, void *ctx);
+
 /// Appends a new node to the list.
 /// @param list Event list to be modified.
 /// @param key Key of the pair to read.
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int delete_pair(HashTable *ht, const char *key);
 
+/// Writes several pairs as one atomic step. The stripes of all keys are
+/// write-locked in ascending order before the first pair is written and
+/// released after the last one, so readers see all pairs or none.
+/// @param ht Hash table to be modified.
+/// @param count Number of pairs.
+/// @param keys Keys of the pairs. A repeated key keeps its last value.
+/// @param values Values of the pairs.
+/// @param results If not NULL, receives 0 or 1 per pair like write_pair.
+/// @return 0 if every pair was written, 1 otherwise.
+int write_pairs(HashTable *ht, size_t count, const char *const keys[], const char *const values[], int results[]);
+
+/// Reads several keys as one atomic step: the values seen are those of a
+/// single instant, with every stripe involved locked in ascending order (or
+/// validated, in optimistic mode).
+/// @param ht Hash table to read from.
+/// @param count Number of keys.
+/// @param keys Keys to read.
+/// @param visit Called once per key, in order, with the value or NULL if
+///              the key does not exist. It must not call back into the table.
+/// @param ctx Pointer passed to visit.
+/// @return Number of keys that do not exist.
+int read_pairs(HashTable *ht, size_t count, const char *const keys[], pair_visitor visit, void *ctx);
+
+/// Deletes several keys as one atomic step, locking like write_pairs.
+/// @param ht Hash table to delete from.
+/// @param count Number of keys.
+/// @param keys Keys to delete.
+/// @param results If not NULL, receives 0 per deleted key and 1 per missing key.
+/// @return Number of keys that did not exist.
+int delete_pairs(HashTable *ht, size_t count, const char *const keys[], int results[]);
+
+/// Visits every pair of the hash table, one stripe at a time.
+/// @param ht Hash table to iterate.
+/// @param visit Function called for each pair.
+/// @param ctx Pointer passed to every call of visit.
+void foreach_pair(HashTable *ht, pair_visitor visit, void *ctx);
+
+/// Adds the pairs of one stripe to a table, without locking it. If the
+/// stripe is empty its buckets are sized for every pair at once and the
+/// keys are not looked up, so they must all be different; otherwise the
+/// pairs are written with write_pair. Used to load snapshots before the
+/// table is shared: several threads may load different stripes at once.
+/// @param ht Hash table to fill.
+/// @param stripe Stripe every key belongs to.
+/// @param count Number of pairs.
+/// @param keys Keys of the pairs.
+/// @param values Values of the pairs.
+/// @return 0 on success, 1 if a key belongs to another stripe or memory
+///         ran out.
+int load_stripe(HashTable *ht, int stripe, size_t count, const char *const keys[], const char *const values[]);
+
+/// Sets the function that receives every write_pairs and delete_pairs batch.
+/// It is called while the stripes of the keys are still write-locked, so two
+/// batches touching the same key are logged in the order they were applied.
+/// Must be set before other threads use the table.
+/// @param ht Hash table to observe.
+/// @param log Function to call, NULL to stop logging.
+/// @param ctx Pointer passed to every call of log.
+void set_change_logger(HashTable *ht, change_logger log, void *ctx);
+
+/// Sets the function that receives the changes to subscribed keys. Must be
+/// set before other threads use the table.
+/// @param ht Hash table to observe.
+/// @param notify Function to call, NULL to stop notifying.
+void set_change_notifier(HashTable *ht, change_notifier notify);
+
+/// Subscribes to the changes of a key, which does not need to exist. The
+/// current value is visited under the same lock the subscription is added
+/// with, so no change is missed between them.
+/// @param ht Hash table to observe.
+/// @param key Key to subscribe to.
+/// @param subscriber Pointer handed to the change notifier. Subscribing
+///                   twice with the same pointer has no effect.
+/// @param visit Called with the key and its value, or NULL if it does not
+///              exist. It must not call back into the table.
+/// @param ctx Pointer passed to visit.
+/// @return 0 on success, 1 if the key is too long or memory ran out.
+int subscribe_key(HashTable *ht, const char *key, void *subscriber, pair_visitor visit, void *ctx);
+
+/// Removes a subscription. Once it returns, the change notifier is not
+/// running and will not run for this key and subscriber.
+/// @param ht Hash table observed.
+/// @param key Key subscribed to.
+/// @param subscriber Pointer given to subscribe_key.
+/// @return 0 if the subscription was removed, 1 if there was none.
+int unsubscribe_key(HashTable *ht, const char *key, void *subscriber);
+
+/// Takes a point-in-time snapshot of the table. Writers are only held off
+/// while the snapshot is registered; afterwards each write saves the old
+/// values of the keys it changes, and each stripe is copied when the
+/// snapshot reads it.
+/// @param ht Hash table to snapshot.
+/// @return The snapshot, NULL if KVS_MAX_SNAPSHOTS are open or memory ran out.
+TableSnapshot *snapshot_table(HashTable *ht);
+
+/// Visits every pair of a snapshot, stripe by stripe like foreach_pair. Keys
+/// changed since the snapshot come last in their stripe. Can only be called
+/// once.
+/// @param ht Hash table the snapshot was taken from.
+/// @param snap Snapshot to iterate.
+/// @param visit Function called for each pair, without any lock held.
+/// @param ctx Pointer passed to every call of visit.
+/// @return 0 on success, 1 if a copy of the snapshot could not be allocated.
+int snapshot_foreach(HashTable *ht, TableSnapshot *snap, pair_visitor visit, void *ctx);
+
+/// Visits the pairs one stripe of a snapshot held, like snapshot_foreach.
+/// Each stripe can only be visited once; stripes never visited are dropped
+/// by snapshot_release.
+/// @param ht Hash table the snapshot was taken from.
+/// @param snap Snapshot to iterate.
+/// @param stripe Index of the stripe, below KVS_STRIPES.
+/// @param visit Function called for each pair, without any lock held.
+/// @param ctx Pointer passed to every call of visit.
+/// @return 0 on success, 1 if a copy of the snapshot could not be allocated.
+int snapshot_stripe(HashTable *ht, TableSnapshot *snap, int stripe, pair_visitor visit, void *ctx);
+
+/// Closes a snapshot and frees its copies.
+/// @param ht Hash table the snapshot was taken from.
+/// @param snap Snapshot to release.
+void snapshot_release(HashTable *ht, TableSnapshot *snap);
+
+/// Read-locks every stripe, freezing the whole table for writers.
+/// @param ht Hash table to lock.
+void lock_table(HashTable *ht);
+
+/// Releases the locks taken by lock_table.
+/// @param ht Hash table to unlock.
+void unlock_table(HashTable *ht);
+
+#ifdef KVS_LOCK_PROFILE
+/// Writes the lock statistics of the busiest stripes, the longest waited
+/// for first, each with the keys used most on it.
+/// @param ht Hash table to report on.
+/// @param out Stream to write to.
+/// @param top Number of stripes to list.
+void lock_profile_report(HashTable *ht, FILE *out, int top);
+#endif
+
 /// Frees the hashtable.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
@@ -4,45 +4,49 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <fcntl.h> 
+#include <sys/stat.h>
 #include <string.h>
 #include <errno.h>
-#include <sys/wait.h>
 #include <pthread.h>
 
 
 #include "constants.h"
+#include "backup.h"
 #include "parser.h"
+#include "reader.h"
+#include "writer.h"
 #include "operations.h"
-
-// Struct for thread data
-int threads_created = 0;
-
-typedef struct {
-
-  int thread_id;
-  char file[MAX_PATH + MAX_WRITE_SIZE];
-  int active;
-
-} thread_data;
-
+#include "pool.h"
+#include "segment.h"
+#include "metrics.h"
+#include "server.h"
 
 int maxBackups = 0;
 int maxThreads = 0;
+long splitKiB = 0;
 
 // Function to process commands on a file
-int process_file(thread_data* t_data) {
+int process_file(const char *file, JobPool *pool) {
 
 
     // Open commands file and create output file
-    int fd = open(t_data->file,O_RDONLY); 
+    int fd = open(file,O_RDONLY); 
     
 
     if (fd < 0) {
         
         perror("Error opening file\n");
+        return 1;
+    }
+
+    Reader reader;
+    if (reader_init(&reader, fd)) {
+        fprintf(stderr, "Failed to allocate the job file buffer\n");
+        close(fd);
+        return 1;
     }
     
-    char* out_file_path = modify_file_path(t_data->file, ".job",".out");
+    char* out_file_path = modify_file_path(file, ".job",".out");
     
     int fd_out = open(out_file_path,O_WRONLY | O_CREAT | O_TRUNC, 0644);
     
@@ -50,28 +54,65 @@ int process_file(thread_data* t_data) {
     if (fd_out < 0) {
         
         perror("Error opening file\n");
+        // A writer on fd -1 would keep the whole output in memory
+        reader_destroy(&reader);
+        free(out_file_path);
+        close(fd);
+        return 1;
     }
 
+    // Results are buffered and written in large chunks
+    Writer out;
+    if (writer_init(&out, fd_out)) {
+        fprintf(stderr, "Failed to allocate the output buffer\n");
+        reader_destroy(&reader);
+        free(out_file_path);
+        close(fd);
+        close(fd_out);
+        return 1;
+    }
+
+    // Large job files hand runs of independent commands to idle workers
+    struct stat st;
+    int split = splitKiB > 0 && maxThreads > 1 && pool != NULL &&
+                fstat(fd, &st) == 0 && st.st_size >= (off_t)splitKiB * 1024;
+    Segment segment;
+    segment_init(&segment, pool, maxThreads);
+
     char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
     char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
     unsigned int delay;
     size_t num_pairs;
-    char output[MAX_WRITE_SIZE];
     int backupCounter = 0;
+    BackupChain backupChain;
+    backup_chain_init(&backupChain);
     
     while (1) {
         
-        switch (get_next(fd)) {
+        enum Command cmd = get_next(&reader);
+
+        // Everything else has to see the commands before it done
+        if (split && cmd != CMD_WRITE && cmd != CMD_READ && cmd != CMD_DELETE &&
+            cmd != CMD_EMPTY && cmd != CMD_INVALID) {
+            segment_run(&segment, &out);
+        }
+
+        switch (cmd) {
 
             case CMD_WRITE:
 
-                num_pairs = parse_write(fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+                num_pairs = parse_write(&reader, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
 
                 if (num_pairs == 0) {
                     fprintf(stderr, "Invalid command. See HELP for usage\n");
                     break;
                 }
 
+                if (split) {
+                    segment_add(&segment, CMD_WRITE, num_pairs, keys, values, &out);
+                    break;
+                }
+
                 if (kvs_write(num_pairs, keys, values)) {
                     fprintf(stderr, "Failed to write pair\n");
                 }
@@ -80,56 +121,60 @@ int process_file(thread_data* t_data) {
 
             case CMD_READ:
 
-                num_pairs = parse_read_delete(fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+                num_pairs = parse_read_delete(&reader, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
     
                 if (num_pairs == 0) {
                     fprintf(stderr, "Invalid command. See HELP for usage\n");
                     break;
                 }
 
-                if (kvs_read(num_pairs, keys, output)) {
-                    fprintf(stderr, "Failed to read pair\n");
+                if (split) {
+                    segment_add(&segment, CMD_READ, num_pairs, keys, NULL, &out);
+                    break;
                 }
-                write_in_file(output, fd_out);
 
+                if (kvs_read(num_pairs, keys, &out)) {
+                    fprintf(stderr, "Failed to read pair\n");
+                }
 
                 break;
 
             case CMD_DELETE:
 
-                num_pairs = parse_read_delete(fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+                num_pairs = parse_read_delete(&reader, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
 
                 if (num_pairs == 0) {
                     fprintf(stderr, "Invalid command. See HELP for usage\n");
                     break;
                 }
 
-                if (kvs_delete(num_pairs, keys, output)) {
-                    fprintf(stderr, "Failed to delete pair\n");
+                if (split) {
+                    segment_add(&segment, CMD_DELETE, num_pairs, keys, NULL, &out);
+                    break;
                 }
 
-                write_in_file(output, fd_out);
+                if (kvs_delete(num_pairs, keys, &out)) {
+                    fprintf(stderr, "Failed to delete pair\n");
+                }
 
                 break;
 
             case CMD_SHOW:
 
-                kvs_show(output);
-                write_in_file(output, fd_out);
+                kvs_show(&out);
 
                 break;
 
             case CMD_WAIT:
-                if (parse_wait(fd, &delay, NULL) == -1) {
+                if (parse_wait(&reader, &delay, NULL) == -1) {
                     fprintf(stderr, "Invalid command. See HELP for usage\n");
                     break;
                 }
 
                 if (delay > 0) {
                     
-                    strcpy(output, "Waiting...\n");
-                    write_in_file(output, fd_out);
-                    
+                    writer_puts(&out, "Waiting...\n");
+                    writer_flush(&out);
 
                     kvs_wait(delay); 
                 }
@@ -140,14 +185,22 @@ int process_file(thread_data* t_data) {
 
 
                 backupCounter++;
+                writer_flush(&out);
               
-                if (kvs_backup(t_data->file, backupCounter, maxBackups)) {
+                if (kvs_backup(file, backupCounter, maxBackups, &backupChain)) {
                     fprintf(stderr, "Failed to perform backup.\n");
                 }
 
 
                 break;
 
+            case CMD_SUBSCRIBE:
+            case CMD_UNSUBSCRIBE:
+                // Notifications need a client to go to (see -S)
+                parse_read_delete(&reader, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+                fprintf(stderr, "SUBSCRIBE and UNSUBSCRIBE are only available to clients\n");
+                break;
+
             case CMD_INVALID:
                 fprintf(stderr, "Invalid command. See HELP for usage\n");
                 break;
@@ -171,9 +224,12 @@ int process_file(thread_data* t_data) {
 
             case EOC:
 
-                wait(NULL);
-                t_data->active = 0;
+                // Backup threads report to the chain until they are done
+                backup_chain_destroy(&backupChain);
                 free(out_file_path);
+                segment_destroy(&segment);
+                reader_destroy(&reader);
+                writer_destroy(&out);
                 close(fd);
                 close(fd_out);
                 return 0;
@@ -182,32 +238,16 @@ int process_file(thread_data* t_data) {
 
 }
 
-void* thread_process_file(void* arg) {
-
-    thread_data* t = (thread_data*)arg;
-    
-    process_file(t);
-
-    return NULL;
+static void run_job(const char *path, void *ctx) {
+    process_file(path, ctx);
 }
 
 
+// Job files are queued as the directory is scanned and taken by a fixed set
+// of maxThreads workers, each running one job file at a time. Workers with
+// nothing left to start help with the split job files still running
 int readFiles(char* path) {
 
-    thread_data* threads_data[maxThreads];
-    pthread_t threads[maxThreads];
-
-    
-
-    for (int i = 0; i < maxThreads; i++ ) {
-
-        thread_data* t = malloc(sizeof(thread_data));
-        t->thread_id = i;
-        t->active = 1;
-        threads_data[i] = t;
-        
-    }
-
     struct dirent *file;
     DIR *dir = opendir(path);
     if (dir == NULL) {
@@ -215,83 +255,213 @@ int readFiles(char* path) {
         return -1; 
     }
 
+    JobPool pool;
+    if (pool_start(&pool, maxThreads, POOL_QUEUE_SIZE, run_job, &pool)) {
+        fprintf(stderr, "Failed to start the job workers\n");
+        closedir(dir);
+        return -1;
+    }
+
     size_t path_len = strlen(path);
     char aux_path[path_len + MAX_PATH];
-    int i = 0;
 
     while ((file = readdir(dir)) != NULL) {
         
         if (is_job_file(file->d_name)) {
             
             snprintf(aux_path, sizeof(aux_path), "%s/%s", path, file->d_name);
-            
-            
-            
-            if (threads_created < maxThreads) {
-                
-                strcpy(threads_data[threads_created]->file, aux_path);
-                if (pthread_create(&threads[threads_created], NULL, thread_process_file, threads_data[threads_created]) != 0) {
-                    perror("Failed to create thread\n");
-                    continue;
-                }
-                threads_created++;
-                
-            } else {
-                while(i < maxThreads) {
-                    if (!threads_data[i]->active) {
-                        
-                        strcpy(threads_data[i]->file, aux_path);
-                        threads_data[i]->active = 1;
-
-                        
-                        process_file(threads_data[i]);
-                        break;
-                    }
-
-                    i++;
-                    if(i == maxThreads) {
-                        i = 0;
-                    }
-                }
-                
+
+            if (pool_submit(&pool, aux_path)) {
+                fprintf(stderr, "Failed to queue %s\n", aux_path);
             }
-                
         }
 
     }
-    for (int j = 0; j < maxThreads; j++) {
-        pthread_join(threads[j], NULL);
-        free(threads_data[j]);
-    }
+
+    // Returns once every queued job file was processed
+    pool_finish(&pool);
     closedir(dir);  
     return 0;
 }
 
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] <jobs_dir> [max_threads]\n"
+            "       %s [options] -S <fifo> [jobs_dir] [max_threads]\n"
+            "  max_threads      job workers and concurrent backups, unless set below\n"
+            "  -t <n>|auto      job worker threads, auto for one per online CPU\n"
+            "  -j <KiB>         split job files of at least this size across idle workers\n"
+            "  -b <n>           backups written at the same time, up to %d\n"
+            "  -s <file.bck>    backup loaded before the first job starts\n"
+            "  -L <n>|auto      threads loading that backup\n"
+            "  -e chained|open  storage engine of the table\n"
+            "  -o               lock-free optimistic reads\n"
+            "  -l <file>        write-ahead log (default: $KVS_WAL)\n"
+            "  -y               commands wait until the log is on disk (default: $KVS_WAL_SYNC)\n"
+            "  -i <ms>          interval between syncs of the log (default: $KVS_WAL_INTERVAL_MS)\n"
+            "  -m <file>|-      metrics written on exit and on SIGUSR1, as JSON if file ends in .json\n"
+            "  -S <fifo>        serve clients connecting through this FIFO, after the jobs if any,\n"
+            "                   until SIGINT or SIGTERM\n"
+            "  -C <n>           threads serving clients (default: %d)\n",
+            prog, prog, KVS_MAX_SNAPSHOTS, SERVER_THREADS);
+}
+
+// Parses a count between 1 and max. With allow_auto, "auto" gives 0.
+static int parse_count(const char *arg, long max, int allow_auto, int *count) {
+    if (allow_auto && strcmp(arg, "auto") == 0) {
+        *count = 0;
+        return 0;
+    }
+
+    char *end;
+    errno = 0;
+    long value = strtol(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || value < 1 || value > max) {
+        return 1;
+    }
+    *count = (int)value;
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
 
-  if (argc != 3) {
+  KvsOptions options;
+  kvs_options_default(&options);
+
+  // The write-ahead log can also be set from the environment
+  options.wal_path = getenv("KVS_WAL");
+  const char *sync = getenv("KVS_WAL_SYNC");
+  options.wal.wait_durable = sync != NULL && atoi(sync) != 0;
+  const char *interval = getenv("KVS_WAL_INTERVAL_MS");
+  if (interval != NULL && atoi(interval) > 0) {
+      options.wal.interval_ms = (unsigned)atoi(interval);
+  }
+
+  // -1 until set by an option or by max_threads; 0 means auto
+  int workers = -1;
+  int backups = -1;
+  const char *metrics = NULL;
+  ServerOptions server = {NULL, SERVER_THREADS};
+  int count;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:j:b:s:L:e:ol:yi:m:S:C:")) != -1) {
+      int invalid = 0;
+      switch (opt) {
+          case 't':
+              invalid = parse_count(optarg, MAX_WORKERS, 1, &workers);
+              break;
+          case 'j':
+              invalid = parse_count(optarg, INT_MAX, 0, &count);
+              splitKiB = count;
+              break;
+          case 'b':
+              invalid = parse_count(optarg, KVS_MAX_SNAPSHOTS, 0, &backups);
+              break;
+          case 's':
+              options.snapshot_path = optarg;
+              break;
+          case 'L':
+              invalid = parse_count(optarg, KVS_STRIPES, 1, &options.load_threads);
+              break;
+          case 'e':
+              if (strcmp(optarg, "chained") == 0) {
+                  options.table.engine = ENGINE_CHAINED;
+              } else if (strcmp(optarg, "open") == 0) {
+                  options.table.engine = ENGINE_OPEN;
+              } else {
+                  invalid = 1;
+              }
+              break;
+          case 'o':
+              options.table.optimistic_reads = 1;
+              break;
+          case 'l':
+              options.wal_path = optarg;
+              break;
+          case 'y':
+              options.wal.wait_durable = 1;
+              break;
+          case 'i':
+              invalid = parse_count(optarg, 60000, 0, &count);
+              options.wal.interval_ms = (unsigned)count;
+              break;
+          case 'm':
+              metrics = optarg;
+              break;
+          case 'S':
+              server.fifo_path = optarg;
+              break;
+          case 'C':
+              invalid = parse_count(optarg, MAX_WORKERS, 0, &server.threads);
+              break;
+          default:
+              usage(argv[0]);
+              return 1;
+      }
+      if (invalid) {
+          fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+          usage(argv[0]);
+          return 1;
+      }
+  }
+
+  // A server does not need jobs to start with
+  int min_args = server.fifo_path != NULL ? 0 : 1;
+  if (argc - optind < min_args || argc - optind > 2) {
     fprintf(stderr, "Invalid Number of Arguments\n");
-    return 0;
+    usage(argv[0]);
+    return 1;
   }
 
-  char* dir = argv[1]; 
-  maxBackups = atoi(argv[2]); 
-  maxThreads = maxBackups; 
+  char* dir = argc > optind ? argv[optind] : NULL; 
 
+  // A single max_threads sets both limits, as it always did
+  if (argc - optind == 2) {
+      if (parse_count(argv[optind + 1], MAX_WORKERS, 0, &count)) {
+          fprintf(stderr, "Invalid thread limit\n");
+          return 1;
+      }
+      if (workers < 0) workers = count;
+      if (backups < 0) backups = count < KVS_MAX_SNAPSHOTS ? count : KVS_MAX_SNAPSHOTS;
+  }
 
-  if (maxThreads <= 0) {
-        fprintf(stderr, "Invalid thread limit\n");
-        return 1;
+  // Jobs are CPU-bound: auto runs one worker per online CPU. Backups are
+  // I/O-bound and write one at a time unless asked otherwise
+  if (workers <= 0) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      workers = cpus < 1 ? 1 : cpus > MAX_WORKERS ? MAX_WORKERS : (int)cpus;
   }
+  if (backups < 0) {
+      backups = 1;
+  }
+  maxThreads = workers;
+  maxBackups = backups;
 
-  
+  // Before any thread starts, so that all of them leave SIGUSR1 to the
+  // metrics thread
+  if (metrics != NULL && metrics_start(metrics)) {
+    fprintf(stderr, "Failed to start the metrics thread\n");
+    return 1;
+  }
 
-  if (kvs_init()) {
+  if (kvs_init_with(&options)) {
     fprintf(stderr, "Failed to initialize KVS\n");
+    metrics_stop();
     return 1;
   }
 
-  readFiles(dir);  
+  if (dir != NULL) {
+    readFiles(dir);  
+  }
+
+  int failed = 0;
+  if (server.fifo_path != NULL) {
+    failed = server_run(&server);
+  }
+
+  // Also waits for the backups still being written
+  kvs_terminate();
+  metrics_stop();
 
-  return 0;
+  return failed;
 }
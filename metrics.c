@@ -0,0 +1,383 @@
+#include "metrics.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct Histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[METRICS_BUCKETS];
+} Histogram;
+
+// Counters of one thread. Only that thread writes them, with relaxed
+// stores, so a dump from another thread reads whole values without any
+// lock. Shards of exited threads are reused and keep their counts.
+typedef struct Shard {
+  Histogram latency[METRIC_COMMANDS];
+  uint64_t keys[METRIC_COMMANDS];
+  uint64_t parsed;
+  uint64_t written;
+  uint64_t locks;
+  uint64_t contended;
+  uint64_t wait_ns;
+  uint64_t max_wait_ns;
+  uint64_t chains[METRICS_CHAIN_BUCKETS];
+  int in_use;
+  struct Shard *next;
+} Shard;
+
+int metrics_active = 0;
+
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static Shard *shards = NULL;
+
+static _Thread_local Shard *self = NULL;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+
+static const char *dump_path = NULL;
+static uint64_t started_at = 0;
+static pthread_t reporter_thread;
+static int stopping = 0;
+
+static const char *const command_names[METRIC_COMMANDS] = {"write", "read", "delete", "show", "backup"};
+
+static void shard_release(void *arg) {
+  Shard *shard = arg;
+  __atomic_store_n(&shard->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void shard_key_create(void) {
+  pthread_key_create(&shard_key, shard_release);
+}
+
+static Shard *shard_get(void) {
+  if (self != NULL) {
+    return self;
+  }
+
+  pthread_once(&shard_key_once, shard_key_create);
+  pthread_mutex_lock(&shards_lock);
+
+  Shard *shard = shards;
+  while (shard != NULL && __atomic_load_n(&shard->in_use, __ATOMIC_ACQUIRE)) {
+    shard = shard->next;
+  }
+
+  if (shard == NULL) {
+    shard = aligned_alloc(64, (sizeof(Shard) + 63) / 64 * 64);
+    if (!shard) abort();
+    memset(shard, 0, sizeof(Shard));
+    shard->next = shards;
+    shards = shard;
+  }
+  shard->in_use = 1;
+
+  pthread_mutex_unlock(&shards_lock);
+
+  pthread_setspecific(shard_key, shard);
+  self = shard;
+  return shard;
+}
+
+// Only the owner of a counter writes it.
+static void add(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static void raise_to(uint64_t *counter, uint64_t value) {
+  if (value > __atomic_load_n(counter, __ATOMIC_RELAXED)) {
+    __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+  }
+}
+
+static uint64_t read_counter(const uint64_t *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static size_t bucket_of(uint64_t value) {
+  if (value < (1u << METRICS_SUB_BITS)) {
+    return (size_t)value;
+  }
+  int top = 63 - __builtin_clzll(value);
+  int shift = top - METRICS_SUB_BITS;
+  uint64_t sub = (value >> shift) & ((1u << METRICS_SUB_BITS) - 1);
+  return ((size_t)(shift + 1) << METRICS_SUB_BITS) + (size_t)sub;
+}
+
+// Largest value that falls in a bucket.
+static uint64_t bucket_limit(size_t bucket) {
+  if (bucket < (1u << METRICS_SUB_BITS)) {
+    return bucket;
+  }
+  int shift = (int)(bucket >> METRICS_SUB_BITS) - 1;
+  uint64_t sub = bucket & ((1u << METRICS_SUB_BITS) - 1);
+  uint64_t low = ((1ULL << METRICS_SUB_BITS) + sub) << shift;
+  return low + ((1ULL << shift) - 1);
+}
+
+static void record(Histogram *h, uint64_t value) {
+  add(&h->count, 1);
+  add(&h->sum, value);
+  raise_to(&h->max, value);
+  add(&h->buckets[bucket_of(value)], 1);
+}
+
+// Value below which a fraction of the recorded values fall.
+static uint64_t percentile(const Histogram *h, double fraction) {
+  if (h->count == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(fraction * (double)h->count);
+  if (rank >= h->count) rank = h->count - 1;
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen > rank) {
+      uint64_t limit = bucket_limit(i);
+      return limit < h->max ? limit : h->max;
+    }
+  }
+  return h->max;
+}
+
+uint64_t metrics_now(void) {
+  if (!metrics_on()) {
+    return 0;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+void metrics_command(enum MetricsCommand cmd, size_t keys, uint64_t start) {
+  if (!metrics_on() || start == 0) {
+    return;
+  }
+  uint64_t end = metrics_now();
+  Shard *shard = shard_get();
+  record(&shard->latency[cmd], end > start ? end - start : 0);
+  add(&shard->keys[cmd], keys);
+}
+
+void metrics_parsed(size_t bytes) {
+  if (metrics_on()) {
+    add(&shard_get()->parsed, bytes);
+  }
+}
+
+void metrics_written(size_t bytes) {
+  if (metrics_on()) {
+    add(&shard_get()->written, bytes);
+  }
+}
+
+void metrics_lock(uint64_t wait_ns) {
+  if (!metrics_on()) {
+    return;
+  }
+  Shard *shard = shard_get();
+  add(&shard->locks, 1);
+  if (wait_ns > 0) {
+    add(&shard->contended, 1);
+    add(&shard->wait_ns, wait_ns);
+    raise_to(&shard->max_wait_ns, wait_ns);
+  }
+}
+
+void metrics_chain(size_t length) {
+  if (metrics_on()) {
+    size_t bucket = length < METRICS_CHAIN_BUCKETS ? length : METRICS_CHAIN_BUCKETS - 1;
+    add(&shard_get()->chains[bucket], 1);
+  }
+}
+
+// Adds up every shard. The shards are read while their threads keep
+// recording, so the totals are only consistent per counter.
+static void sum_shards(Shard *total) {
+  memset(total, 0, sizeof(*total));
+
+  pthread_mutex_lock(&shards_lock);
+  for (Shard *shard = shards; shard != NULL; shard = shard->next) {
+    for (int c = 0; c < METRIC_COMMANDS; c++) {
+      const Histogram *from = &shard->latency[c];
+      Histogram *to = &total->latency[c];
+      to->count += read_counter(&from->count);
+      to->sum += read_counter(&from->sum);
+      uint64_t max = read_counter(&from->max);
+      if (max > to->max) to->max = max;
+      for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+        to->buckets[i] += read_counter(&from->buckets[i]);
+      }
+      total->keys[c] += read_counter(&shard->keys[c]);
+    }
+    total->parsed += read_counter(&shard->parsed);
+    total->written += read_counter(&shard->written);
+    total->locks += read_counter(&shard->locks);
+    total->contended += read_counter(&shard->contended);
+    total->wait_ns += read_counter(&shard->wait_ns);
+    uint64_t max_wait = read_counter(&shard->max_wait_ns);
+    if (max_wait > total->max_wait_ns) total->max_wait_ns = max_wait;
+    for (size_t i = 0; i < METRICS_CHAIN_BUCKETS; i++) {
+      total->chains[i] += read_counter(&shard->chains[i]);
+    }
+  }
+  pthread_mutex_unlock(&shards_lock);
+
+  // Buckets are read after the counts; keep both in agreement
+  for (int c = 0; c < METRIC_COMMANDS; c++) {
+    Histogram *h = &total->latency[c];
+    h->count = 0;
+    for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+      h->count += h->buckets[i];
+    }
+  }
+}
+
+static void dump_text(FILE *out, const Shard *total, double elapsed) {
+  fprintf(out, "metrics after %.3f s\n", elapsed);
+  fprintf(out, "%-8s %12s %12s %12s %10s %10s %10s %10s %10s %10s\n", "command", "count", "keys", "ops/s",
+          "mean_us", "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us");
+  for (int c = 0; c < METRIC_COMMANDS; c++) {
+    const Histogram *h = &total->latency[c];
+    double mean = h->count ? (double)h->sum / (double)h->count : 0;
+    fprintf(out, "%-8s %12llu %12llu %12.0f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", command_names[c],
+            (unsigned long long)h->count, (unsigned long long)total->keys[c],
+            elapsed > 0 ? (double)h->count / elapsed : 0, mean / 1e3, (double)percentile(h, 0.5) / 1e3,
+            (double)percentile(h, 0.9) / 1e3, (double)percentile(h, 0.99) / 1e3,
+            (double)percentile(h, 0.999) / 1e3, (double)h->max / 1e3);
+  }
+  fprintf(out, "bytes: %llu parsed, %llu written\n", (unsigned long long)total->parsed,
+          (unsigned long long)total->written);
+  fprintf(out, "stripe locks: %llu taken, %llu contended, %.3f ms waited, %.3f ms longest wait\n",
+          (unsigned long long)total->locks, (unsigned long long)total->contended, (double)total->wait_ns / 1e6,
+          (double)total->max_wait_ns / 1e6);
+  fprintf(out, "chain lengths:");
+  for (size_t i = 0; i < METRICS_CHAIN_BUCKETS; i++) {
+    if (total->chains[i] > 0) {
+      fprintf(out, " %zu%s:%llu", i, i == METRICS_CHAIN_BUCKETS - 1 ? "+" : "",
+              (unsigned long long)total->chains[i]);
+    }
+  }
+  fprintf(out, "\n");
+}
+
+static void dump_json(FILE *out, const Shard *total, double elapsed) {
+  fprintf(out, "{\"elapsed_s\":%.6f,\"commands\":{", elapsed);
+  for (int c = 0; c < METRIC_COMMANDS; c++) {
+    const Histogram *h = &total->latency[c];
+    fprintf(out,
+            "%s\"%s\":{\"count\":%llu,\"keys\":%llu,\"ops_per_s\":%.1f,\"mean_ns\":%llu,\"p50_ns\":%llu,"
+            "\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}",
+            c ? "," : "", command_names[c], (unsigned long long)h->count, (unsigned long long)total->keys[c],
+            elapsed > 0 ? (double)h->count / elapsed : 0,
+            (unsigned long long)(h->count ? h->sum / h->count : 0), (unsigned long long)percentile(h, 0.5),
+            (unsigned long long)percentile(h, 0.9), (unsigned long long)percentile(h, 0.99),
+            (unsigned long long)percentile(h, 0.999), (unsigned long long)h->max);
+  }
+  fprintf(out, "},\"bytes_parsed\":%llu,\"bytes_written\":%llu", (unsigned long long)total->parsed,
+          (unsigned long long)total->written);
+  fprintf(out, ",\"locks\":{\"taken\":%llu,\"contended\":%llu,\"wait_ns\":%llu,\"max_wait_ns\":%llu}",
+          (unsigned long long)total->locks, (unsigned long long)total->contended,
+          (unsigned long long)total->wait_ns, (unsigned long long)total->max_wait_ns);
+  // Index i counts lookups that walked i nodes; the last one, longer walks
+  fprintf(out, ",\"chain_lengths\":[");
+  for (size_t i = 0; i < METRICS_CHAIN_BUCKETS; i++) {
+    fprintf(out, "%s%llu", i ? "," : "", (unsigned long long)total->chains[i]);
+  }
+  fprintf(out, "]}\n");
+}
+
+void metrics_dump(FILE *out, int json) {
+  Shard *total = malloc(sizeof(Shard));
+  if (total == NULL) {
+    return;
+  }
+  sum_shards(total);
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t ns = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+  double elapsed = started_at > 0 ? (double)(ns - started_at) / 1e9 : 0;
+
+  if (json) {
+    dump_json(out, total, elapsed);
+  } else {
+    dump_text(out, total, elapsed);
+  }
+  fflush(out);
+  free(total);
+}
+
+static void dump_to_path(void) {
+  size_t len = strlen(dump_path);
+  int json = len >= 5 && strcmp(dump_path + len - 5, ".json") == 0;
+
+  if (strcmp(dump_path, "-") == 0) {
+    metrics_dump(stderr, json);
+    return;
+  }
+
+  FILE *out = fopen(dump_path, "w");
+  if (out == NULL) {
+    perror("Failed to open the metrics file");
+    return;
+  }
+  metrics_dump(out, json);
+  fclose(out);
+}
+
+static void *reporter(void *arg) {
+  const sigset_t *signals = arg;
+
+  while (1) {
+    int sig;
+    if (sigwait(signals, &sig) != 0) {
+      continue;
+    }
+    if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+    dump_to_path();
+  }
+  return NULL;
+}
+
+int metrics_start(const char *path) {
+  static sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+    return 1;
+  }
+
+  dump_path = path;
+  __atomic_store_n(&metrics_active, 1, __ATOMIC_RELAXED);
+  started_at = metrics_now();
+
+  if (pthread_create(&reporter_thread, NULL, reporter, &signals) != 0) {
+    __atomic_store_n(&metrics_active, 0, __ATOMIC_RELAXED);
+    dump_path = NULL;
+    return 1;
+  }
+  return 0;
+}
+
+void metrics_stop(void) {
+  if (dump_path == NULL) {
+    return;
+  }
+
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+  pthread_kill(reporter_thread, SIGUSR1);
+  pthread_join(reporter_thread, NULL);
+
+  dump_to_path();
+  __atomic_store_n(&metrics_active, 0, __ATOMIC_RELAXED);
+  dump_path = NULL;
+}
@@ -0,0 +1,81 @@
+#ifndef KVS_METRICS_H
+#define KVS_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Latencies are kept in log-linear buckets: values below 2^METRICS_SUB_BITS
+// nanoseconds get a bucket each, and every larger power of two is split in
+// 2^METRICS_SUB_BITS buckets, so a bucket is within 1/16 of its values.
+#define METRICS_SUB_BITS 4
+#define METRICS_BUCKETS ((64 - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+
+// Chain lengths counted one by one; longer chains share the last bucket.
+#define METRICS_CHAIN_BUCKETS 32
+
+// Commands whose latency is recorded.
+enum MetricsCommand {
+  METRIC_WRITE,
+  METRIC_READ,
+  METRIC_DELETE,
+  METRIC_SHOW,
+  METRIC_BACKUP,
+  METRIC_COMMANDS
+};
+
+// Every thread records into its own shard, so recording takes no lock and
+// shares no cache line; a dump adds the shards up. Nothing is recorded
+// until metrics_start is called.
+extern int metrics_active;
+
+/// Tells whether metrics are being recorded.
+/// @return 1 after metrics_start, 0 otherwise.
+static inline int metrics_on(void) {
+  return __atomic_load_n(&metrics_active, __ATOMIC_RELAXED);
+}
+
+/// Reads the monotonic clock.
+/// @return Nanoseconds since an arbitrary point, 0 while metrics are off.
+uint64_t metrics_now(void);
+
+/// Records one command.
+/// @param cmd Kind of command.
+/// @param keys Number of keys it touched.
+/// @param start Value of metrics_now when it started.
+void metrics_command(enum MetricsCommand cmd, size_t keys, uint64_t start);
+
+/// Counts bytes read from job files.
+/// @param bytes Number of bytes.
+void metrics_parsed(size_t bytes);
+
+/// Counts bytes written to .out and backup files.
+/// @param bytes Number of bytes.
+void metrics_written(size_t bytes);
+
+/// Records a stripe lock acquisition.
+/// @param wait_ns Nanoseconds spent waiting for it, 0 if it was free.
+void metrics_lock(uint64_t wait_ns);
+
+/// Records the number of nodes walked by a lookup in a chained bucket.
+/// @param length Nodes walked.
+void metrics_chain(size_t length);
+
+/// Writes the totals of every thread.
+/// @param out Stream to write to.
+/// @param json Whether to write JSON instead of text.
+void metrics_dump(FILE *out, int json);
+
+/// Starts recording, and a thread that dumps the metrics to a file every
+/// time the process receives SIGUSR1. Must be called before any other
+/// thread is created, since SIGUSR1 is blocked in the calling thread and
+/// every thread it creates from then on.
+/// @param path File the dumps overwrite, "-" for stderr. JSON is written if
+///             it ends in ".json", text otherwise.
+/// @return 0 on success, 1 if the thread could not be started.
+int metrics_start(const char *path);
+
+/// Stops the SIGUSR1 thread and writes a last dump.
+void metrics_stop(void);
+
+#endif  // KVS_METRICS_H
@@ -0,0 +1,416 @@
+#include "notify.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "operations.h"
+#include "protocol.h"
+
+// A key a client is subscribed to. It is the subscriber the table hands
+// back on every change, so a change finds its client without a lookup.
+typedef struct Subscription {
+  NotifyQueue *queue;
+  struct Subscription *next;
+  struct Subscription *next_dirty;
+  int dirty;
+  int deleted;
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+} Subscription;
+
+struct NotifyQueue {
+  pthread_mutex_t lock;
+  int fd;
+  // Owned by the session of the client
+  Subscription *subscriptions;
+  size_t subscribed;
+  // Protected by lock: keys changed since the last batch, each once and
+  // holding its latest state, in the order they first changed. `scheduled`
+  // is set while the notifier thread is responsible for the queue
+  Subscription *dirty_head;
+  Subscription *dirty_tail;
+  int scheduled;
+  // Protected by notifier_lock
+  NotifyQueue *next_ready;
+  int ready;
+  int closed;
+  // Only used by the notifier thread: the batch being sent
+  char *out;
+  size_t out_len;
+  size_t sent;
+  int blocked;
+  int broken;
+};
+
+enum FlushResult {
+  FLUSH_IDLE,
+  FLUSH_BLOCKED
+};
+
+// Queues with changes to send or closed by their session, in arrival order.
+static pthread_mutex_t notifier_lock = PTHREAD_MUTEX_INITIALIZER;
+static NotifyQueue *ready_head = NULL;
+static NotifyQueue *ready_tail = NULL;
+static int notifier_stop = 0;
+
+// Written when the ready list stops being empty; non-blocking at both ends.
+static int wake_pipe[2] = {-1, -1};
+static pthread_t notifier_thread;
+
+static void wake_notifier(void) {
+  ssize_t ignored = write(wake_pipe[1], "x", 1);
+  (void)ignored;
+}
+
+// Adds a queue to the ready list unless it is there already. Called with
+// notifier_lock held; returns whether the notifier has to be woken up.
+static int push_ready(NotifyQueue *q) {
+  int was_empty = ready_head == NULL;
+  if (!q->ready) {
+    q->ready = 1;
+    q->next_ready = NULL;
+    if (ready_tail != NULL) {
+      ready_tail->next_ready = q;
+    } else {
+      ready_head = q;
+    }
+    ready_tail = q;
+  }
+  return was_empty;
+}
+
+static void schedule(NotifyQueue *q) {
+  pthread_mutex_lock(&notifier_lock);
+  int wake = push_ready(q);
+  pthread_mutex_unlock(&notifier_lock);
+
+  if (wake) {
+    wake_notifier();
+  }
+}
+
+// Change notifier of the table, called by writers with the stripe of the
+// key locked. It only records the new state: a key that is already waiting
+// keeps its place and takes the new value.
+static void on_change(void *subscriber, const char *key, const char *value) {
+  Subscription *sub = subscriber;
+  NotifyQueue *q = sub->queue;
+  (void)key;
+
+  pthread_mutex_lock(&q->lock);
+  sub->deleted = value == NULL;
+  if (value != NULL) {
+    size_t len = strnlen(value, MAX_STRING_SIZE - 1);
+    memcpy(sub->value, value, len);
+    sub->value[len] = '\0';
+  }
+  if (!sub->dirty) {
+    sub->dirty = 1;
+    sub->next_dirty = NULL;
+    if (q->dirty_tail != NULL) {
+      q->dirty_tail->next_dirty = sub;
+    } else {
+      q->dirty_head = sub;
+    }
+    q->dirty_tail = sub;
+  }
+  int wake = !q->scheduled;
+  q->scheduled = 1;
+  pthread_mutex_unlock(&q->lock);
+
+  // The queue cannot be freed meanwhile: closing it first unsubscribes from
+  // this key, which waits for the stripe lock held by the caller
+  if (wake) {
+    schedule(q);
+  }
+}
+
+// Moves every pending change into one NOTIFY frame. Called with q->lock
+// held. The changes are dropped if the client is gone or memory ran out.
+static void take_batch(NotifyQueue *q) {
+  size_t length = 0;
+  for (Subscription *s = q->dirty_head; s != NULL; s = s->next_dirty) {
+    length += strlen(s->key) + strlen(s->deleted ? "DELETED" : s->value) + 4;
+  }
+
+  // One more byte for the terminator sprintf writes after the last line
+  q->out = q->broken ? NULL : malloc(sizeof(ResponseHeader) + length + 1);
+  if (q->out != NULL) {
+    ResponseHeader header = {OP_NOTIFY, STATUS_OK, 0, (uint32_t)length};
+    memcpy(q->out, &header, sizeof(header));
+    q->out_len = sizeof(header);
+  }
+
+  for (Subscription *s = q->dirty_head; s != NULL; s = s->next_dirty) {
+    if (q->out != NULL) {
+      q->out_len += (size_t)sprintf(q->out + q->out_len, "(%s,%s)\n", s->key, s->deleted ? "DELETED" : s->value);
+    }
+    s->dirty = 0;
+  }
+  q->dirty_head = NULL;
+  q->dirty_tail = NULL;
+  q->sent = 0;
+}
+
+// Sends batches until nothing is pending or the FIFO is full. A full FIFO
+// leaves the rest of the batch for when it can be written again; changes
+// keep coalescing meanwhile.
+static enum FlushResult flush(NotifyQueue *q) {
+  while (1) {
+    while (q->sent < q->out_len && !q->broken) {
+      ssize_t n = write(q->fd, q->out + q->sent, q->out_len - q->sent);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return FLUSH_BLOCKED;
+      if (n < 0) {
+        // The client closed its end; keep dropping until its session ends
+        q->broken = 1;
+      } else {
+        q->sent += (size_t)n;
+      }
+    }
+    free(q->out);
+    q->out = NULL;
+    q->out_len = 0;
+    q->sent = 0;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->dirty_head == NULL) {
+      q->scheduled = 0;
+      pthread_mutex_unlock(&q->lock);
+      return FLUSH_IDLE;
+    }
+    take_batch(q);
+    pthread_mutex_unlock(&q->lock);
+  }
+}
+
+static void free_queue(NotifyQueue *q) {
+  Subscription *sub = q->subscriptions;
+  while (sub != NULL) {
+    Subscription *next = sub->next;
+    free(sub);
+    sub = next;
+  }
+  free(q->out);
+  close(q->fd);
+  pthread_mutex_destroy(&q->lock);
+  free(q);
+}
+
+// Takes the oldest ready queue. `closed` is read with it, under the same
+// lock, so a queue closed later is scheduled again and seen then.
+static NotifyQueue *pop_ready(int *closed) {
+  pthread_mutex_lock(&notifier_lock);
+  NotifyQueue *q = ready_head;
+  if (q != NULL) {
+    ready_head = q->next_ready;
+    if (ready_head == NULL) ready_tail = NULL;
+    q->ready = 0;
+    *closed = q->closed;
+  }
+  pthread_mutex_unlock(&notifier_lock);
+  return q;
+}
+
+// Waits for ready queues and for full FIFOs to drain. Blocked queues are
+// polled for POLLOUT, so one slow client never delays the others.
+static void *notifier_main(void *arg) {
+  (void)arg;
+  size_t capacity = 16;
+  size_t nblocked = 0;
+  NotifyQueue **blocked = malloc(capacity * sizeof(NotifyQueue *));
+  struct pollfd *fds = malloc(capacity * sizeof(struct pollfd));
+  if (blocked == NULL || fds == NULL) {
+    fprintf(stderr, "Out of memory in the notifier\n");
+    abort();
+  }
+
+  while (1) {
+    fds[0] = (struct pollfd){wake_pipe[0], POLLIN, 0};
+    for (size_t i = 0; i < nblocked; i++) {
+      fds[i + 1] = (struct pollfd){blocked[i]->fd, POLLOUT, 0};
+    }
+    if (poll(fds, (nfds_t)(nblocked + 1), -1) < 0 && errno != EINTR) {
+      perror("Failed to wait for notifications");
+      break;
+    }
+
+    char drain[64];
+    while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {
+    }
+
+    // Backwards, so that removing an entry does not skip the next one
+    for (size_t i = nblocked; i-- > 0;) {
+      if (fds[i + 1].revents != 0 && flush(blocked[i]) == FLUSH_IDLE) {
+        blocked[i]->blocked = 0;
+        blocked[i] = blocked[--nblocked];
+      }
+    }
+
+    NotifyQueue *q;
+    int closed = 0;
+    while ((q = pop_ready(&closed)) != NULL) {
+      if (closed) {
+        for (size_t i = 0; q->blocked && i < nblocked; i++) {
+          if (blocked[i] == q) blocked[i] = blocked[--nblocked];
+        }
+        free_queue(q);
+      } else if (flush(q) == FLUSH_BLOCKED && !q->blocked) {
+        if (nblocked + 1 >= capacity) {
+          capacity *= 2;
+          blocked = realloc(blocked, capacity * sizeof(NotifyQueue *));
+          fds = realloc(fds, capacity * sizeof(struct pollfd));
+          if (blocked == NULL || fds == NULL) {
+            fprintf(stderr, "Out of memory in the notifier\n");
+            abort();
+          }
+        }
+        q->blocked = 1;
+        blocked[nblocked++] = q;
+      }
+    }
+
+    pthread_mutex_lock(&notifier_lock);
+    int done = notifier_stop && ready_head == NULL;
+    pthread_mutex_unlock(&notifier_lock);
+    if (done) break;
+  }
+
+  free(blocked);
+  free(fds);
+  return NULL;
+}
+
+int notify_start(void) {
+  if (pipe(wake_pipe) != 0) {
+    perror("Failed to create the notifier pipe");
+    return 1;
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(wake_pipe[i], F_SETFL, fcntl(wake_pipe[i], F_GETFL) | O_NONBLOCK);
+  }
+
+  notifier_stop = 0;
+  kvs_set_notifier(on_change);
+  if (pthread_create(&notifier_thread, NULL, notifier_main, NULL) != 0) {
+    fprintf(stderr, "Failed to start the notifier thread\n");
+    kvs_set_notifier(NULL);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    return 1;
+  }
+  return 0;
+}
+
+void notify_stop(void) {
+  pthread_mutex_lock(&notifier_lock);
+  notifier_stop = 1;
+  pthread_mutex_unlock(&notifier_lock);
+  wake_notifier();
+
+  pthread_join(notifier_thread, NULL);
+  kvs_set_notifier(NULL);
+  close(wake_pipe[0]);
+  close(wake_pipe[1]);
+}
+
+NotifyQueue *notify_open(int fd) {
+  NotifyQueue *q = calloc(1, sizeof(NotifyQueue));
+  if (q == NULL) {
+    return NULL;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  pthread_mutex_init(&q->lock, NULL);
+  q->fd = fd;
+  return q;
+}
+
+static Subscription **find_subscription(NotifyQueue *q, const char *key) {
+  Subscription **link = &q->subscriptions;
+  while (*link != NULL && strcmp((*link)->key, key) != 0) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+int notify_subscribe(NotifyQueue *q, const char *key, Writer *out) {
+  Subscription *sub = *find_subscription(q, key);
+  int added = sub == NULL;
+
+  if (added) {
+    size_t len = strlen(key);
+    sub = q->subscribed < NOTIFY_MAX_SUBSCRIPTIONS && len < MAX_STRING_SIZE ? calloc(1, sizeof(Subscription)) : NULL;
+    if (sub == NULL) {
+      writer_puts(out, "(");
+      writer_puts(out, key);
+      writer_puts(out, ",KVSERROR)");
+      return 1;
+    }
+    sub->queue = q;
+    memcpy(sub->key, key, len + 1);
+  }
+
+  // Subscribing again with the same pointer only reports the value
+  if (kvs_subscribe(key, sub, out)) {
+    if (added) free(sub);
+    return 1;
+  }
+  if (added) {
+    sub->next = q->subscriptions;
+    q->subscriptions = sub;
+    q->subscribed++;
+  }
+  return 0;
+}
+
+int notify_unsubscribe(NotifyQueue *q, const char *key) {
+  Subscription **link = find_subscription(q, key);
+  Subscription *sub = *link;
+  if (sub == NULL) {
+    return 1;
+  }
+
+  // Writers are done with it once the table forgets it
+  kvs_unsubscribe(key, sub);
+
+  pthread_mutex_lock(&q->lock);
+  if (sub->dirty) {
+    Subscription **dirty = &q->dirty_head;
+    Subscription *prev = NULL;
+    while (*dirty != sub) {
+      prev = *dirty;
+      dirty = &(*dirty)->next_dirty;
+    }
+    *dirty = sub->next_dirty;
+    if (q->dirty_tail == sub) q->dirty_tail = prev;
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  *link = sub->next;
+  q->subscribed--;
+  free(sub);
+  return 0;
+}
+
+void notify_close(NotifyQueue *q) {
+  for (Subscription *sub = q->subscriptions; sub != NULL; sub = sub->next) {
+    kvs_unsubscribe(sub->key, sub);
+  }
+
+  // Both under one lock: the notifier frees a closed queue as soon as it
+  // takes it from the ready list
+  pthread_mutex_lock(&notifier_lock);
+  q->closed = 1;
+  int wake = push_ready(q);
+  pthread_mutex_unlock(&notifier_lock);
+
+  if (wake) {
+    wake_notifier();
+  }
+}
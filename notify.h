@@ -0,0 +1,48 @@
+#ifndef KVS_NOTIFY_H
+#define KVS_NOTIFY_H
+
+#include "writer.h"
+
+// Keys a client can be subscribed to at once. It also bounds the changes
+// waiting to be sent to a client, since they are coalesced per key.
+#define NOTIFY_MAX_SUBSCRIPTIONS 256
+
+// Subscriptions of one client and the changes waiting for its notification
+// FIFO. Writers only queue changes; a single notifier thread sends them,
+// without ever blocking on a slow client.
+typedef struct NotifyQueue NotifyQueue;
+
+/// Starts the notifier thread and routes the changes of subscribed keys to
+/// it. Must be called after kvs_init and before any client subscribes.
+/// @return 0 on success, 1 otherwise.
+int notify_start(void);
+
+/// Stops the notifier thread. Every queue must have been closed.
+void notify_stop(void);
+
+/// Creates the queue of a client.
+/// @param fd Notification FIFO of the client, open for writing. It is made
+///           non-blocking and closed by notify_close.
+/// @return The queue, NULL if memory ran out.
+NotifyQueue *notify_open(int fd);
+
+/// Subscribes a client to a key.
+/// @param q Queue of the client.
+/// @param key Key to subscribe to.
+/// @param out Writer that receives the current value, like READ.
+/// @return 0 on success, 1 if the client has NOTIFY_MAX_SUBSCRIPTIONS
+///         subscriptions or memory ran out.
+int notify_subscribe(NotifyQueue *q, const char *key, Writer *out);
+
+/// Unsubscribes a client from a key and drops its pending change.
+/// @param q Queue of the client.
+/// @param key Key to unsubscribe from.
+/// @return 0 on success, 1 if the client was not subscribed to it.
+int notify_unsubscribe(NotifyQueue *q, const char *key);
+
+/// Removes every subscription of a client and hands the queue back to the
+/// notifier thread, which closes the FIFO and frees it.
+/// @param q Queue to close. Must not be used afterwards.
+void notify_close(NotifyQueue *q);
+
+#endif  // KVS_NOTIFY_H
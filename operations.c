@@ -4,14 +4,25 @@
 #include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <sys/wait.h>
+#include <pthread.h>
 
+#include "backup.h"
 #include "kvs.h"
+#include "metrics.h"
 #include "constants.h"
+#include "operations.h"
+#include "wal.h"
+#include "writer.h"
 
 static struct HashTable* kvs_table = NULL;
 
-int ongoingBackups = 0;
+// Write-ahead log of the table, NULL when running without one.
+static Wal *kvs_wal = NULL;
+
+// Backups still being written by backup threads.
+static int ongoingBackups = 0;
+static pthread_mutex_t backups_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backups_done = PTHREAD_COND_INITIALIZER;
 
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
@@ -85,35 +96,67 @@ char *add_extension(const char *file_path, const char *ext) {
 }
 
 
-int write_in_file(char output[MAX_WRITE_SIZE], int fd) {
-    
-    ssize_t bytes_written = 0;
-    ssize_t total_written = 0;
-
-    while (output[total_written] != '\0') { 
-        bytes_written = write(fd, &output[total_written], 1); 
-
-        if (bytes_written < 0) {
-            perror("Error writing to file");
-            return 0;
-        }
-
-        total_written += bytes_written; // Atualiza a quantidade de bytes escritos
-    }
-
-    return 0;
+void kvs_options_default(KvsOptions *options) {
+  options->table = (TableOptions){KVS_DEFAULT_ENGINE, KVS_DEFAULT_OPTIMISTIC_READS};
+  options->snapshot_path = NULL;
+  options->load_threads = 0;
+  options->wal_path = NULL;
+  wal_options_default(&options->wal);
 }
 
-
 int kvs_init() {
+  return kvs_init_with(NULL);
+}
+
+int kvs_init_with(const KvsOptions *options) {
   if (kvs_table != NULL) {
     fprintf(stderr, "KVS state has already been initialized\n");
     return 1;
   }
 
-  kvs_table = create_hash_table();
-  return kvs_table == NULL;
+  kvs_table = options != NULL ? create_hash_table_with(&options->table) : create_hash_table();
+  if (kvs_table == NULL) {
+    return 1;
+  }
+
+  if (options != NULL && options->snapshot_path != NULL &&
+      backup_load(options->snapshot_path, kvs_table, options->load_threads)) {
+    fprintf(stderr, "Failed to load %s\n", options->snapshot_path);
+    free_table(kvs_table);
+    kvs_table = NULL;
+    return 1;
+  }
+
+  if (options != NULL && options->wal_path != NULL) {
+    // Rebuilds the table from the last checkpoint and the log
+    kvs_wal = wal_open(options->wal_path, kvs_table, &options->wal);
+    if (kvs_wal == NULL) {
+      free_table(kvs_table);
+      kvs_table = NULL;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+#ifdef KVS_LOCK_PROFILE
+// Stripes listed in the lock profile written on exit.
+#define KVS_PROFILE_TOP 16
+
+// Writes the lock profile to $KVS_LOCK_REPORT, or to stderr when unset.
+static void report_locks(void) {
+  const char *path = getenv("KVS_LOCK_REPORT");
+  FILE *out = path != NULL ? fopen(path, "w") : stderr;
+  if (out == NULL) {
+    perror("Failed to open the lock report");
+    return;
+  }
+  lock_profile_report(kvs_table, out, KVS_PROFILE_TOP);
+  if (out != stderr) {
+    fclose(out);
+  }
 }
+#endif
 
 int kvs_terminate() {
   if (kvs_table == NULL) {
@@ -121,8 +164,18 @@ int kvs_terminate() {
     return 1;
   }
 
+  kvs_wait_backups();
+  int failed = 0;
+  if (kvs_wal != NULL) {
+    failed = wal_close(kvs_wal, 1);
+    kvs_wal = NULL;
+  }
+#ifdef KVS_LOCK_PROFILE
+  report_locks();
+#endif
   free_table(kvs_table);
-  return 0;
+  kvs_table = NULL;
+  return failed;
 }
 
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
@@ -131,32 +184,55 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_
     return 1;
   }
 
+  uint64_t start = metrics_now();
+  const char *key_ptrs[num_pairs];
+  const char *value_ptrs[num_pairs];
+  int results[num_pairs];
   for (size_t i = 0; i < num_pairs; i++) {
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-      fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
+    key_ptrs[i] = keys[i];
+    value_ptrs[i] = values[i];
+  }
+
+  // All pairs of the command become visible at once
+  if (write_pairs(kvs_table, num_pairs, key_ptrs, value_ptrs, results) != 0) {
+    for (size_t i = 0; i < num_pairs; i++) {
+      if (results[i] != 0) {
+        fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
+      }
     }
   }
 
-  return 0;
+  int failed = kvs_wal != NULL && wal_commit(kvs_wal);
+  if (failed) {
+    fprintf(stderr, "Failed to log the write\n");
+  }
+  metrics_command(METRIC_WRITE, num_pairs, start);
+  return failed;
 }
 
 int compare_keys(const void *a, const void *b) {
     return strcmp(*(const char **)a, *(const char **)b);
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], char output[MAX_WRITE_SIZE]) {
+static void format_read(const char *key, const char *value, void *ctx) {
+  Writer *out = ctx;
+
+  writer_puts(out, "(");
+  writer_puts(out, key);
+  writer_puts(out, ",");
+  writer_puts(out, value ? value : "KVSERROR");
+  writer_puts(out, ")");
+}
+
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], Writer *out) {
   
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  memset(output, 0, MAX_WRITE_SIZE);
-
-  char output_temp[MAX_WRITE_SIZE];
-
-  
-  char *sorted_keys[num_pairs];
+  uint64_t start = metrics_now();
+  const char *sorted_keys[num_pairs];
   for (size_t i = 0; i < num_pairs; i++) {
     sorted_keys[i] = keys[i];
   }
@@ -164,31 +240,19 @@ int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], char output[MAX_WRI
   
   qsort(sorted_keys, num_pairs, sizeof(char*), compare_keys);
 
-  strcat(output, "[");
+  writer_puts(out, "[");
 
-  for (size_t i = 0; i < num_pairs; i++) {
-    
-    char* result = read_pair(kvs_table, sorted_keys[i]);
+  // All keys are read at the same instant and formatted while their stripes
+  // are locked, so nothing is copied
+  read_pairs(kvs_table, num_pairs, sorted_keys, format_read, out);
 
-    
-    if (result == NULL) {
-      snprintf(output_temp, MAX_WRITE_SIZE, "(%s,KVSERROR)", sorted_keys[i]);
-      strcat(output, output_temp);
-    } else {
-      snprintf(output_temp, MAX_WRITE_SIZE, "(%s,%s)", sorted_keys[i], result);
-      strcat(output, output_temp);
-      
-      
-      free(result);
-    }
-  }
+  writer_puts(out, "]\n");
 
-  strcat(output, "]\n");
-  
+  metrics_command(METRIC_READ, num_pairs, start);
   return 0;
 }
 
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], char output[MAX_WRITE_SIZE]) {
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], Writer *out) {
 
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
@@ -196,93 +260,192 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], char output[MAX_W
   }
   int aux = 0;
 
-  memset(output, 0, MAX_WRITE_SIZE);
+  uint64_t start = metrics_now();
+  const char *key_ptrs[num_pairs];
+  int missing[num_pairs];
+  for (size_t i = 0; i < num_pairs; i++) {
+    key_ptrs[i] = keys[i];
+  }
 
-  char output_temp[MAX_WRITE_SIZE];
+  delete_pairs(kvs_table, num_pairs, key_ptrs, missing);
+  int failed = kvs_wal != NULL && wal_commit(kvs_wal);
+  if (failed) {
+    fprintf(stderr, "Failed to log the delete\n");
+  }
 
   for (size_t i = 0; i < num_pairs; i++) {
-    if (delete_pair(kvs_table, keys[i]) != 0) {
+    if (missing[i]) {
       if (!aux) {
-        strcat(output, "[");
+        writer_puts(out, "[");
         aux = 1;
       }
-      snprintf(output_temp, MAX_WRITE_SIZE, "(%s,KVSMISSING)", keys[i]);
-      strcat(output, output_temp);
+      writer_puts(out, "(");
+      writer_puts(out, keys[i]);
+      writer_puts(out, ",KVSMISSING)");
     }
   }
   if (aux) {
-    strcat(output, "]\n");
+    writer_puts(out, "]\n");
   }
-  
 
-  return 0;
+  metrics_command(METRIC_DELETE, num_pairs, start);
+
+  return failed;
 }
 
-void kvs_show(char output[MAX_WRITE_SIZE]) {
-    
-  memset(output, 0, MAX_WRITE_SIZE);
+void kvs_set_notifier(change_notifier notify) {
+  set_change_notifier(kvs_table, notify);
+}
 
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i];
-    while (keyNode != NULL) {
-        
-      strcat(output, "(");
-      strcat(output, keyNode->key);
-      strcat(output, ", ");
-      strcat(output, keyNode->value);
-      strcat(output, ")\n");
-  
+int kvs_subscribe(const char *key, void *subscriber, Writer *out) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+  return subscribe_key(kvs_table, key, subscriber, format_read, out);
+}
 
-      keyNode = keyNode->next;
-    }
+int kvs_unsubscribe(const char *key, void *subscriber) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
   }
+  return unsubscribe_key(kvs_table, key, subscriber);
 }
 
-int kvs_backup(const char* file_path, int backupCounter, int maxBackups) {
+static void show_pair(const char *key, const char *value, void *ctx) {
+  Writer *out = ctx;
 
-    if (ongoingBackups == maxBackups) {
-      wait(NULL);
-      ongoingBackups--;
+  writer_puts(out, "(");
+  writer_puts(out, key);
+  writer_puts(out, ", ");
+  writer_puts(out, value);
+  writer_puts(out, ")\n");
+}
+
+void kvs_show(Writer *out) {
+  // Pairs stream into the writer one stripe at a time, so memory use does
+  // not depend on the size of the store
+  uint64_t start = metrics_now();
+  foreach_pair(kvs_table, show_pair, out);
+  metrics_command(METRIC_SHOW, 0, start);
+}
+
+typedef struct BackupTask {
+  TableSnapshot *snapshot;
+  char *path;
+  BackupChain *chain;
+  int number;
+  int base;
+  int depth;
+  unsigned base_versions[KVS_STRIPES];
+} BackupTask;
+
+// Serializes a snapshot to its .bck file while the jobs keep running.
+static void *backup_thread(void *arg) {
+  BackupTask *task = arg;
+  int failed = 1;
+
+  int fBackup = open(task->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fBackup < 0) {
+    perror("Failed to open backup file");
+  } else {
+    Writer backup;
+    failed = writer_init(&backup, fBackup);
+    if (!failed) {
+      if (backup_write(kvs_table, task->snapshot, task->number, task->base, task->base_versions, &backup)) {
+        fprintf(stderr, "Failed to copy the table for a backup\n");
+        failed = 1;
+      }
+      failed |= writer_destroy(&backup) != 0;
     }
+    close(fBackup);
 
-    ongoingBackups++;
-    
-    pid_t pid = fork();
-    
-    if (pid < 0) {
-        perror("Fork failed for backup");
-        ongoingBackups--;
-        return -1; 
+    // A partial file must not pass for a backup
+    if (failed) {
+      fprintf(stderr, "Failed to write backup %s\n", task->path);
+      unlink(task->path);
     }
+  }
 
-    if (pid == 0) {
+  backup_chain_done(task->chain, task->number, task->depth, task->snapshot, failed);
+  snapshot_release(kvs_table, task->snapshot);
+  free(task->path);
+  free(task);
 
-        char *file_path_no_ext = remove_extension(file_path, ".job");
-        char aux_path[MAX_WRITE_SIZE];                        
-        snprintf(aux_path, MAX_PATH + MAX_WRITE_SIZE, "%s-%d", file_path_no_ext, backupCounter);
-        
-        
-        free(file_path_no_ext);
-        char* backup_file_path = add_extension(aux_path, ".bck");
-              
-        char output[MAX_WRITE_SIZE];
-        kvs_show(output); 
-        int fBackup = open(backup_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fBackup < 0) {
-            perror("Failed to open backup file");
-            _exit(1); 
-        }
+  pthread_mutex_lock(&backups_lock);
+  ongoingBackups--;
+  pthread_cond_broadcast(&backups_done);
+  pthread_mutex_unlock(&backups_lock);
+
+  return NULL;
+}
+
+int kvs_backup(const char* file_path, int backupCounter, int maxBackups, BackupChain *chain) {
+    int limit = maxBackups < KVS_MAX_SNAPSHOTS ? maxBackups : KVS_MAX_SNAPSHOTS;
+    // Covers the wait for a free backup slot and the snapshot, which is
+    // what the job waits for; the file is written in the background
+    uint64_t start = metrics_now();
 
-        write_in_file(output, fBackup); 
-        close(fBackup);
+    pthread_mutex_lock(&backups_lock);
+    while (ongoingBackups >= limit) {
+      pthread_cond_wait(&backups_done, &backups_lock);
+    }
+    ongoingBackups++;
+    pthread_mutex_unlock(&backups_lock);
+
+    BackupTask *task = malloc(sizeof(BackupTask));
+    char *file_path_no_ext = remove_extension(file_path, ".job");
+    char aux_path[MAX_PATH + MAX_WRITE_SIZE];
+    snprintf(aux_path, sizeof(aux_path), "%s-%d", file_path_no_ext, backupCounter);
+    free(file_path_no_ext);
+
+    // The snapshot is taken here, so the backup holds the state at this
+    // point of the job; the file is written by a backup thread
+    if (task != NULL) {
+      task->path = add_extension(aux_path, ".bck");
+      task->snapshot = snapshot_table(kvs_table);
+      task->chain = chain;
+      task->number = backupCounter;
+    }
 
-        free(backup_file_path);
-        _exit(0);
+    // Deltas store the stripes that changed since the last backup written
+    if (task != NULL && task->snapshot != NULL) {
+      backup_chain_next(chain, backupCounter, &task->base, &task->depth, task->base_versions);
     }
 
+    pthread_t thread;
+    if (task == NULL || task->path == NULL || task->snapshot == NULL ||
+        pthread_create(&thread, NULL, backup_thread, task) != 0) {
+      fprintf(stderr, "Failed to start backup\n");
+      if (task != NULL) {
+        if (task->snapshot != NULL) {
+          backup_chain_done(chain, backupCounter, task->depth, task->snapshot, 1);
+          snapshot_release(kvs_table, task->snapshot);
+        }
+        free(task->path);
+        free(task);
+      }
+      pthread_mutex_lock(&backups_lock);
+      ongoingBackups--;
+      pthread_cond_broadcast(&backups_done);
+      pthread_mutex_unlock(&backups_lock);
+      return -1;
+    }
+
+    pthread_detach(thread);
+    metrics_command(METRIC_BACKUP, 0, start);
     return 0;
 }
 
+void kvs_wait_backups() {
+  pthread_mutex_lock(&backups_lock);
+  while (ongoingBackups > 0) {
+    pthread_cond_wait(&backups_done, &backups_lock);
+  }
+  pthread_mutex_unlock(&backups_lock);
+}
+
 void kvs_wait(unsigned int delay_ms) {
   struct timespec delay = delay_to_timespec(delay_ms);
   nanosleep(&delay, NULL);
@@ -3,10 +3,37 @@
 
 #include <stddef.h>
 
+#include "backup.h"
+#include "constants.h"
+#include "wal.h"
+#include "writer.h"
+
+typedef struct KvsOptions {
+  // Storage engine and read mode of the table
+  TableOptions table;
+  // Backup file the state starts from, NULL to start empty
+  const char *snapshot_path;
+  // Threads that load the snapshot, 0 for one per online CPU
+  int load_threads;
+  // Path of the write-ahead log, NULL to keep the state only in memory
+  const char *wal_path;
+  WalOptions wal;
+} KvsOptions;
+
+/// Fills the options kvs_init uses: default table, no snapshot, no log.
+/// @param options Options to fill.
+void kvs_options_default(KvsOptions *options);
+
 /// Initializes the KVS state.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
 int kvs_init();
 
+/// Initializes the KVS state, loading the snapshot and then replaying the
+/// write-ahead log if they are set.
+/// @param options Settings of the state, NULL for the defaults of kvs_init.
+/// @return 0 if the KVS state was initialized successfully, 1 otherwise.
+int kvs_init_with(const KvsOptions *options);
+
 /// Destroys the KVS state.
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
 int kvs_terminate();
@@ -21,24 +48,51 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
-/// @param fd File descriptor to write the (successful) output.
+/// @param out Writer that receives the values read.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], char output[MAX_WRITE_SIZE]);
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], Writer *out);
 
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
+/// @param out Writer that receives the keys that were missing.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], char output[MAX_WRITE_SIZE]);
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], Writer *out);
+
+/// Sets the function that hears about every change to a subscribed key.
+/// Must be called before clients can subscribe.
+/// @param notify Function to call with the subscriber, key and new value.
+void kvs_set_notifier(change_notifier notify);
+
+/// Subscribes to the changes of a key, whether it exists or not.
+/// @param key Key to subscribe to.
+/// @param subscriber Pointer handed to the notifier on every change.
+/// @param out Writer that receives the current value as (key,value), or
+/// (key,KVSERROR) if the key does not exist.
+/// @return 0 if the subscription was added, 1 otherwise.
+int kvs_subscribe(const char *key, void *subscriber, Writer *out);
+
+/// Removes a subscription. The notifier no longer runs for it on return.
+/// @param key Key subscribed to.
+/// @param subscriber Pointer given to kvs_subscribe.
+/// @return 0 if the subscription was removed, 1 if there was none.
+int kvs_unsubscribe(const char *key, void *subscriber);
 
 /// Writes the state of the KVS.
-/// @param fd File descriptor to write the output.
-void kvs_show(char output[MAX_WRITE_SIZE]);
+/// @param out Writer that receives every pair.
+void kvs_show(Writer *out);
 
-/// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
-/// @return 0 if the backup was successful, 1 otherwise.
-int kvs_backup(const char* backup_file_path, int backupCounter, int maxBackups);
+/// Takes a snapshot of the KVS state and starts a backup thread that writes
+/// it to the correspondent backup file, as a delta of the last backup of
+/// the job written successfully or in full. Blocks while maxBackups backups
+/// are still being written.
+/// @param chain Backups written so far by the job. The backup thread reports
+///              to it, so it must stay until backup_chain_destroy.
+/// @return 0 if the backup was started, -1 otherwise.
+int kvs_backup(const char* backup_file_path, int backupCounter, int maxBackups, BackupChain *chain);
+
+/// Waits until every backup started by kvs_backup has been written.
+void kvs_wait_backups();
 
 /// Waits for a given amount of time.
 /// @param delay_us Delay in milliseconds.
@@ -68,11 +122,5 @@ char *remove_extension(const char *file_path, const char *ext);
 /// @return Pointer to the new file path with the added extension.
 char *add_extension(const char *file_path, const char *ext);
 
-/// Writes the given output to a specified file descriptor.
-/// @param output The string to be written.
-/// @param fd File descriptor where the string will be written.
-/// @return 0 if the string was written successfully, -1 otherwise.
-int write_in_file(char output[MAX_WRITE_SIZE], int fd);
-
 #endif  // KVS_OPERATIONS_H
 
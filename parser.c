@@ -1,20 +1,26 @@
 #include "parser.h"
 #include <stdio.h>
+#include <ctype.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 
 #include "constants.h"
-
-static int read_string(int fd, char *buffer, size_t max) {
+#include "reader.h"
+#include "tokenizer.h"
+
+// Reads a key or value up to the next delimiter. A backslash makes the
+// following printable character part of the string, so keys and values can
+// hold spaces, commas, parentheses, brackets and backslashes.
+// @return 0 if ended by ',', 1 if ended by ')', 2 if ended by ']', -1 on error.
+static int read_string(Reader *r, char *buffer, size_t max) {
   ssize_t bytes_read;
   char ch;
   size_t i = 0;
   int value = -1;
 
-  while (i < max) {
-    bytes_read = read(fd, &ch, 1);
+  while (1) {
+    bytes_read = reader_getc(r, &ch);
 
     if (bytes_read <= 0) {
         return -1;
@@ -24,6 +30,14 @@ static int read_string(int fd, char *buffer, size_t max) {
       return -1;
     }
 
+    if (ch == '\\') {
+      if (reader_getc(r, &ch) != 1 || !isprint((unsigned char)ch) || i == max - 1) {
+        return -1;
+      }
+      buffer[i++] = ch;
+      continue;
+    }
+
     if (ch == ',') {
       value = 0;
       break;
@@ -37,6 +51,10 @@ static int read_string(int fd, char *buffer, size_t max) {
       break;
     }
 
+    if (i == max - 1) {
+      return -1;
+    }
+
     buffer[i++] = ch;
   }
 
@@ -45,29 +63,39 @@ static int read_string(int fd, char *buffer, size_t max) {
   return value;
 }
 
-static int read_uint(int fd, unsigned int *value, char *next) {
+// Reads decimal digits up to the first other character, which is stored in
+// `next` ('\0' at end of file). Digits past the buffer are still consumed and
+// make the number out of range.
+static int read_uint(Reader *r, unsigned int *value, char *next) {
   char buf[16];
+  char ch;
+  int overflow = 0;
 
   int i = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    if (reader_getc(r, &ch) == 0) {
       *next = '\0';
       break;
     }
 
-    *next = buf[i];
+    *next = ch;
 
-    if (buf[i] > '9' || buf[i] < '0') {
-      buf[i] = '\0';
+    if (ch > '9' || ch < '0') {
       break;
     }
 
-    i++;
+    if (i == (int)sizeof(buf) - 1) {
+      overflow = 1;
+      continue;
+    }
+
+    buf[i++] = ch;
   }
+  buf[i] = '\0';
 
   unsigned long ul = strtoul(buf, NULL, 10);
 
-  if (ul > UINT_MAX) {
+  if (overflow || ul > UINT_MAX) {
     return 1;
   }
 
@@ -76,23 +104,23 @@ static int read_uint(int fd, unsigned int *value, char *next) {
   return 0;
 }
 
-static void cleanup(int fd) {
-  char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
-    ;
+// Skips the rest of the current line, newline included.
+static void cleanup(Reader *r) {
+  const char *line;
+  reader_skip(r, reader_line(r, &line));
 }
 
-enum Command get_next(int fd) {
+enum Command get_next(Reader *r) {
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  if (reader_getc(r, buf) != 1) {
     return EOC;
   }
 
   switch (buf[0]) {
     case 'W':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-        if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
-          cleanup(fd);
+      if (reader_read(r, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+        if (reader_read(r, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
+          cleanup(r);
           return CMD_INVALID;
         }
         return CMD_WRITE;
@@ -101,114 +129,283 @@ enum Command get_next(int fd) {
       return CMD_WAIT;
 
     case 'R':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
-        cleanup(fd);
+      if (reader_read(r, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+        cleanup(r);
         return CMD_INVALID;
       }
 
       return CMD_READ;
 
     case 'D':
-      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
-        cleanup(fd);
+      if (reader_read(r, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
+        cleanup(r);
         return CMD_INVALID;
       }
 
       return CMD_DELETE;
 
     case 'S':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
-        cleanup(fd);
+      if (reader_read(r, buf + 1, 3) != 3 || (strncmp(buf, "SHOW", 4) != 0 && strncmp(buf, "SUBS", 4) != 0)) {
+        cleanup(r);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-        cleanup(fd);
+      if (buf[1] == 'U') {
+        if (reader_read(r, buf + 4, 6) != 6 || strncmp(buf, "SUBSCRIBE ", 10) != 0) {
+          cleanup(r);
+          return CMD_INVALID;
+        }
+        return CMD_SUBSCRIBE;
+      }
+
+      if (reader_read(r, buf + 4, 1) != 0 && buf[4] != '\n') {
+        cleanup(r);
         return CMD_INVALID;
       }
 
       return CMD_SHOW;
 
+    case 'U':
+      if (reader_read(r, buf + 1, 11) != 11 || strncmp(buf, "UNSUBSCRIBE ", 12) != 0) {
+        cleanup(r);
+        return CMD_INVALID;
+      }
+
+      return CMD_UNSUBSCRIBE;
+
     case 'B':
-      if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
-        cleanup(fd);
+      if (reader_read(r, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
+        cleanup(r);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
-        cleanup(fd);
+      if (reader_read(r, buf + 6, 1) != 0 && buf[6] != '\n') {
+        cleanup(r);
         return CMD_INVALID;
       }
 
       return CMD_BACKUP;
 
     case 'H':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
-        cleanup(fd);
+      if (reader_read(r, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+        cleanup(r);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-        cleanup(fd);
+      if (reader_read(r, buf + 4, 1) != 0 && buf[4] != '\n') {
+        cleanup(r);
         return CMD_INVALID;
       }
 
       return CMD_HELP;
 
     case '#':
-      cleanup(fd);
+      cleanup(r);
       return CMD_EMPTY;
 
     case '\n':
       return CMD_EMPTY;
 
     default:
-      cleanup(fd);
+      cleanup(r);
       return CMD_INVALID;
   }
 }
 
-int parse_pair(int fd, char *key, char *value) {
-  if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
-    cleanup(fd);
+// Marks kept for a WRITE, READ or DELETE line parsed from memory: enough for
+// MAX_WRITE_SIZE pairs with a few escapes. Lines with more go through the
+// byte at a time parser.
+#define MAX_LINE_MARKS (4 * MAX_WRITE_SIZE + 64)
+
+// A line of the reader with the offsets of its structural characters.
+typedef struct Line {
+  const char *bytes;
+  size_t len;
+  size_t pos;
+  const uint32_t *marks;
+  size_t count;
+  size_t next;
+} Line;
+
+static void line_scan(Reader *r, Line *line, uint32_t *marks) {
+  line->len = reader_line(r, &line->bytes);
+  line->pos = 0;
+  line->marks = marks;
+  line->count = tokenize_line(line->bytes, line->len, marks, MAX_LINE_MARKS);
+  line->next = 0;
+}
+
+// Copies a key or value from the line into buffer, with the semantics of
+// read_string. Returns the delimiter, or -1 whenever read_string would fail
+// or would read past the line, in which case the caller falls back to it.
+static int line_string(Line *line, char *buffer, size_t max) {
+  size_t i = 0;
+
+  while (line->next < line->count && line->marks[line->next] < line->pos) {
+    line->next++;
+  }
+
+  while (line->next < line->count) {
+    size_t mark = line->marks[line->next++];
+    size_t n = mark - line->pos;
+
+    if (i + n > max - 1) {
+      return -1;
+    }
+    memcpy(buffer + i, line->bytes + line->pos, n);
+    i += n;
+    line->pos = mark + 1;
+
+    switch (line->bytes[mark]) {
+      case '\\':
+        if (line->pos == line->len || !isprint((unsigned char)line->bytes[line->pos]) || i == max - 1) {
+          return -1;
+        }
+        buffer[i++] = line->bytes[line->pos++];
+        if (line->next < line->count && line->marks[line->next] < line->pos) {
+          line->next++;
+        }
+        break;
+      case ',':
+        buffer[i] = '\0';
+        return 0;
+      case ')':
+        buffer[i] = '\0';
+        return 1;
+      case ']':
+        buffer[i] = '\0';
+        return 2;
+      default:
+        return -1;
+    }
+  }
+
+  return -1;
+}
+
+// Reads the byte after the parsed part of the line, -1 if there is none.
+static int line_next(Line *line) {
+  return line->pos < line->len ? line->bytes[line->pos++] : -1;
+}
+
+// Parses the pairs of a WRITE line held in memory. Returns 0 without
+// consuming anything if the line is invalid or does not end the command.
+static size_t write_from_line(Reader *r, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE],
+                              size_t max_pairs, size_t max_string_size) {
+  uint32_t marks[MAX_LINE_MARKS];
+  Line line;
+  line_scan(r, &line, marks);
+
+  if (line_next(&line) != '[' || line_next(&line) != '(') {
+    return 0;
+  }
+
+  size_t num_pairs = 0;
+  while (1) {
+    if (num_pairs == max_pairs || line_string(&line, keys[num_pairs], max_string_size) != 0 ||
+        line_string(&line, values[num_pairs], max_string_size) != 1) {
+      return 0;
+    }
+    num_pairs++;
+
+    int ch = line_next(&line);
+    if (ch == ']') {
+      break;
+    }
+    if (ch != '(') {
+      return 0;
+    }
+  }
+
+  int ch = line_next(&line);
+  if (num_pairs == max_pairs || (ch != '\n' && ch != '\0')) {
+    return 0;
+  }
+
+  reader_skip(r, line.pos);
+  return num_pairs;
+}
+
+// Parses the keys of a READ or DELETE line held in memory, like
+// write_from_line.
+static size_t keys_from_line(Reader *r, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
+  uint32_t marks[MAX_LINE_MARKS];
+  Line line;
+  line_scan(r, &line, marks);
+
+  if (line_next(&line) != '[') {
+    return 0;
+  }
+
+  size_t num_keys = 0;
+  while (1) {
+    if (num_keys == max_keys) {
+      return 0;
+    }
+
+    int output = line_string(&line, keys[num_keys], max_string_size);
+    if (output != 0 && output != 2) {
+      return 0;
+    }
+    num_keys++;
+
+    if (output == 2) {
+      break;
+    }
+  }
+
+  int ch = line_next(&line);
+  if (num_keys == max_keys || (ch != '\n' && ch != '\0')) {
+    return 0;
+  }
+
+  reader_skip(r, line.pos);
+  return num_keys;
+}
+
+int parse_pair(Reader *r, char *key, char *value) {
+  if (read_string(r, key, MAX_STRING_SIZE) != 0) {
+    cleanup(r);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
-    cleanup(fd);
+  if (read_string(r, value, MAX_STRING_SIZE) != 1) {
+    cleanup(r);
     return 0;
   }
 
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+size_t parse_write(Reader *r, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+  size_t num_pairs = write_from_line(r, keys, values, max_pairs, max_string_size);
+  if (num_pairs > 0) {
+    return num_pairs;
+  }
+
+  // Invalid commands and pairs spanning lines are parsed a byte at a time,
+  // which decides how much of the file they consume.
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  if (reader_getc(r, &ch) != 1 || ch != '[') {
+    cleanup(r);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '(') {
-    cleanup(fd);
+  if (reader_getc(r, &ch) != 1 || ch != '(') {
+    cleanup(r);
     return 0;
   }
 
-  size_t num_pairs = 0;
-  char key[max_string_size];
-  char value[max_string_size];
   while (num_pairs < max_pairs) {
-    if(parse_pair(fd, key, value) == 0) {
-      cleanup(fd);
+    if(parse_pair(r, keys[num_pairs], values[num_pairs]) == 0) {
+      cleanup(r);
       return 0;
     }
+    num_pairs++;
 
-    strcpy(keys[num_pairs], key);
-    strcpy(values[num_pairs++], value);
-
-    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
-      cleanup(fd);
+    if (reader_getc(r, &ch) != 1 || (ch != '(' && ch != ']')) {
+      cleanup(r);
       return 0;
     }
 
@@ -218,38 +415,40 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
   }
 
   if (num_pairs == max_pairs) {
-    cleanup(fd);
+    cleanup(r);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (reader_getc(r, &ch) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(r);
     return 0;
   }
 
   return num_pairs;
 }
 
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
+size_t parse_read_delete(Reader *r, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
+  size_t num_keys = keys_from_line(r, keys, max_keys, max_string_size);
+  if (num_keys > 0) {
+    return num_keys;
+  }
+
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  if (reader_getc(r, &ch) != 1 || ch != '[') {
+    cleanup(r);
     return 0;
   }
 
-
-  size_t num_keys = 0;
-  char key[max_string_size];
   while (num_keys < max_keys) {
-    int output = read_string(fd, key, max_string_size);
+    int output = read_string(r, keys[num_keys], max_string_size);
     if(output < 0 || output == 1) {
 
-      cleanup(fd);
+      cleanup(r);
       return 0;
     }
 
-    strcpy(keys[num_keys++], key);
+    num_keys++;
 
     if (output == 2){
       break;
@@ -257,34 +456,34 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
   }
 
   if (num_keys == max_keys) {
-    cleanup(fd);
+    cleanup(r);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (reader_getc(r, &ch) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(r);
     return 0;
   }
 
   return num_keys;
 }
 
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
+int parse_wait(Reader *r, unsigned int *delay, unsigned int *thread_id) {
   char ch;
 
-  if (read_uint(fd, delay, &ch) != 0) {
-    cleanup(fd);
+  if (read_uint(r, delay, &ch) != 0) {
+    cleanup(r);
     return -1;
   }
 
   if (ch == ' ') {
     if (thread_id == NULL) {
-      cleanup(fd);
+      cleanup(r);
       return 0;
     }
 
-    if (read_uint(fd, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
-      cleanup(fd);
+    if (read_uint(r, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+      cleanup(r);
       return -1;
     }
 
@@ -292,7 +491,7 @@ int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   } else if (ch == '\n' || ch == '\0') {
     return 0;
   } else {
-    cleanup(fd);
+    cleanup(r);
     return -1;
   }
 }
@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include "constants.h"
+#include "reader.h"
 
 enum Command {
   CMD_WRITE,
@@ -12,38 +13,40 @@ enum Command {
   CMD_WAIT,
   CMD_BACKUP,
   CMD_HELP,
+  CMD_SUBSCRIBE,
+  CMD_UNSUBSCRIBE,
   CMD_EMPTY,
   CMD_INVALID,
   EOC  // End of commands
 };
 
 /// Reads a line and returns the corresponding command.
-/// @param fd File descriptor to read from.
+/// @param r Reader over the job file.
 /// @return The command read.
-enum Command get_next(int fd);
+enum Command get_next(Reader *r);
 
 /// Parses a WRITE command.
-/// @param fd File descriptor to read from.
+/// @param r Reader over the job file.
 /// @param keys Array of keys to be written.
 /// @param values Array of values to be written.
 /// @param max_pairs number of pairs to be written.
 /// @param max_string_size maximum size for keys and values.
 /// @return 0 if the command was parsed successfully, 1 otherwise.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
+size_t parse_write(Reader *r, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
 
-/// Parses a READ or DELETE command.
-/// @param fd File descriptor to read from.
+/// Parses a READ, DELETE, SUBSCRIBE or UNSUBSCRIBE command.
+/// @param r Reader over the job file.
 /// @param keys Array of keys to be written.
 /// @param max_keys number of keys to be iread or deleted.
 /// @param max_string_size maximum size for keys and values.
 /// @return Number of keys read or deleted. 0 on failure.
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
+size_t parse_read_delete(Reader *r, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
 
 /// Parses a WAIT command.
-/// @param fd File descriptor to read from.
+/// @param r Reader over the job file.
 /// @param delay Pointer to the variable to store the wait delay in.
 /// @param thread_id Pointer to the variable to store the thread ID in. May not be set.
 /// @return 0 if no thread was specified, 1 if a thread was specified, -1 on error.
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id);
+int parse_wait(Reader *r, unsigned int *delay, unsigned int *thread_id);
 
 #endif  // KVS_PARSER_H
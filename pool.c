@@ -0,0 +1,184 @@
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Runs the oldest queued task. Called with the lock held, which is
+// released while the task runs.
+static void run_task(JobPool *pool) {
+  PoolTask task = pool->tasks[pool->task_head];
+  pool->task_head = (pool->task_head + 1) % pool->task_capacity;
+  pool->task_count--;
+  pthread_mutex_unlock(&pool->lock);
+
+  task.run(task.arg);
+
+  pthread_mutex_lock(&pool->lock);
+  if (--task.group->pending == 0) {
+    pthread_cond_broadcast(&pool->task_done);
+  }
+}
+
+static void *worker(void *arg) {
+  JobPool *pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    while (pool->task_count == 0 && pool->count == 0 && !pool->closed) {
+      pthread_cond_wait(&pool->not_empty, &pool->lock);
+    }
+    // Chunks of a job file already running come before new job files
+    if (pool->task_count > 0) {
+      run_task(pool);
+      continue;
+    }
+    if (pool->count == 0) {
+      break;
+    }
+
+    char *path = pool->paths[pool->head];
+    pool->head = (pool->head + 1) % pool->capacity;
+    pool->count--;
+    pthread_cond_signal(&pool->not_full);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool->run(path, pool->ctx);
+    free(path);
+
+    pthread_mutex_lock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+int pool_start(JobPool *pool, int workers, size_t capacity, job_runner run, void *ctx) {
+  pool->paths = malloc(capacity * sizeof(char *));
+  pool->tasks = malloc(POOL_INITIAL_TASKS * sizeof(PoolTask));
+  pool->workers = malloc((size_t)workers * sizeof(pthread_t));
+  if (capacity == 0 || workers <= 0 || !pool->paths || !pool->tasks || !pool->workers) {
+    free(pool->paths);
+    free(pool->tasks);
+    free(pool->workers);
+    return 1;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->not_empty, NULL);
+  pthread_cond_init(&pool->not_full, NULL);
+  pthread_cond_init(&pool->task_done, NULL);
+  pool->task_head = 0;
+  pool->task_count = 0;
+  pool->task_capacity = POOL_INITIAL_TASKS;
+  pool->head = 0;
+  pool->count = 0;
+  pool->capacity = capacity;
+  pool->closed = 0;
+  pool->run = run;
+  pool->ctx = ctx;
+
+  // Fewer workers than asked for still drain the queue
+  pool->started = 0;
+  while (pool->started < workers) {
+    if (pthread_create(&pool->workers[pool->started], NULL, worker, pool) != 0) {
+      perror("Failed to create thread");
+      break;
+    }
+    pool->started++;
+  }
+
+  if (pool->started == 0) {
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_cond_destroy(&pool->not_full);
+    pthread_cond_destroy(&pool->task_done);
+    free(pool->paths);
+    free(pool->tasks);
+    free(pool->workers);
+    return 1;
+  }
+  return 0;
+}
+
+int pool_submit(JobPool *pool, const char *path) {
+  char *copy = strdup(path);
+  if (copy == NULL) {
+    return 1;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->count == pool->capacity) {
+    pthread_cond_wait(&pool->not_full, &pool->lock);
+  }
+  pool->paths[(pool->head + pool->count) % pool->capacity] = copy;
+  pool->count++;
+  pthread_cond_signal(&pool->not_empty);
+  pthread_mutex_unlock(&pool->lock);
+
+  return 0;
+}
+
+// Doubles the task queue, moving the queued tasks to its start.
+static int grow_tasks(JobPool *pool) {
+  size_t capacity = pool->task_capacity * 2;
+  PoolTask *tasks = malloc(capacity * sizeof(PoolTask));
+  if (tasks == NULL) {
+    return 1;
+  }
+  for (size_t i = 0; i < pool->task_count; i++) {
+    tasks[i] = pool->tasks[(pool->task_head + i) % pool->task_capacity];
+  }
+  free(pool->tasks);
+  pool->tasks = tasks;
+  pool->task_head = 0;
+  pool->task_capacity = capacity;
+  return 0;
+}
+
+void pool_spawn(JobPool *pool, TaskGroup *group, task_fn run, void *arg) {
+  pthread_mutex_lock(&pool->lock);
+  if (pool->task_count == pool->task_capacity && grow_tasks(pool)) {
+    // Nobody can steal it: the spawning worker runs it right away
+    pthread_mutex_unlock(&pool->lock);
+    run(arg);
+    return;
+  }
+
+  pool->tasks[(pool->task_head + pool->task_count) % pool->task_capacity] = (PoolTask){run, arg, group};
+  pool->task_count++;
+  group->pending++;
+  pthread_cond_signal(&pool->not_empty);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(JobPool *pool, TaskGroup *group) {
+  pthread_mutex_lock(&pool->lock);
+  while (group->pending > 0) {
+    if (pool->task_count > 0) {
+      run_task(pool);
+    } else {
+      pthread_cond_wait(&pool->task_done, &pool->lock);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_finish(JobPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->closed = 1;
+  pthread_cond_broadcast(&pool->not_empty);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->started; i++) {
+    pthread_join(pool->workers[i], NULL);
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->not_empty);
+  pthread_cond_destroy(&pool->not_full);
+  pthread_cond_destroy(&pool->task_done);
+  free(pool->paths);
+  free(pool->tasks);
+  free(pool->workers);
+}
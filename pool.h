@@ -0,0 +1,91 @@
+#ifndef KVS_POOL_H
+#define KVS_POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+// Job files waiting for a worker. The directory scan blocks once the queue
+// is full, so a directory of any size is fed with bounded memory.
+#define POOL_QUEUE_SIZE 1024
+
+// Chunk tasks a job file can start before it has to grow the task queue.
+#define POOL_INITIAL_TASKS 64
+
+/// Runs one chunk of a job file.
+/// @param arg Pointer given to pool_spawn.
+typedef void (*task_fn)(void *arg);
+
+// Chunk tasks spawned together, which pool_wait waits for.
+typedef struct TaskGroup {
+  int pending;
+} TaskGroup;
+
+typedef struct PoolTask {
+  task_fn run;
+  void *arg;
+  TaskGroup *group;
+} PoolTask;
+
+/// Runs one job file on a worker thread.
+/// @param path Path of the job file.
+/// @param ctx Pointer given to pool_start.
+typedef void (*job_runner)(const char *path, void *ctx);
+
+// Fixed set of worker threads that take job file paths from a bounded
+// queue, in the order they were submitted, until the queue is closed and
+// drained. Chunks of a large job file are queued as tasks, which idle
+// workers take before starting another job file.
+typedef struct JobPool {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  pthread_cond_t task_done;
+  char **paths;
+  size_t head;
+  size_t count;
+  size_t capacity;
+  PoolTask *tasks;
+  size_t task_head;
+  size_t task_count;
+  size_t task_capacity;
+  int closed;
+  pthread_t *workers;
+  int started;
+  job_runner run;
+  void *ctx;
+} JobPool;
+
+/// Starts the workers of a pool.
+/// @param pool Pool to start.
+/// @param workers Number of worker threads.
+/// @param capacity Paths the queue holds before pool_submit blocks.
+/// @param run Function that processes a job file.
+/// @param ctx Pointer passed to every call of run.
+/// @return 0 on success, 1 if no worker could be started.
+int pool_start(JobPool *pool, int workers, size_t capacity, job_runner run, void *ctx);
+
+/// Queues a job file, waiting while the queue is full.
+/// @param pool Pool to feed.
+/// @param path Path of the job file; it is copied.
+/// @return 0 on success, 1 if the path could not be copied.
+int pool_submit(JobPool *pool, const char *path);
+
+/// Queues a chunk task that any worker may run.
+/// @param pool Pool of the worker running the job file.
+/// @param group Group the task belongs to; pool_wait waits for it.
+/// @param run Function that runs the chunk.
+/// @param arg Pointer passed to run.
+void pool_spawn(JobPool *pool, TaskGroup *group, task_fn run, void *arg);
+
+/// Waits until every task of a group has run, running queued tasks
+/// meanwhile instead of sleeping.
+/// @param pool Pool the tasks were spawned on.
+/// @param group Group to wait for.
+void pool_wait(JobPool *pool, TaskGroup *group);
+
+/// Closes the queue, waits until the workers have processed every queued
+/// job file and frees the pool.
+/// @param pool Pool to finish.
+void pool_finish(JobPool *pool);
+
+#endif  // KVS_POOL_H
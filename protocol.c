@@ -0,0 +1,46 @@
+#include "protocol.h"
+
+#include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+int read_exact(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 1;
+    p += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+int write_exact(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 1;
+    p += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+ssize_t send_response(int fd, enum KvsOp op, enum KvsStatus status, const char *text, size_t length) {
+  ResponseHeader header = {(uint8_t)op, (uint8_t)status, 0, (uint32_t)length};
+  struct iovec iov[2] = {
+      {&header, sizeof(header)},
+      {(void *)text, length},
+  };
+
+  ssize_t n;
+  do {
+    n = writev(fd, iov, length > 0 ? 2 : 1);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;
+  }
+  return n;
+}
@@ -0,0 +1,97 @@
+#ifndef KVS_PROTOCOL_H
+#define KVS_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "constants.h"
+
+// Protocol between kvs in server mode and its clients, over named pipes on
+// the same machine, so integers use the host byte order.
+//
+// A client creates three FIFOs: requests, responses and notifications. It
+// writes a ConnectRequest to the server FIFO, and then opens its request
+// FIFO for writing, its response FIFO for reading and its notification
+// FIFO for reading, in that order. The server opens them in the same order
+// and answers with a CONNECT response.
+//
+// Every request is a RequestHeader followed by `count` keys of
+// MAX_STRING_SIZE bytes each and, for WRITE, `count` values of the same
+// size. Every response is a ResponseHeader followed by `length` bytes of
+// text, formatted like the .out files of job files.
+//
+// SUBSCRIBE answers with the current value of every key, as READ does, and
+// UNSUBSCRIBE with the keys that were not subscribed to, as DELETE does with
+// missing keys. Changes to subscribed keys arrive on the notification FIFO
+// as NOTIFY frames: a ResponseHeader followed by one "(key,value)" line per
+// key, or "(key,DELETED)" for a deleted key. Under backpressure only the
+// latest state of each key is sent.
+
+// Size of a FIFO path in a ConnectRequest, terminator included.
+#define KVS_PIPE_PATH_SIZE 40
+
+enum KvsOp {
+  OP_CONNECT = 1,
+  OP_DISCONNECT = 2,
+  OP_WRITE = 3,
+  OP_READ = 4,
+  OP_DELETE = 5,
+  OP_SUBSCRIBE = 6,
+  OP_UNSUBSCRIBE = 7,
+  OP_NOTIFY = 8
+};
+
+enum KvsStatus {
+  STATUS_OK = 0,
+  STATUS_ERROR = 1
+};
+
+// Written in one write() to the server FIFO. It is smaller than PIPE_BUF,
+// so requests of concurrent clients never interleave.
+typedef struct ConnectRequest {
+  uint8_t op;
+  char request_path[KVS_PIPE_PATH_SIZE];
+  char response_path[KVS_PIPE_PATH_SIZE];
+  char notification_path[KVS_PIPE_PATH_SIZE];
+} ConnectRequest;
+
+typedef struct RequestHeader {
+  uint8_t op;
+  uint8_t reserved;
+  uint16_t count;
+} RequestHeader;
+
+typedef struct ResponseHeader {
+  uint8_t op;
+  uint8_t status;
+  uint16_t reserved;
+  uint32_t length;
+} ResponseHeader;
+
+/// Reads exactly len bytes, retrying short reads and interruptions.
+/// @param fd File descriptor to read from.
+/// @param buf Buffer of at least len bytes.
+/// @param len Number of bytes to read.
+/// @return 0 on success, 1 at end of file or on error.
+int read_exact(int fd, void *buf, size_t len);
+
+/// Writes exactly len bytes, retrying short writes and interruptions.
+/// @param fd File descriptor to write to.
+/// @param buf Bytes to write.
+/// @param len Number of bytes to write.
+/// @return 0 on success, 1 on error.
+int write_exact(int fd, const void *buf, size_t len);
+
+/// Sends as much of a response as the FIFO takes in one writev, so a
+/// non-blocking FIFO never stalls the caller. The caller keeps the rest.
+/// @param fd Response FIFO of the client.
+/// @param op Operation answered.
+/// @param status STATUS_OK or STATUS_ERROR.
+/// @param text Text of the response, NULL if length is 0.
+/// @param length Bytes of text.
+/// @return Bytes written, header included, 0 if the FIFO is full, -1 on
+///         error.
+ssize_t send_response(int fd, enum KvsOp op, enum KvsStatus status, const char *text, size_t length);
+
+#endif  // KVS_PROTOCOL_H
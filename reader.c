@@ -0,0 +1,103 @@
+#include "reader.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+int reader_init(Reader *r, int fd) {
+  r->fd = fd;
+  r->pos = 0;
+  r->end = 0;
+  r->eof = 0;
+  r->capacity = READER_CHUNK_SIZE;
+  r->buf = malloc(r->capacity);
+  return r->buf == NULL;
+}
+
+void reader_destroy(Reader *r) {
+  free(r->buf);
+  r->buf = NULL;
+}
+
+size_t reader_fill(Reader *r) {
+  if (r->eof) {
+    return r->end - r->pos;
+  }
+
+  // Keep the unread bytes, moved to the front of the buffer. The buffer only
+  // grows when a single line fills it.
+  if (r->pos > 0) {
+    memmove(r->buf, r->buf + r->pos, r->end - r->pos);
+    r->end -= r->pos;
+    r->pos = 0;
+  }
+
+  if (r->end == r->capacity) {
+    char *buf = realloc(r->buf, r->capacity * 2);
+    if (!buf) {
+      r->eof = 1;
+      return r->end;
+    }
+    r->buf = buf;
+    r->capacity *= 2;
+  }
+
+  ssize_t bytes_read;
+  do {
+    bytes_read = read(r->fd, r->buf + r->end, r->capacity - r->end);
+  } while (bytes_read < 0 && errno == EINTR);
+
+  if (bytes_read <= 0) {
+    r->eof = 1;
+    return r->end;
+  }
+
+  r->end += (size_t)bytes_read;
+  metrics_parsed((size_t)bytes_read);
+  return r->end;
+}
+
+size_t reader_line(Reader *r, const char **line) {
+  size_t scanned = 0;
+
+  while (1) {
+    size_t available = r->end - r->pos;
+    const char *newline = memchr(r->buf + r->pos + scanned, '\n', available - scanned);
+    if (newline != NULL) {
+      *line = r->buf + r->pos;
+      return (size_t)(newline - *line) + 1;
+    }
+
+    scanned = available;
+    if (r->eof || reader_fill(r) == available) {
+      *line = r->buf + r->pos;
+      return r->end - r->pos;
+    }
+  }
+}
+
+void reader_skip(Reader *r, size_t n) {
+  r->pos += n;
+}
+
+ssize_t reader_read(Reader *r, char *dst, size_t n) {
+  size_t copied = 0;
+
+  while (copied < n) {
+    if (r->pos == r->end && reader_fill(r) == 0) {
+      break;
+    }
+    size_t chunk = r->end - r->pos;
+    if (chunk > n - copied) {
+      chunk = n - copied;
+    }
+    memcpy(dst + copied, r->buf + r->pos, chunk);
+    r->pos += chunk;
+    copied += chunk;
+  }
+
+  return (ssize_t)copied;
+}
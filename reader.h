@@ -0,0 +1,70 @@
+#ifndef KVS_READER_H
+#define KVS_READER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Bytes requested from the file on every refill of a reader.
+#define READER_CHUNK_SIZE 65536
+
+// Buffered reader over a file descriptor. The parser consumes bytes from
+// `buf[pos..end)` and only calls read() when the buffer runs dry, so a job
+// file costs one syscall per chunk instead of one per byte.
+typedef struct Reader {
+  int fd;
+  char *buf;
+  size_t pos;
+  size_t end;
+  size_t capacity;
+  int eof;
+} Reader;
+
+/// Initializes a reader over a file descriptor.
+/// @param r Reader to initialize.
+/// @param fd File descriptor to read from. Not closed by the reader.
+/// @return 0 on success, 1 if the buffer could not be allocated.
+int reader_init(Reader *r, int fd);
+
+/// Frees the buffer of a reader.
+/// @param r Reader to destroy.
+void reader_destroy(Reader *r);
+
+/// Refills the buffer with the next chunk of the file.
+/// @param r Reader to refill.
+/// @return Number of bytes now available, 0 at end of file or on error.
+size_t reader_fill(Reader *r);
+
+/// Makes the rest of the current line, up to and including its newline,
+/// available in the buffer. Grows the buffer for lines longer than a chunk.
+/// @param r Reader to read from.
+/// @param line Receives a pointer to the first unread byte.
+/// @return Bytes available from *line, which end with '\n' unless the file
+/// ends first. 0 at end of file.
+size_t reader_line(Reader *r, const char **line);
+
+/// Consumes bytes returned by reader_line.
+/// @param r Reader to advance.
+/// @param n Number of bytes to consume.
+void reader_skip(Reader *r, size_t n);
+
+/// Reads one byte, with the semantics of read(fd, ch, 1).
+/// @param r Reader to read from.
+/// @param ch Receives the byte.
+/// @return 1 if a byte was read, 0 at end of file or on error.
+static inline ssize_t reader_getc(Reader *r, char *ch) {
+  if (r->pos == r->end && reader_fill(r) == 0) {
+    return 0;
+  }
+  *ch = r->buf[r->pos++];
+  return 1;
+}
+
+/// Reads up to n bytes, with the semantics of read() on a regular file: only
+/// returns fewer than n bytes at end of file.
+/// @param r Reader to read from.
+/// @param dst Buffer to copy the bytes to.
+/// @param n Number of bytes to read.
+/// @return Number of bytes read.
+ssize_t reader_read(Reader *r, char *dst, size_t n);
+
+#endif  // KVS_READER_H
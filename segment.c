@@ -0,0 +1,255 @@
+#include "segment.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kvs.h"
+#include "operations.h"
+
+// Last commands of the segment that used a key: the last one that wrote it,
+// and the first one that read it since then.
+typedef struct KeyState {
+  const char *key;
+  long last_write;
+  long first_read;
+} KeyState;
+
+typedef struct KeyMap {
+  KeyState *slots;
+  size_t mask;
+} KeyMap;
+
+// Commands [from, to) of a segment run by one worker. The first chunk
+// writes to the job file, the others to their own buffer.
+typedef struct Chunk {
+  const Segment *seg;
+  size_t from;
+  size_t to;
+  Writer *out;
+  Writer buffer;
+} Chunk;
+
+void segment_init(Segment *seg, JobPool *pool, int workers) {
+  memset(seg, 0, sizeof(*seg));
+  seg->pool = pool;
+  seg->workers = workers;
+}
+
+void segment_destroy(Segment *seg) {
+  free(seg->commands);
+  free(seg->strings);
+}
+
+static void run_command(enum Command kind, size_t count, char keys[][MAX_STRING_SIZE],
+                        char values[][MAX_STRING_SIZE], Writer *out) {
+  if (kind == CMD_WRITE) {
+    if (kvs_write(count, keys, values)) {
+      fprintf(stderr, "Failed to write pair\n");
+    }
+  } else if (kind == CMD_READ) {
+    if (kvs_read(count, keys, out)) {
+      fprintf(stderr, "Failed to read pair\n");
+    }
+  } else if (kind == CMD_DELETE) {
+    if (kvs_delete(count, keys, out)) {
+      fprintf(stderr, "Failed to delete pair\n");
+    }
+  }
+}
+
+static void run_commands(const Segment *seg, size_t from, size_t to, Writer *out) {
+  for (size_t i = from; i < to; i++) {
+    const SegmentCommand *cmd = &seg->commands[i];
+    char (*keys)[MAX_STRING_SIZE] = seg->strings + cmd->first;
+    run_command(cmd->kind, cmd->count, keys, keys + cmd->count, out);
+  }
+}
+
+static void run_chunk(void *arg) {
+  Chunk *chunk = arg;
+  run_commands(chunk->seg, chunk->from, chunk->to, chunk->out);
+}
+
+static int reserve(Segment *seg, size_t strings) {
+  if (seg->count == seg->capacity) {
+    size_t capacity = seg->capacity ? seg->capacity * 2 : 256;
+    SegmentCommand *commands = realloc(seg->commands, capacity * sizeof(SegmentCommand));
+    if (commands == NULL) return 1;
+    seg->commands = commands;
+    seg->capacity = capacity;
+  }
+
+  if (seg->strings_len + strings > seg->strings_capacity) {
+    size_t capacity = seg->strings_capacity ? seg->strings_capacity * 2 : 1024;
+    while (capacity < seg->strings_len + strings) {
+      capacity *= 2;
+    }
+    char (*grown)[MAX_STRING_SIZE] = realloc(seg->strings, capacity * MAX_STRING_SIZE);
+    if (grown == NULL) return 1;
+    seg->strings = grown;
+    seg->strings_capacity = capacity;
+  }
+  return 0;
+}
+
+void segment_add(Segment *seg, enum Command kind, size_t count, char keys[][MAX_STRING_SIZE],
+                 char values[][MAX_STRING_SIZE], Writer *out) {
+  size_t strings = values != NULL ? 2 * count : count;
+  if (seg->count == SEGMENT_MAX_COMMANDS || seg->strings_len + strings > SEGMENT_MAX_STRINGS) {
+    segment_run(seg, out);
+  }
+
+  if (reserve(seg, strings)) {
+    // Keeps the file order: everything before it runs first
+    segment_run(seg, out);
+    run_command(kind, count, keys, values, out);
+    return;
+  }
+
+  SegmentCommand *cmd = &seg->commands[seg->count++];
+  cmd->kind = kind;
+  cmd->count = count;
+  cmd->first = seg->strings_len;
+  memcpy(seg->strings + seg->strings_len, keys, count * MAX_STRING_SIZE);
+  if (values != NULL) {
+    memcpy(seg->strings + seg->strings_len + count, values, count * MAX_STRING_SIZE);
+  }
+  seg->strings_len += strings;
+}
+
+static KeyState *lookup(KeyMap *map, const char *key) {
+  size_t i = (size_t)hash_key(key) & map->mask;
+  while (map->slots[i].key != NULL && strcmp(map->slots[i].key, key) != 0) {
+    i = (i + 1) & map->mask;
+  }
+  if (map->slots[i].key == NULL) {
+    map->slots[i] = (KeyState){key, -1, -1};
+  }
+  return &map->slots[i];
+}
+
+// Index of the group holding a command: the last group starting at or
+// before it.
+static size_t group_of(const size_t *starts, size_t groups, size_t command) {
+  size_t lo = 0;
+  size_t hi = groups;
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (starts[mid] <= command) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Splits the commands into contiguous groups that share no key with
+// another group, unless every group only reads it. Returns the number of
+// groups, whose first commands are left in starts, or 0 if memory ran out.
+static size_t find_groups(const Segment *seg, size_t *starts) {
+  KeyMap map;
+  size_t size = 16;
+  while (size < 2 * seg->strings_len) {
+    size *= 2;
+  }
+  map.slots = calloc(size, sizeof(KeyState));
+  map.mask = size - 1;
+  if (map.slots == NULL) {
+    return 0;
+  }
+
+  size_t groups = 0;
+  for (size_t j = 0; j < seg->count; j++) {
+    const SegmentCommand *cmd = &seg->commands[j];
+    char (*keys)[MAX_STRING_SIZE] = seg->strings + cmd->first;
+    int writes = cmd->kind != CMD_READ;
+
+    // A write depends on the reads since the last write, or on that write;
+    // a read only on the last write. Groups before those can stay apart.
+    size_t merge = j;
+    for (size_t k = 0; k < cmd->count; k++) {
+      KeyState *state = lookup(&map, keys[k]);
+      long other = writes && state->first_read >= 0 ? state->first_read : state->last_write;
+      if (other >= 0) {
+        size_t start = starts[group_of(starts, groups, (size_t)other)];
+        if (start < merge) merge = start;
+      }
+    }
+    for (size_t k = 0; k < cmd->count; k++) {
+      KeyState *state = lookup(&map, keys[k]);
+      if (writes) {
+        state->last_write = (long)j;
+        state->first_read = -1;
+      } else if (state->first_read < 0) {
+        state->first_read = (long)j;
+      }
+    }
+
+    if (merge == j) {
+      starts[groups++] = j;
+    } else {
+      while (starts[groups - 1] > merge) {
+        groups--;
+      }
+    }
+  }
+
+  free(map.slots);
+  return groups;
+}
+
+void segment_run(Segment *seg, Writer *out) {
+  size_t n = seg->count;
+  size_t *starts = NULL;
+  Chunk *chunks = NULL;
+  size_t count = 0;
+
+  if (n >= SEGMENT_MIN_SPLIT && seg->workers > 1) {
+    starts = malloc(n * sizeof(size_t));
+    chunks = malloc(n * sizeof(Chunk));
+  }
+  size_t groups = starts && chunks ? find_groups(seg, starts) : 0;
+
+  // Consecutive groups are packed into chunks of about a quarter of a
+  // worker's share, so that workers which finish early can take more
+  size_t target = n / ((size_t)seg->workers * 4);
+  if (target < SEGMENT_MIN_CHUNK) target = SEGMENT_MIN_CHUNK;
+  for (size_t g = 0; g < groups; g++) {
+    if (count == 0 || chunks[count - 1].to - chunks[count - 1].from >= target) {
+      chunks[count++] = (Chunk){seg, starts[g], starts[g], out, {0}};
+    }
+    chunks[count - 1].to = g + 1 < groups ? starts[g + 1] : n;
+  }
+
+  size_t buffered = 1;
+  while (buffered < count && writer_init_memory(&chunks[buffered].buffer) == 0) {
+    chunks[buffered].out = &chunks[buffered].buffer;
+    buffered++;
+  }
+
+  if (buffered < 2) {
+    run_commands(seg, 0, n, out);
+  } else {
+    TaskGroup group = {0};
+    for (size_t i = 1; i < buffered; i++) {
+      pool_spawn(seg->pool, &group, run_chunk, &chunks[i]);
+    }
+    run_chunk(&chunks[0]);
+    pool_wait(seg->pool, &group);
+
+    for (size_t i = 1; i < buffered; i++) {
+      writer_put(out, chunks[i].buffer.buf, chunks[i].buffer.len);
+      writer_destroy(&chunks[i].buffer);
+    }
+    // Chunks that got no buffer run last, straight to the file
+    run_commands(seg, chunks[buffered - 1].to, n, out);
+  }
+
+  free(starts);
+  free(chunks);
+  seg->count = 0;
+  seg->strings_len = 0;
+}
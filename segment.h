@@ -0,0 +1,75 @@
+#ifndef KVS_SEGMENT_H
+#define KVS_SEGMENT_H
+
+#include <stddef.h>
+
+#include "constants.h"
+#include "parser.h"
+#include "pool.h"
+#include "writer.h"
+
+// A segment is a run of WRITE, READ and DELETE commands of one job file
+// between two commands that have to see everything before them (SHOW, WAIT,
+// BACKUP, HELP) or the end of the file. Its commands are grouped into
+// contiguous ranges so that no key written in one range is read or written
+// in another; the ranges can then run on any worker, in any order, with the
+// same results as running the commands one after the other. Each range
+// writes to its own buffer, and the buffers are copied to the .out file in
+// file order.
+
+// Segments with fewer commands run on the worker of the job file.
+#define SEGMENT_MIN_SPLIT 64
+
+// Fewest commands in a chunk given to another worker.
+#define SEGMENT_MIN_CHUNK 32
+
+// Limits of a segment, which is run once it reaches either of them.
+#define SEGMENT_MAX_COMMANDS 65536
+#define SEGMENT_MAX_STRINGS (1 << 20)
+
+typedef struct SegmentCommand {
+  enum Command kind;
+  size_t count;
+  // Index of the first key in `keys`; the values of a WRITE follow them
+  size_t first;
+} SegmentCommand;
+
+typedef struct Segment {
+  JobPool *pool;
+  int workers;
+  SegmentCommand *commands;
+  size_t count;
+  size_t capacity;
+  char (*strings)[MAX_STRING_SIZE];
+  size_t strings_len;
+  size_t strings_capacity;
+} Segment;
+
+/// Initializes an empty segment.
+/// @param seg Segment to initialize.
+/// @param pool Pool whose workers may run its chunks.
+/// @param workers Number of workers of the pool.
+void segment_init(Segment *seg, JobPool *pool, int workers);
+
+/// Frees the commands of a segment.
+/// @param seg Segment to free.
+void segment_destroy(Segment *seg);
+
+/// Appends a parsed command to a segment. A full segment is run first, and
+/// a command that cannot be stored is run right away.
+/// @param seg Segment to append to.
+/// @param kind CMD_WRITE, CMD_READ or CMD_DELETE.
+/// @param count Number of keys.
+/// @param keys Keys of the command.
+/// @param values Values of a WRITE, NULL otherwise.
+/// @param out Writer of the job file.
+void segment_add(Segment *seg, enum Command kind, size_t count, char keys[][MAX_STRING_SIZE],
+                 char values[][MAX_STRING_SIZE], Writer *out);
+
+/// Runs every command of a segment and empties it.
+/// @param seg Segment to run.
+/// @param out Writer of the job file, which receives the output in file
+///            order.
+void segment_run(Segment *seg, Writer *out);
+
+#endif  // KVS_SEGMENT_H
@@ -0,0 +1,567 @@
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "notify.h"
+#include "operations.h"
+#include "writer.h"
+
+struct IoThread;
+
+// A connected client. It belongs to one serving thread, the only one that
+// touches it, so it needs no lock. An idle session holds no buffers: the
+// body of a request only exists while it is being read, and a response
+// only while the client is slow to take it.
+typedef struct Session {
+  int req;
+  int resp;
+  NotifyQueue *notify;
+  struct IoThread *thread;
+  struct Session *prev;
+  struct Session *next;
+  // Request being read: `received` bytes of the header and then the body
+  RequestHeader header;
+  size_t received;
+  char *body;
+  // Bytes of the last response the FIFO did not take yet
+  char *pending;
+  size_t pending_len;
+  size_t pending_sent;
+  // Set once the session ends as soon as the response is out
+  int closing;
+  int dead;
+} Session;
+
+// Serving thread: waits on its epoll instance for requests and for slow
+// clients to make room for their responses.
+typedef struct IoThread {
+  pthread_t thread;
+  int epoll;
+  // Protects the list, which the host thread adds sessions to
+  pthread_mutex_t lock;
+  Session *sessions;
+  // Text of the response being built
+  Writer out;
+} IoThread;
+
+// A client between its connection request and its CONNECT response.
+typedef struct Handshake {
+  ConnectRequest request;
+  int req;
+  int resp;
+  int notif;
+  uint64_t deadline;
+} Handshake;
+
+// The epoll data of a session FIFO is the session pointer, with the low bit
+// telling which FIFO it is. The stop pipe is 0.
+enum EventSource {
+  SOURCE_REQUEST = 0,
+  SOURCE_RESPONSE = 1
+};
+
+// Written once by the SIGINT/SIGTERM handler and never read: the read end
+// stays readable, which wakes the host and every serving thread.
+static int stop_pipe[2] = {-1, -1};
+
+static void request_stop(int sig) {
+  (void)sig;
+  int saved = errno;
+  ssize_t ignored = write(stop_pipe[1], "x", 1);
+  (void)ignored;
+  errno = saved;
+}
+
+static int stopping(void) {
+  struct pollfd p = {stop_pipe[0], POLLIN, 0};
+  return poll(&p, 1, 0) > 0;
+}
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void watch(Session *s, int op, int fd, enum EventSource source, uint32_t events) {
+  struct epoll_event event = {.events = events, .data.u64 = (uint64_t)(uintptr_t)s | source};
+  epoll_ctl(s->thread->epoll, op, fd, &event);
+}
+
+static void free_session(Session *s) {
+  epoll_ctl(s->thread->epoll, EPOLL_CTL_DEL, s->req, NULL);
+  if (s->pending != NULL) {
+    epoll_ctl(s->thread->epoll, EPOLL_CTL_DEL, s->resp, NULL);
+  }
+  close(s->req);
+  close(s->resp);
+  notify_close(s->notify);
+
+  pthread_mutex_lock(&s->thread->lock);
+  if (s->prev != NULL) {
+    s->prev->next = s->next;
+  } else {
+    s->thread->sessions = s->next;
+  }
+  if (s->next != NULL) s->next->prev = s->prev;
+  pthread_mutex_unlock(&s->thread->lock);
+
+  free(s->body);
+  free(s->pending);
+  free(s);
+}
+
+// Sends a response, keeping whatever the FIFO does not take. Until it is
+// out the session reads no more requests, which holds back a client that
+// does not read its responses. Returns 1 when the client is gone.
+static int respond(Session *s, enum KvsOp op, enum KvsStatus status, const char *text, size_t length) {
+  ssize_t n = send_response(s->resp, op, status, text, length);
+  if (n < 0) {
+    return 1;
+  }
+  size_t done = (size_t)n;
+  size_t total = sizeof(ResponseHeader) + length;
+  if (done == total) {
+    return 0;
+  }
+
+  s->pending = malloc(total - done);
+  if (s->pending == NULL) {
+    return 1;
+  }
+  s->pending_len = 0;
+  s->pending_sent = 0;
+  if (done < sizeof(ResponseHeader)) {
+    ResponseHeader header = {(uint8_t)op, (uint8_t)status, 0, (uint32_t)length};
+    s->pending_len = sizeof(header) - done;
+    memcpy(s->pending, (char *)&header + done, s->pending_len);
+    done = sizeof(header);
+  }
+  if (total > done) {
+    memcpy(s->pending + s->pending_len, text + (done - sizeof(ResponseHeader)), total - done);
+    s->pending_len += total - done;
+  }
+
+  watch(s, EPOLL_CTL_MOD, s->req, SOURCE_REQUEST, 0);
+  watch(s, EPOLL_CTL_ADD, s->resp, SOURCE_RESPONSE, EPOLLOUT);
+  return 0;
+}
+
+// Writes what is left of a response once the client made room for it.
+// Returns 1 when the session is over.
+static int flush_pending(Session *s) {
+  while (s->pending_sent < s->pending_len) {
+    ssize_t n = write(s->resp, s->pending + s->pending_sent, s->pending_len - s->pending_sent);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (n < 0) return 1;
+    s->pending_sent += (size_t)n;
+  }
+
+  epoll_ctl(s->thread->epoll, EPOLL_CTL_DEL, s->resp, NULL);
+  free(s->pending);
+  s->pending = NULL;
+  if (s->closing) {
+    return 1;
+  }
+  watch(s, EPOLL_CTL_MOD, s->req, SOURCE_REQUEST, EPOLLIN);
+  return 0;
+}
+
+// Ends the session once its last response is out.
+static int respond_and_close(Session *s, enum KvsOp op, enum KvsStatus status) {
+  s->closing = 1;
+  return respond(s, op, status, NULL, 0) != 0 || s->pending == NULL;
+}
+
+static size_t body_size(const RequestHeader *header) {
+  return (size_t)header->count * MAX_STRING_SIZE * (header->op == OP_WRITE ? 2 : 1);
+}
+
+// Subscribes to every key, answering with their current values like READ.
+static int subscribe(NotifyQueue *notify, size_t count, char keys[][MAX_STRING_SIZE], Writer *out) {
+  int failed = 0;
+  writer_puts(out, "[");
+  for (size_t i = 0; i < count; i++) {
+    failed |= notify_subscribe(notify, keys[i], out);
+  }
+  writer_puts(out, "]\n");
+  return failed;
+}
+
+// Unsubscribes from every key, answering with the keys that were not
+// subscribed to like DELETE does with missing keys.
+static void unsubscribe(NotifyQueue *notify, size_t count, char keys[][MAX_STRING_SIZE], Writer *out) {
+  int missing = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (notify_unsubscribe(notify, keys[i])) {
+      writer_puts(out, missing++ ? "(" : "[(");
+      writer_puts(out, keys[i]);
+      writer_puts(out, ",KVSMISSING)");
+    }
+  }
+  if (missing) {
+    writer_puts(out, "]\n");
+  }
+}
+
+// Runs a request whose body was read whole. Returns 1 when the client is
+// gone.
+static int dispatch(Session *s, Writer *out) {
+  enum KvsOp op = s->header.op;
+  size_t count = s->header.count;
+  char (*keys)[MAX_STRING_SIZE] = (char (*)[MAX_STRING_SIZE])(void *)s->body;
+  char (*values)[MAX_STRING_SIZE] = op == OP_WRITE ? keys + count : NULL;
+
+  for (size_t i = 0; i < count; i++) {
+    keys[i][MAX_STRING_SIZE - 1] = '\0';
+    if (values != NULL) values[i][MAX_STRING_SIZE - 1] = '\0';
+  }
+
+  out->len = 0;
+  out->failed = 0;
+  int failed = 0;
+  if (op == OP_WRITE) {
+    failed = kvs_write(count, keys, values);
+  } else if (op == OP_READ) {
+    failed = kvs_read(count, keys, out);
+  } else if (op == OP_DELETE) {
+    failed = kvs_delete(count, keys, out);
+  } else if (op == OP_SUBSCRIBE) {
+    failed = subscribe(s->notify, count, keys, out);
+  } else {
+    unsubscribe(s->notify, count, keys, out);
+  }
+  failed |= out->failed;
+
+  return respond(s, op, failed ? STATUS_ERROR : STATUS_OK, out->buf, out->len);
+}
+
+// Reads whatever the client sent, running every request completed, until
+// the FIFO is empty or a response has to wait. Returns 1 when the session
+// is over.
+static int on_readable(Session *s, Writer *out) {
+  while (s->pending == NULL) {
+    char *dst;
+    size_t need;
+    if (s->received < sizeof(RequestHeader)) {
+      dst = (char *)&s->header + s->received;
+      need = sizeof(RequestHeader) - s->received;
+    } else {
+      size_t done = s->received - sizeof(RequestHeader);
+      dst = s->body + done;
+      need = body_size(&s->header) - done;
+    }
+
+    ssize_t n = read(s->req, dst, need);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (n <= 0) return 1;
+    s->received += (size_t)n;
+    if ((size_t)n < need) continue;
+
+    if (s->body == NULL) {
+      enum KvsOp op = s->header.op;
+      if (op == OP_DISCONNECT) {
+        return respond_and_close(s, OP_DISCONNECT, STATUS_OK);
+      }
+      // An unknown operation or count leaves the stream impossible to follow
+      if ((op != OP_WRITE && op != OP_READ && op != OP_DELETE && op != OP_SUBSCRIBE && op != OP_UNSUBSCRIBE) ||
+          s->header.count == 0 || s->header.count > MAX_WRITE_SIZE) {
+        return respond_and_close(s, op, STATUS_ERROR);
+      }
+      s->body = malloc(body_size(&s->header));
+      if (s->body == NULL) {
+        return 1;
+      }
+      continue;
+    }
+
+    int failed = dispatch(s, out);
+    free(s->body);
+    s->body = NULL;
+    s->received = 0;
+    if (failed) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void *io_main(void *arg) {
+  IoThread *t = arg;
+  struct epoll_event events[SERVER_EVENTS];
+  Session *ended[SERVER_EVENTS];
+  int running = 1;
+
+  while (running) {
+    int n = epoll_wait(t->epoll, events, SERVER_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      perror("Failed to wait for clients");
+      break;
+    }
+
+    // Sessions that end are freed after the batch, which may still hold
+    // events for their other FIFO
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+      uint64_t data = events[i].data.u64;
+      if (data == 0) {
+        running = 0;
+        continue;
+      }
+      Session *s = (Session *)(uintptr_t)(data & ~(uint64_t)1);
+      if (s->dead) {
+        continue;
+      }
+      int over;
+      if ((data & 1) == SOURCE_RESPONSE) {
+        over = flush_pending(s);
+      } else if (s->pending != NULL) {
+        // The request FIFO is not watched while a response waits, yet
+        // epoll still reports that the client closed it
+        over = (events[i].events & (EPOLLHUP | EPOLLERR)) != 0;
+      } else {
+        over = on_readable(s, &t->out);
+      }
+      if (over) {
+        s->dead = 1;
+        ended[count++] = s;
+      }
+    }
+    for (int i = 0; i < count; i++) {
+      free_session(ended[i]);
+    }
+  }
+
+  while (1) {
+    pthread_mutex_lock(&t->lock);
+    Session *s = t->sessions;
+    pthread_mutex_unlock(&t->lock);
+    if (s == NULL) break;
+    free_session(s);
+  }
+  return NULL;
+}
+
+static void drop_handshake(Handshake *h) {
+  if (h->notif >= 0) close(h->notif);
+  if (h->resp >= 0) close(h->resp);
+  if (h->req >= 0) close(h->req);
+}
+
+// Opens the client FIFOs without blocking, each once the client has its end
+// open or is waiting for ours. Returns 1 when all three are open, 0 to try
+// again later, -1 if the client cannot be served.
+static int open_fifos(Handshake *h) {
+  if (h->req < 0) {
+    h->req = open(h->request.request_path, O_RDONLY | O_NONBLOCK);
+    if (h->req < 0) return -1;
+  }
+  if (h->resp < 0) {
+    h->resp = open(h->request.response_path, O_WRONLY | O_NONBLOCK);
+    if (h->resp < 0) return errno == ENXIO ? 0 : -1;
+  }
+  if (h->notif < 0) {
+    h->notif = open(h->request.notification_path, O_WRONLY | O_NONBLOCK);
+    if (h->notif < 0) return errno == ENXIO ? 0 : -1;
+  }
+  return 1;
+}
+
+// Answers the connection and gives the session to a serving thread.
+static void start_session(Handshake *h, IoThread *t) {
+  Session *s = calloc(1, sizeof(Session));
+  NotifyQueue *notify = s != NULL ? notify_open(h->notif) : NULL;
+  if (notify == NULL ||
+      send_response(h->resp, OP_CONNECT, STATUS_OK, NULL, 0) != (ssize_t)sizeof(ResponseHeader)) {
+    fprintf(stderr, "Failed to open the session of %s\n", h->request.request_path);
+    if (notify != NULL) {
+      // The queue took the notification FIFO
+      notify_close(notify);
+      h->notif = -1;
+    }
+    free(s);
+    drop_handshake(h);
+    return;
+  }
+
+  s->req = h->req;
+  s->resp = h->resp;
+  s->notify = notify;
+  s->thread = t;
+
+  pthread_mutex_lock(&t->lock);
+  s->next = t->sessions;
+  if (s->next != NULL) s->next->prev = s;
+  t->sessions = s;
+  pthread_mutex_unlock(&t->lock);
+
+  watch(s, EPOLL_CTL_ADD, s->req, SOURCE_REQUEST, EPOLLIN);
+}
+
+// Reads connection requests and completes their handshakes until the
+// server stops. Handshakes are retried every millisecond while any is open,
+// so a client that never opens its FIFOs only costs a slot until its
+// deadline. Requests are written whole, so a short read only happens if a
+// client misbehaves.
+static void accept_clients(int fifo, IoThread *threads, int count) {
+  Handshake waiting[SERVER_HANDSHAKES];
+  int open = 0;
+  int next = 0;
+
+  while (1) {
+    struct pollfd fds[2] = {{stop_pipe[0], POLLIN, 0}, {fifo, open < SERVER_HANDSHAKES ? POLLIN : 0, 0}};
+    int ready = poll(fds, 2, open > 0 ? 1 : -1);
+    if (ready < 0 && errno != EINTR) break;
+    if (ready > 0 && fds[0].revents != 0) break;
+
+    if (ready > 0 && (fds[1].revents & POLLIN)) {
+      Handshake *h = &waiting[open];
+      if (read_exact(fifo, &h->request, sizeof(h->request))) {
+        break;
+      }
+      if (h->request.op != OP_CONNECT) {
+        fprintf(stderr, "Ignoring an invalid connection request\n");
+      } else {
+        h->request.request_path[KVS_PIPE_PATH_SIZE - 1] = '\0';
+        h->request.response_path[KVS_PIPE_PATH_SIZE - 1] = '\0';
+        h->request.notification_path[KVS_PIPE_PATH_SIZE - 1] = '\0';
+        h->req = h->resp = h->notif = -1;
+        h->deadline = now_ms() + SERVER_HANDSHAKE_MS;
+        open++;
+      }
+    }
+
+    for (int i = 0; i < open;) {
+      int state = open_fifos(&waiting[i]);
+      if (state == 0 && now_ms() > waiting[i].deadline) {
+        state = -1;
+      }
+      if (state == 0) {
+        i++;
+        continue;
+      }
+      if (state > 0) {
+        start_session(&waiting[i], &threads[next]);
+        next = (next + 1) % count;
+      } else {
+        fprintf(stderr, "Dropping the connection of %s\n", waiting[i].request.request_path);
+        drop_handshake(&waiting[i]);
+      }
+      waiting[i] = waiting[--open];
+    }
+  }
+
+  for (int i = 0; i < open; i++) {
+    drop_handshake(&waiting[i]);
+  }
+}
+
+static int start_thread(IoThread *t) {
+  memset(t, 0, sizeof(*t));
+  t->epoll = epoll_create1(0);
+  if (t->epoll < 0) {
+    return 1;
+  }
+  struct epoll_event stop = {.events = EPOLLIN, .data.u64 = 0};
+  if (epoll_ctl(t->epoll, EPOLL_CTL_ADD, stop_pipe[0], &stop) != 0 || writer_init_memory(&t->out) != 0) {
+    close(t->epoll);
+    return 1;
+  }
+  pthread_mutex_init(&t->lock, NULL);
+  if (pthread_create(&t->thread, NULL, io_main, t) != 0) {
+    pthread_mutex_destroy(&t->lock);
+    writer_destroy(&t->out);
+    close(t->epoll);
+    return 1;
+  }
+  return 0;
+}
+
+int server_run(const ServerOptions *options) {
+  if (pipe(stop_pipe) != 0) {
+    perror("Failed to create the stop pipe");
+    return 1;
+  }
+
+  // Clients that go away must not kill the server
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &action, NULL);
+  action.sa_handler = request_stop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  unlink(options->fifo_path);
+  if (mkfifo(options->fifo_path, 0640) != 0) {
+    perror("Failed to create the server FIFO");
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    return 1;
+  }
+
+  // Opened for writing as well, so that it never reads end of file while
+  // no client has it open
+  int fifo = open(options->fifo_path, O_RDWR);
+  if (fifo < 0) {
+    perror("Failed to open the server FIFO");
+    unlink(options->fifo_path);
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    return 1;
+  }
+
+  if (notify_start()) {
+    close(fifo);
+    unlink(options->fifo_path);
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    return 1;
+  }
+
+  IoThread *threads = calloc((size_t)options->threads, sizeof(IoThread));
+  int started = 0;
+  while (threads != NULL && started < options->threads && start_thread(&threads[started]) == 0) {
+    started++;
+  }
+
+  if (started > 0) {
+    accept_clients(fifo, threads, started);
+  } else {
+    fprintf(stderr, "Failed to start the serving threads\n");
+  }
+
+  // Serving threads notice the stop pipe and end their sessions
+  if (!stopping()) {
+    request_stop(0);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i].thread, NULL);
+    pthread_mutex_destroy(&threads[i].lock);
+    writer_destroy(&threads[i].out);
+    close(threads[i].epoll);
+  }
+  free(threads);
+  notify_stop();
+
+  close(fifo);
+  unlink(options->fifo_path);
+  close(stop_pipe[0]);
+  close(stop_pipe[1]);
+  return started > 0 ? 0 : 1;
+}
@@ -0,0 +1,34 @@
+#ifndef KVS_SERVER_H
+#define KVS_SERVER_H
+
+#include "protocol.h"
+
+// Threads serving the sessions unless set otherwise. Each one waits on an
+// epoll instance of its own, so it serves any number of sessions.
+#define SERVER_THREADS 2
+
+// Connections still opening their FIFOs. Further connection requests wait
+// in the server FIFO until one of them finishes.
+#define SERVER_HANDSHAKES 64
+
+// Time a client has to open its FIFOs after its connection request.
+#define SERVER_HANDSHAKE_MS 5000
+
+// Events taken from epoll at a time by a serving thread.
+#define SERVER_EVENTS 64
+
+typedef struct ServerOptions {
+  // Well-known FIFO clients send their ConnectRequest to
+  const char *fifo_path;
+  // Threads reading requests and writing responses for all sessions
+  int threads;
+} ServerOptions;
+
+/// Serves clients until the process receives SIGINT or SIGTERM. The server
+/// FIFO is created, and removed on return. Requests run on the table of
+/// kvs_init.
+/// @param options Path of the server FIFO and number of serving threads.
+/// @return 0 after a clean shutdown, 1 if the server could not start.
+int server_run(const ServerOptions *options);
+
+#endif  // KVS_SERVER_H
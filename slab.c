@@ -0,0 +1,201 @@
+#include "slab.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#define SLAB_POISON(ptr, size) ASAN_POISON_MEMORY_REGION(ptr, size)
+#define SLAB_UNPOISON(ptr, size) ASAN_UNPOISON_MEMORY_REGION(ptr, size)
+#else
+#define SLAB_POISON(ptr, size) ((void)(ptr), (void)(size))
+#define SLAB_UNPOISON(ptr, size) ((void)(ptr), (void)(size))
+#endif
+
+// Free objects are linked through their first bytes. Under ASan the rest of
+// a free object stays poisoned so use-after-free is still reported.
+typedef struct FreeObject {
+    struct FreeObject *next;
+} FreeObject;
+
+// Chunks are chained so they stay reachable until the process exits.
+typedef struct Chunk {
+    struct Chunk *next;
+    _Alignas(SLAB_GRANULE) char data[];
+} Chunk;
+
+typedef struct Depot {
+    pthread_mutex_t lock;
+    FreeObject *head;
+    size_t count;
+} Depot;
+
+typedef struct ThreadCache {
+    FreeObject *head[SLAB_CLASSES];
+    size_t count[SLAB_CLASSES];
+    int registered;
+} ThreadCache;
+
+static Depot depots[SLAB_CLASSES] = {
+    {PTHREAD_MUTEX_INITIALIZER, NULL, 0},
+    {PTHREAD_MUTEX_INITIALIZER, NULL, 0},
+    {PTHREAD_MUTEX_INITIALIZER, NULL, 0},
+    {PTHREAD_MUTEX_INITIALIZER, NULL, 0},
+};
+
+static pthread_mutex_t chunks_lock = PTHREAD_MUTEX_INITIALIZER;
+static Chunk *chunks = NULL;
+
+static _Thread_local ThreadCache cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static size_t class_of(size_t size) {
+    return size == 0 ? 0 : (size - 1) / SLAB_GRANULE;
+}
+
+static size_t class_size(size_t cls) {
+    return (cls + 1) * SLAB_GRANULE;
+}
+
+static void push(FreeObject **head, void *ptr, size_t size) {
+    FreeObject *object = ptr;
+    SLAB_UNPOISON(object, sizeof(FreeObject));
+    object->next = *head;
+    *head = object;
+    SLAB_POISON((char *)ptr + sizeof(FreeObject), size - sizeof(FreeObject));
+}
+
+static void *pop(FreeObject **head, size_t size) {
+    FreeObject *object = *head;
+    *head = object->next;
+    SLAB_UNPOISON(object, size);
+    return object;
+}
+
+// Moves up to `count` objects from the depot of a class to `head`.
+static size_t depot_take(Depot *depot, size_t cls, FreeObject **head, size_t count) {
+    size_t size = class_size(cls);
+    size_t taken = 0;
+
+    pthread_mutex_lock(&depot->lock);
+    while (taken < count && depot->head != NULL) {
+        push(head, pop(&depot->head, size), size);
+        taken++;
+    }
+    depot->count -= taken;
+    pthread_mutex_unlock(&depot->lock);
+
+    return taken;
+}
+
+static void depot_give(Depot *depot, size_t cls, FreeObject **head, size_t count) {
+    size_t size = class_size(cls);
+
+    pthread_mutex_lock(&depot->lock);
+    for (size_t i = 0; i < count && *head != NULL; i++) {
+        push(&depot->head, pop(head, size), size);
+        depot->count++;
+    }
+    pthread_mutex_unlock(&depot->lock);
+}
+
+// Carves a new chunk into objects of one class and hands them to the depot.
+static int depot_grow(Depot *depot, size_t cls) {
+    size_t size = class_size(cls);
+    Chunk *chunk = malloc(sizeof(Chunk) + SLAB_CHUNK_SIZE);
+    if (!chunk) return 1;
+
+    pthread_mutex_lock(&chunks_lock);
+    chunk->next = chunks;
+    chunks = chunk;
+    pthread_mutex_unlock(&chunks_lock);
+
+    pthread_mutex_lock(&depot->lock);
+    for (size_t offset = 0; offset + size <= SLAB_CHUNK_SIZE; offset += size) {
+        push(&depot->head, chunk->data + offset, size);
+        depot->count++;
+    }
+    pthread_mutex_unlock(&depot->lock);
+
+    return 0;
+}
+
+// Gives the objects cached by an exiting thread back to the depots.
+static void cache_release(void *arg) {
+    ThreadCache *tc = arg;
+
+    for (size_t cls = 0; cls < SLAB_CLASSES; cls++) {
+        depot_give(&depots[cls], cls, &tc->head[cls], tc->count[cls]);
+        tc->count[cls] = 0;
+    }
+}
+
+static void cache_key_create(void) {
+    pthread_key_create(&cache_key, cache_release);
+}
+
+// Makes sure the cache of the calling thread is flushed when it exits.
+static void cache_register(void) {
+    if (!cache.registered) {
+        pthread_once(&cache_key_once, cache_key_create);
+        pthread_setspecific(cache_key, &cache);
+        cache.registered = 1;
+    }
+}
+
+void *slab_alloc(size_t size) {
+    size_t cls = class_of(size);
+    if (cls >= SLAB_CLASSES) {
+        return malloc(size);
+    }
+
+    cache_register();
+
+    if (cache.head[cls] == NULL) {
+        size_t taken = depot_take(&depots[cls], cls, &cache.head[cls], SLAB_BATCH);
+        while (taken == 0) {
+            if (depot_grow(&depots[cls], cls)) return NULL;
+            taken = depot_take(&depots[cls], cls, &cache.head[cls], SLAB_BATCH);
+        }
+        cache.count[cls] = taken;
+    }
+
+    cache.count[cls]--;
+    return pop(&cache.head[cls], class_size(cls));
+}
+
+void slab_free(void *ptr, size_t size) {
+    size_t cls = class_of(size);
+    if (ptr == NULL) return;
+
+    if (cls >= SLAB_CLASSES) {
+        free(ptr);
+        return;
+    }
+
+    cache_register();
+    push(&cache.head[cls], ptr, class_size(cls));
+    if (++cache.count[cls] > 2 * SLAB_BATCH) {
+        depot_give(&depots[cls], cls, &cache.head[cls], SLAB_BATCH);
+        cache.count[cls] -= SLAB_BATCH;
+    }
+}
+
+size_t slab_capacity(size_t size) {
+    size_t cls = class_of(size);
+    return cls >= SLAB_CLASSES ? size : class_size(cls);
+}
+
+char *slab_strdup(const char *str) {
+    size_t size = strlen(str) + 1;
+    char *copy = slab_alloc(size);
+    if (copy) memcpy(copy, str, size);
+    return copy;
+}
+
+void slab_free_string(char *str) {
+    if (str == NULL) return;
+    slab_free(str, strlen(str) + 1);
+}
@@ -0,0 +1,43 @@
+#ifndef KVS_SLAB_H
+#define KVS_SLAB_H
+
+#include <stddef.h>
+
+// Objects are grouped in size classes of 16, 32, 48 and 64 bytes, which
+// cover every KeyNode and every key or value up to MAX_STRING_SIZE. Larger
+// requests go straight to malloc.
+#define SLAB_GRANULE 16
+#define SLAB_CLASSES 4
+
+// Memory carved into objects at once when a size class runs dry.
+#define SLAB_CHUNK_SIZE (64 * 1024)
+
+// Objects moved between a thread cache and the shared depot at once. A
+// thread cache holds at most twice this many objects per class.
+#define SLAB_BATCH 64
+
+/// Allocates a block of at least size bytes from the calling thread cache.
+/// @param size Number of bytes needed.
+/// @return Pointer to the block, NULL on failure.
+void *slab_alloc(size_t size);
+
+/// Returns a block to the calling thread cache.
+/// @param ptr Block returned by slab_alloc, may be NULL.
+/// @param size Size given to slab_alloc for this block.
+void slab_free(void *ptr, size_t size);
+
+/// Usable size of the block slab_alloc hands out for a request.
+/// @param size Number of bytes requested.
+/// @return Capacity of the block, at least size.
+size_t slab_capacity(size_t size);
+
+/// Copies a string into a slab block.
+/// @param str String to copy.
+/// @return The copy, NULL on failure.
+char *slab_strdup(const char *str);
+
+/// Frees a string returned by slab_strdup.
+/// @param str String to free, may be NULL.
+void slab_free_string(char *str);
+
+#endif  // KVS_SLAB_H
@@ -0,0 +1,394 @@
+#include "slots.h"
+#include "epoch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+// Low hash bits pick the stripe; groups are indexed from the bits above them
+// and tags come from the top seven bits.
+#define SLOT_HASH_SHIFT 8
+
+static size_t group_of(uint64_t h, size_t groups_mask) {
+    return (size_t)(h >> SLOT_HASH_SHIFT) & groups_mask;
+}
+
+static int8_t tag_of(uint64_t h) {
+    return (int8_t)(h >> 57);
+}
+
+// Bit i of the result is set when ctrl[i] == tag.
+static unsigned match_tag(const int8_t *ctrl, int8_t tag) {
+#ifdef __SSE2__
+    __m128i group = _mm_load_si128((const __m128i *)(const void *)ctrl);
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+    unsigned mask = 0;
+    for (unsigned i = 0; i < SLOT_GROUP; i++) {
+        mask |= (unsigned)(ctrl[i] == tag) << i;
+    }
+    return mask;
+#endif
+}
+
+// Bit i of the result is set when ctrl[i] is empty or deleted.
+static unsigned match_free(const int8_t *ctrl) {
+#ifdef __SSE2__
+    __m128i group = _mm_load_si128((const __m128i *)(const void *)ctrl);
+    return (unsigned)_mm_movemask_epi8(group);
+#else
+    unsigned mask = 0;
+    for (unsigned i = 0; i < SLOT_GROUP; i++) {
+        mask |= (unsigned)(ctrl[i] < 0) << i;
+    }
+    return mask;
+#endif
+}
+
+static unsigned lowest_bit(unsigned mask) {
+    return (unsigned)__builtin_ctz(mask);
+}
+
+static size_t capacity_of(const SlotArrays *a) {
+    return (a->groups_mask + 1) * SLOT_GROUP;
+}
+
+static int arrays_alloc(SlotArrays *a, size_t groups) {
+    size_t capacity = groups * SLOT_GROUP;
+
+    a->ctrl = aligned_alloc(SLOT_GROUP, capacity);
+    a->slots = malloc(capacity * sizeof(Slot));
+    if (!a->ctrl || !a->slots) {
+        free(a->ctrl);
+        free(a->slots);
+        a->ctrl = NULL;
+        a->slots = NULL;
+        return 1;
+    }
+
+    memset(a->ctrl, CTRL_EMPTY, capacity);
+    a->groups_mask = groups - 1;
+    return 0;
+}
+
+// Arrays whose ctrl is NULL were already retired.
+static void arrays_free(SlotArrays *a) {
+    if (a->ctrl != NULL) {
+        free(a->ctrl);
+        free(a->slots);
+    }
+    a->ctrl = NULL;
+    a->slots = NULL;
+}
+
+static void release_array(void *ptr, size_t size) {
+    (void)size;
+    free(ptr);
+}
+
+// Frees drained arrays, or retires them while lock-free readers may still be
+// probing them. Only ctrl is cleared: a reader that still sees the old ctrl
+// must also find the slots it belongs to.
+static void arrays_retire(SlotTable *t, SlotArrays *a) {
+    int8_t *ctrl = a->ctrl;
+    Slot *slots = a->slots;
+
+    __atomic_store_n(&a->ctrl, NULL, __ATOMIC_RELEASE);
+
+    if (t->deferred_free) {
+        epoch_retire(ctrl, 0, release_array);
+        epoch_retire(slots, 0, release_array);
+    } else {
+        free(ctrl);
+        free(slots);
+    }
+}
+
+// Returns the index of the slot holding key, or -1. Probing stops at the
+// first group that still has an empty slot.
+static ptrdiff_t arrays_find(const SlotArrays *a, uint64_t h, const char *key) {
+    size_t group = group_of(h, a->groups_mask);
+    int8_t tag = tag_of(h);
+
+    for (size_t probes = 0; probes <= a->groups_mask; probes++) {
+        const int8_t *ctrl = a->ctrl + group * SLOT_GROUP;
+
+        for (unsigned match = match_tag(ctrl, tag); match != 0; match &= match - 1) {
+            size_t index = group * SLOT_GROUP + lowest_bit(match);
+            if (a->slots[index].hash == h && strcmp(a->slots[index].key, key) == 0) {
+                return (ptrdiff_t)index;
+            }
+        }
+
+        if (match_tag(ctrl, CTRL_EMPTY) != 0) {
+            return -1;
+        }
+        group = (group + 1) & a->groups_mask;
+    }
+
+    return -1;
+}
+
+// Places a key known not to be stored in the first free slot of its probe
+// sequence. Returns 1 if an empty (not deleted) slot was consumed.
+static int arrays_insert(SlotArrays *a, uint64_t h, const char *key, const char *value) {
+    size_t group = group_of(h, a->groups_mask);
+
+    while (1) {
+        int8_t *ctrl = a->ctrl + group * SLOT_GROUP;
+        unsigned free_mask = match_free(ctrl);
+
+        if (free_mask != 0) {
+            size_t index = group * SLOT_GROUP + lowest_bit(free_mask);
+            int was_empty = a->ctrl[index] == CTRL_EMPTY;
+
+            a->ctrl[index] = tag_of(h);
+            a->slots[index].hash = h;
+            strcpy(a->slots[index].key, key);
+            strcpy(a->slots[index].value, value);
+            return was_empty;
+        }
+        group = (group + 1) & a->groups_mask;
+    }
+}
+
+// A removed slot can go back to empty when its group already has an empty
+// slot, because no probe sequence continues past such a group.
+static void arrays_erase(SlotArrays *a, size_t index) {
+    const int8_t *group = a->ctrl + (index / SLOT_GROUP) * SLOT_GROUP;
+    a->ctrl[index] = match_tag(group, CTRL_EMPTY) != 0 ? CTRL_EMPTY : CTRL_DELETED;
+}
+
+// Moves up to `steps` groups of the old arrays into the current ones. Moved
+// slots are marked deleted so that probes into later old groups still work.
+static void migrate_groups(SlotTable *t, size_t steps) {
+    while (t->old.ctrl != NULL && steps-- > 0) {
+        size_t first = t->migrated * SLOT_GROUP;
+
+        for (size_t i = first; i < first + SLOT_GROUP; i++) {
+            if (t->old.ctrl[i] >= 0) {
+                Slot *slot = &t->old.slots[i];
+                if (arrays_insert(&t->cur, slot->hash, slot->key, slot->value)) {
+                    t->used++;
+                }
+                t->old.ctrl[i] = CTRL_DELETED;
+            }
+        }
+
+        if (t->migrated++ == t->old.groups_mask) {
+            arrays_retire(t, &t->old);
+        }
+    }
+}
+
+// Keeps at most 7/8 of the slots in use (tombstones included). Doubles when
+// more than half of the slots hold live keys, otherwise rehashes at the same
+// size to drop tombstones. The old arrays are drained by later writes.
+static int make_room(SlotTable *t) {
+    size_t capacity = capacity_of(&t->cur);
+    if ((t->used + 1) * 8 <= capacity * 7) {
+        return 0;
+    }
+
+    if (t->old.ctrl != NULL) {
+        migrate_groups(t, t->old.groups_mask + 1);
+        if ((t->used + 1) * 8 <= capacity * 7) {
+            return 0;
+        }
+    }
+
+    size_t groups = t->cur.groups_mask + 1;
+    if (t->count * 2 >= capacity) {
+        groups *= 2;
+    }
+
+    SlotArrays fresh;
+    if (arrays_alloc(&fresh, groups)) {
+        return 1;
+    }
+
+    // Arrays never shrink, and slots, ctrl and groups_mask are published in
+    // that order. A lock-free reader that sees a new groups_mask therefore
+    // also sees the arrays it belongs to, and never pairs a larger mask with
+    // smaller arrays.
+    t->old.slots = t->cur.slots;
+    __atomic_store_n(&t->old.ctrl, t->cur.ctrl, __ATOMIC_RELEASE);
+    __atomic_store_n(&t->old.groups_mask, t->cur.groups_mask, __ATOMIC_RELEASE);
+    t->cur.slots = fresh.slots;
+    __atomic_store_n(&t->cur.ctrl, fresh.ctrl, __ATOMIC_RELEASE);
+    __atomic_store_n(&t->cur.groups_mask, fresh.groups_mask, __ATOMIC_RELEASE);
+    t->migrated = 0;
+    t->used = 0;
+    return 0;
+}
+
+int slots_init(SlotTable *t, int deferred_free) {
+    t->deferred_free = deferred_free;
+    t->old.ctrl = NULL;
+    t->old.slots = NULL;
+    t->old.groups_mask = 0;
+    t->migrated = 0;
+    t->used = 0;
+    t->count = 0;
+    return arrays_alloc(&t->cur, SLOT_INITIAL_GROUPS);
+}
+
+Slot *slots_find(SlotTable *t, uint64_t h, const char *key) {
+    ptrdiff_t index = arrays_find(&t->cur, h, key);
+    if (index >= 0) {
+        return &t->cur.slots[index];
+    }
+
+    if (t->old.ctrl != NULL) {
+        index = arrays_find(&t->old, h, key);
+        if (index >= 0) {
+            return &t->old.slots[index];
+        }
+    }
+
+    return NULL;
+}
+
+// Lock-free variant of arrays_find: strings are compared and copied with
+// bounds because a concurrent writer may be rewriting the slot.
+static int arrays_peek(const SlotArrays *a, uint64_t h, const char *key, char value[MAX_STRING_SIZE]) {
+    size_t groups_mask = __atomic_load_n(&a->groups_mask, __ATOMIC_ACQUIRE);
+    const int8_t *ctrl = __atomic_load_n(&a->ctrl, __ATOMIC_ACQUIRE);
+    const Slot *slots = __atomic_load_n(&a->slots, __ATOMIC_RELAXED);
+    size_t group = group_of(h, groups_mask);
+    int8_t tag = tag_of(h);
+
+    if (ctrl == NULL) {
+        return 0;
+    }
+
+    for (size_t probes = 0; probes <= groups_mask; probes++) {
+        const int8_t *group_ctrl = ctrl + group * SLOT_GROUP;
+
+        for (unsigned match = match_tag(group_ctrl, tag); match != 0; match &= match - 1) {
+            const Slot *slot = &slots[group * SLOT_GROUP + lowest_bit(match)];
+            if (slot->hash == h && strncmp(slot->key, key, MAX_STRING_SIZE) == 0) {
+                memcpy(value, slot->value, MAX_STRING_SIZE);
+                value[MAX_STRING_SIZE - 1] = '\0';
+                return 1;
+            }
+        }
+
+        if (match_tag(group_ctrl, CTRL_EMPTY) != 0) {
+            return 0;
+        }
+        group = (group + 1) & groups_mask;
+    }
+
+    return 0;
+}
+
+int slots_peek(const SlotTable *t, uint64_t h, const char *key, char value[MAX_STRING_SIZE]) {
+    return arrays_peek(&t->cur, h, key, value) || arrays_peek(&t->old, h, key, value);
+}
+
+int slots_put(SlotTable *t, uint64_t h, const char *key, const char *value, int *inserted) {
+    if (strlen(key) >= MAX_STRING_SIZE || strlen(value) >= MAX_STRING_SIZE) {
+        return 1;
+    }
+
+    migrate_groups(t, SLOT_MIGRATE_STEP);
+
+    Slot *slot = slots_find(t, h, key);
+    if (slot != NULL) {
+        strcpy(slot->value, value);
+        *inserted = 0;
+        return 0;
+    }
+
+    if (make_room(t)) {
+        return 1;
+    }
+
+    if (arrays_insert(&t->cur, h, key, value)) {
+        t->used++;
+    }
+    t->count++;
+    *inserted = 1;
+    return 0;
+}
+
+int slots_load(SlotTable *t, size_t count, const uint64_t hashes[], const char *const keys[],
+               const char *const values[]) {
+    // Half full at most, the load slots_put leaves a table in after doubling
+    size_t groups = t->cur.groups_mask + 1;
+    while (count * 2 > groups * SLOT_GROUP) {
+        groups *= 2;
+    }
+    if (groups != t->cur.groups_mask + 1) {
+        SlotArrays fresh;
+        if (arrays_alloc(&fresh, groups)) {
+            return 1;
+        }
+        arrays_free(&t->cur);
+        t->cur = fresh;
+    }
+
+    for (size_t k = 0; k < count; k++) {
+        if (strlen(keys[k]) >= MAX_STRING_SIZE || strlen(values[k]) >= MAX_STRING_SIZE) {
+            return 1;
+        }
+        if (arrays_insert(&t->cur, hashes[k], keys[k], values[k])) {
+            t->used++;
+        }
+        t->count++;
+    }
+    return 0;
+}
+
+int slots_remove(SlotTable *t, uint64_t h, const char *key) {
+    migrate_groups(t, SLOT_MIGRATE_STEP);
+
+    ptrdiff_t index = arrays_find(&t->cur, h, key);
+    if (index >= 0) {
+        arrays_erase(&t->cur, (size_t)index);
+        if (t->cur.ctrl[index] == CTRL_EMPTY) {
+            t->used--;
+        }
+        t->count--;
+        return 0;
+    }
+
+    if (t->old.ctrl != NULL) {
+        index = arrays_find(&t->old, h, key);
+        if (index >= 0) {
+            t->old.ctrl[index] = CTRL_DELETED;
+            t->count--;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void arrays_foreach(const SlotArrays *a, void (*visit)(const char *, const char *, void *), void *ctx) {
+    size_t capacity = capacity_of(a);
+    for (size_t i = 0; i < capacity; i++) {
+        if (a->ctrl[i] >= 0) {
+            visit(a->slots[i].key, a->slots[i].value, ctx);
+        }
+    }
+}
+
+void slots_foreach(SlotTable *t, void (*visit)(const char *, const char *, void *), void *ctx) {
+    if (t->old.ctrl != NULL) {
+        arrays_foreach(&t->old, visit, ctx);
+    }
+    arrays_foreach(&t->cur, visit, ctx);
+}
+
+void slots_free(SlotTable *t) {
+    arrays_free(&t->old);
+    arrays_free(&t->cur);
+}
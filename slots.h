@@ -0,0 +1,106 @@
+#ifndef KVS_SLOTS_H
+#define KVS_SLOTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+// Slots are probed a group at a time; the control bytes of a group are
+// compared against the tag of a key in a single SSE2 instruction.
+#define SLOT_GROUP 16
+
+// Initial number of groups of an open-addressing stripe. Power of two.
+#define SLOT_INITIAL_GROUPS 1
+
+// Old groups moved to the new arrays on every write while a stripe grows.
+#define SLOT_MIGRATE_STEP 1
+
+// Keys and values are stored inline, so a hit reads the control byte group
+// and the slot, without following any pointer.
+typedef struct Slot {
+    uint64_t hash;
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];
+} Slot;
+
+typedef struct SlotArrays {
+    int8_t *ctrl;
+    Slot *slots;
+    size_t groups_mask;
+} SlotArrays;
+
+// Open-addressing table of a stripe. While growing, `old` is drained one
+// group at a time and lookups check both arrays. With `deferred_free` set,
+// drained arrays are retired through the epoch allocator instead of freed so
+// that slots_peek can run without the stripe lock.
+typedef struct SlotTable {
+    SlotArrays cur;
+    SlotArrays old;
+    size_t migrated;
+    size_t used;
+    size_t count;
+    int deferred_free;
+} SlotTable;
+
+/// Allocates the arrays of an empty slot table.
+/// @param t Table to initialize.
+/// @param deferred_free Whether lock-free readers may access the table.
+/// @return 0 on success, 1 otherwise.
+int slots_init(SlotTable *t, int deferred_free);
+
+/// Looks a key up.
+/// @param t Table to search.
+/// @param h Hash of the key.
+/// @param key Key to search for.
+/// @return Slot holding the key, NULL if it is not stored.
+Slot *slots_find(SlotTable *t, uint64_t h, const char *key);
+
+/// Looks a key up without the stripe lock while writers may be running.
+/// The result is only meaningful if no writer touched the table meanwhile,
+/// which the caller checks, and the caller must be inside an epoch.
+/// @param t Table to search.
+/// @param h Hash of the key.
+/// @param key Key to search for.
+/// @param value Receives a copy of the value if the key was found.
+/// @return 1 if the key was found, 0 otherwise.
+int slots_peek(const SlotTable *t, uint64_t h, const char *key, char value[MAX_STRING_SIZE]);
+
+/// Inserts a pair or overwrites the value of an existing key.
+/// @param t Table to modify.
+/// @param h Hash of the key.
+/// @param key Key of the pair, shorter than MAX_STRING_SIZE.
+/// @param value Value of the pair, shorter than MAX_STRING_SIZE.
+/// @param inserted Set to 1 if the key was new, 0 if it was overwritten.
+/// @return 0 on success, 1 if the pair does not fit or memory ran out.
+int slots_put(SlotTable *t, uint64_t h, const char *key, const char *value, int *inserted);
+
+/// Fills an empty table with pairs whose keys are all different. The arrays
+/// are sized for every pair up front and no key is looked up.
+/// @param t Empty table to fill.
+/// @param count Number of pairs.
+/// @param hashes Hashes of the keys.
+/// @param keys Keys of the pairs, shorter than MAX_STRING_SIZE.
+/// @param values Values of the pairs, shorter than MAX_STRING_SIZE.
+/// @return 0 on success, 1 if a pair does not fit or memory ran out.
+int slots_load(SlotTable *t, size_t count, const uint64_t hashes[], const char *const keys[],
+               const char *const values[]);
+
+/// Removes a key.
+/// @param t Table to modify.
+/// @param h Hash of the key.
+/// @param key Key to remove.
+/// @return 0 if the key was removed, 1 if it was not stored.
+int slots_remove(SlotTable *t, uint64_t h, const char *key);
+
+/// Calls visit for every stored pair.
+/// @param t Table to iterate.
+/// @param visit Function called with the key, value and ctx of each pair.
+/// @param ctx Pointer passed to every call of visit.
+void slots_foreach(SlotTable *t, void (*visit)(const char *, const char *, void *), void *ctx);
+
+/// Frees the arrays of the table.
+/// @param t Table to free.
+void slots_free(SlotTable *t);
+
+#endif  // KVS_SLOTS_H
@@ -0,0 +1,135 @@
+#include "subs.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Low hash bits pick the stripe; buckets are indexed from the bits above.
+#define SUBS_HASH_SHIFT 8
+
+static size_t bucket_of(uint64_t h, size_t mask) {
+    return (size_t)(h >> SUBS_HASH_SHIFT) & mask;
+}
+
+static Watched **find_link(const SubscriberIndex *x, uint64_t h, const char *key) {
+    Watched **link = &x->buckets[bucket_of(h, x->mask)];
+    while (*link != NULL && ((*link)->hash != h || strcmp((*link)->key, key) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Doubles the buckets once keys outnumber them. Failing to grow only makes
+// chains longer.
+static void maybe_grow(SubscriberIndex *x) {
+    if (x->count <= x->mask + 1) {
+        return;
+    }
+
+    size_t mask = x->mask * 2 + 1;
+    Watched **buckets = calloc(mask + 1, sizeof(Watched *));
+    if (buckets == NULL) {
+        return;
+    }
+    for (size_t i = 0; i <= x->mask; i++) {
+        Watched *w = x->buckets[i];
+        while (w != NULL) {
+            Watched *next = w->next;
+            w->next = buckets[bucket_of(w->hash, mask)];
+            buckets[bucket_of(w->hash, mask)] = w;
+            w = next;
+        }
+    }
+    free(x->buckets);
+    x->buckets = buckets;
+    x->mask = mask;
+}
+
+int subs_add(SubscriberIndex *x, uint64_t h, const char *key, void *subscriber, int *watched) {
+    *watched = 0;
+    if (x->buckets == NULL) {
+        x->buckets = calloc(SUBS_INITIAL_BUCKETS, sizeof(Watched *));
+        if (x->buckets == NULL) return 1;
+        x->mask = SUBS_INITIAL_BUCKETS - 1;
+    }
+
+    Watched **link = find_link(x, h, key);
+    Watched *w = *link;
+    if (w == NULL) {
+        size_t len = strlen(key);
+        if (len >= MAX_STRING_SIZE) return 1;
+        w = calloc(1, sizeof(Watched));
+        if (w == NULL) return 1;
+        w->hash = h;
+        memcpy(w->key, key, len + 1);
+    }
+
+    for (size_t i = 0; i < w->count; i++) {
+        if (w->subscribers[i] == subscriber) return 0;
+    }
+    if (w->count == w->capacity) {
+        size_t capacity = w->capacity == 0 ? 2 : w->capacity * 2;
+        void **subscribers = realloc(w->subscribers, capacity * sizeof(void *));
+        if (subscribers == NULL) {
+            if (w->count == 0) free(w);
+            return 1;
+        }
+        w->subscribers = subscribers;
+        w->capacity = capacity;
+    }
+    w->subscribers[w->count++] = subscriber;
+
+    if (*link == NULL) {
+        *link = w;
+        x->count++;
+        *watched = 1;
+        maybe_grow(x);
+    }
+    return 0;
+}
+
+int subs_remove(SubscriberIndex *x, uint64_t h, const char *key, void *subscriber, int *unwatched) {
+    *unwatched = 0;
+    if (x->buckets == NULL) return 1;
+
+    Watched **link = find_link(x, h, key);
+    Watched *w = *link;
+    if (w == NULL) return 1;
+
+    size_t i = 0;
+    while (i < w->count && w->subscribers[i] != subscriber) i++;
+    if (i == w->count) return 1;
+
+    // Order does not matter: every subscriber hears about every change
+    w->subscribers[i] = w->subscribers[--w->count];
+    if (w->count == 0) {
+        *link = w->next;
+        free(w->subscribers);
+        free(w);
+        x->count--;
+        *unwatched = 1;
+    }
+    return 0;
+}
+
+const Watched *subs_find(const SubscriberIndex *x, uint64_t h, const char *key) {
+    if (x->buckets == NULL) return NULL;
+    return *find_link(x, h, key);
+}
+
+void subs_free(SubscriberIndex *x) {
+    if (x->buckets == NULL) return;
+
+    for (size_t i = 0; i <= x->mask; i++) {
+        Watched *w = x->buckets[i];
+        while (w != NULL) {
+            Watched *next = w->next;
+            free(w->subscribers);
+            free(w);
+            w = next;
+        }
+    }
+    free(x->buckets);
+    x->buckets = NULL;
+    x->mask = 0;
+    x->count = 0;
+}
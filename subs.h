@@ -0,0 +1,63 @@
+#ifndef KVS_SUBS_H
+#define KVS_SUBS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+// Buckets of a subscriber index once its first key is subscribed to. Power
+// of two.
+#define SUBS_INITIAL_BUCKETS 8
+
+// A key with at least one subscriber. Subscribers are opaque pointers that
+// are handed back to the change notifier of the table.
+typedef struct Watched {
+    uint64_t hash;
+    struct Watched *next;
+    size_t count;
+    size_t capacity;
+    void **subscribers;
+    char key[MAX_STRING_SIZE];
+} Watched;
+
+// Subscribers of the keys of one stripe. It is kept apart from the pairs, so
+// a subscription does not depend on the engine and outlives deletes of its
+// key. An index nobody subscribed to holds no memory.
+typedef struct SubscriberIndex {
+    Watched **buckets;
+    size_t mask;
+    size_t count;
+} SubscriberIndex;
+
+/// Adds a subscriber to a key.
+/// @param x Index to modify.
+/// @param h Hash of the key.
+/// @param key Key to subscribe to, shorter than MAX_STRING_SIZE.
+/// @param subscriber Subscriber to add.
+/// @param watched Set to 1 if the key had no subscribers before, 0 otherwise.
+/// @return 0 on success, including when the subscriber was already there,
+///         1 if memory ran out.
+int subs_add(SubscriberIndex *x, uint64_t h, const char *key, void *subscriber, int *watched);
+
+/// Removes a subscriber from a key.
+/// @param x Index to modify.
+/// @param h Hash of the key.
+/// @param key Key to unsubscribe from.
+/// @param subscriber Subscriber to remove.
+/// @param unwatched Set to 1 if the key has no subscribers left, 0 otherwise.
+/// @return 0 if the subscriber was removed, 1 if it was not subscribed.
+int subs_remove(SubscriberIndex *x, uint64_t h, const char *key, void *subscriber, int *unwatched);
+
+/// Looks up the subscribers of a key.
+/// @param x Index to search.
+/// @param h Hash of the key.
+/// @param key Key to search for.
+/// @return The key and its subscribers, NULL if it has none.
+const Watched *subs_find(const SubscriberIndex *x, uint64_t h, const char *key);
+
+/// Frees every key and subscriber list of the index.
+/// @param x Index to free.
+void subs_free(SubscriberIndex *x);
+
+#endif  // KVS_SUBS_H
@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+# Speaks the server protocol (see protocol.h) frame by frame, for the cases
+# kvsclient cannot produce. Exits 1 with a message on the first check that
+# fails.
+#
+# Usage: tests/rawclient.py coalesce <server_fifo> <pipe_prefix>
+#            checks every frame header, then subscribes to a key, writes it
+#            many times without reading the notification FIFO and checks
+#            that the notifications were coalesced to its latest values
+#        tests/rawclient.py hangup <server_fifo> <pipe_prefix> <hold_s>
+#            queues more READs than the FIFOs hold, closes the request FIFO
+#            without reading a response, prints "hung up" and holds the
+#            other FIFOs open for hold_s seconds
+
+import os
+import struct
+import sys
+import time
+
+OP_CONNECT, OP_DISCONNECT, OP_WRITE, OP_READ = 1, 2, 3, 4
+OP_DELETE, OP_SUBSCRIBE, OP_UNSUBSCRIBE, OP_NOTIFY = 5, 6, 7, 8
+STRING_SIZE = 40
+WRITES = 3000
+
+
+def fail(message):
+    sys.exit('rawclient: ' + message)
+
+
+def connect(server, prefix):
+    paths = [prefix + suffix for suffix in ('.req', '.resp', '.notif')]
+    for path in paths:
+        if os.path.exists(path):
+            os.unlink(path)
+        os.mkfifo(path)
+    fd = os.open(server, os.O_WRONLY)
+    os.write(fd, struct.pack('B40s40s40s', OP_CONNECT, *[p.encode() for p in paths]))
+    os.close(fd)
+    fds = (os.open(paths[0], os.O_WRONLY), os.open(paths[1], os.O_RDONLY), os.open(paths[2], os.O_RDONLY))
+    for path in paths:
+        os.unlink(path)
+    return fds
+
+
+def read_exact(fd, size):
+    data = b''
+    while len(data) < size:
+        chunk = os.read(fd, size - len(data))
+        if not chunk:
+            fail('the server closed a FIFO')
+        data += chunk
+    return data
+
+
+def read_frame(fd, op):
+    got, status, reserved, length = struct.unpack('BBHI', read_exact(fd, 8))
+    if got != op or status != 0 or reserved != 0:
+        fail('frame op=%d status=%d reserved=%d, expected op=%d' % (got, status, reserved, op))
+    return read_exact(fd, length).decode()
+
+
+def request(fds, op, keys, values=()):
+    frame = struct.pack('BBH', op, 0, len(keys))
+    frame += b''.join(s.encode().ljust(STRING_SIZE, b'\0') for s in list(keys) + list(values))
+    os.write(fds[0], frame)
+    return read_frame(fds[1], op)
+
+
+def expect(what, got, wanted):
+    if got != wanted:
+        fail('%s answered %r, expected %r' % (what, got, wanted))
+
+
+def coalesce(server, prefix):
+    fds = connect(server, prefix)
+    if read_frame(fds[1], OP_CONNECT) != '':
+        fail('CONNECT answered with text')
+
+    expect('WRITE', request(fds, OP_WRITE, ['r1', 'r2'], ['a', 'b']), '')
+    expect('READ', request(fds, OP_READ, ['r2', 'r1', 'r3']), '[(r1,a)(r2,b)(r3,KVSERROR)]\n')
+    expect('SUBSCRIBE', request(fds, OP_SUBSCRIBE, ['co']), '[(co,KVSERROR)]\n')
+
+    # Long values fill the notification FIFO well before the last write
+    values = ['%039d' % i for i in range(WRITES)]
+    for value in values:
+        expect('WRITE', request(fds, OP_WRITE, ['co'], [value]), '')
+
+    frames, last = 0, -1
+    while last != WRITES - 1:
+        text = read_frame(fds[2], OP_NOTIFY)
+        frames += 1
+        for line in text.splitlines():
+            if not line.startswith('(co,') or not line.endswith(')'):
+                fail('unexpected notification %r' % line)
+            value = int(line[4:-1])
+            if value <= last:
+                fail('notification %d came after %d' % (value, last))
+            last = value
+    if frames >= WRITES:
+        fail('%d notifications for %d writes, none coalesced' % (frames, WRITES))
+
+    expect('UNSUBSCRIBE', request(fds, OP_UNSUBSCRIBE, ['co', 'nope']), '[(nope,KVSMISSING)]\n')
+    expect('DELETE', request(fds, OP_DELETE, ['co', 'r1', 'r2']), '')
+    expect('DISCONNECT', request(fds, OP_DISCONNECT, []), '')
+    for fd in fds:
+        os.close(fd)
+
+
+def hangup(server, prefix, hold):
+    fds = connect(server, prefix)
+    read_frame(fds[1], OP_CONNECT)
+
+    frame = struct.pack('BBH', OP_READ, 0, 32)
+    frame += b''.join(('key%03d' % i).encode().ljust(STRING_SIZE, b'\0') for i in range(32))
+    # The answers to these fill the response FIFO several times over, and
+    # the server stops reading requests once it is full
+    os.set_blocking(fds[0], False)
+    sent, deadline = 0, time.time() + 1
+    while sent < 400 and time.time() < deadline:
+        try:
+            os.write(fds[0], frame)
+            sent += 1
+        except BlockingIOError:
+            time.sleep(0.01)
+    os.close(fds[0])
+    print('hung up', flush=True)
+
+    time.sleep(hold)
+    os.close(fds[1])
+    os.close(fds[2])
+
+
+if __name__ == '__main__':
+    if len(sys.argv) == 4 and sys.argv[1] == 'coalesce':
+        coalesce(sys.argv[2], sys.argv[3])
+    elif len(sys.argv) == 5 and sys.argv[1] == 'hangup':
+        hangup(sys.argv[2], sys.argv[3], float(sys.argv[4]))
+    else:
+        sys.exit('usage: tests/rawclient.py coalesce|hangup <server_fifo> <pipe_prefix> [hold_s]')
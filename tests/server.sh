@@ -0,0 +1,161 @@
+#!/bin/bash
+# Starts kvs in server mode and checks what clients get back:
+#   - WRITE/READ/DELETE through kvsclient, diffed against the expected output
+#   - SUBSCRIBE/UNSUBSCRIBE, with a second client changing the keys
+#   - two clients writing at once, then the values a third one reads
+#   - frame headers and coalesced notifications (tests/rawclient.py)
+#   - a client that hangs up while responses wait for it: the server must
+#     end the session without spinning, and keep serving others
+#   - SIGINT: the server exits 0 and removes its FIFO
+#
+# Usage: tests/server.sh
+#
+# Expects the binaries built by `make` and python3. Prints "server ok" when
+# every check passed.
+
+set -e
+cd "$(dirname "$0")/.."
+
+# FIFO paths, suffix included, must fit in KVS_PIPE_PATH_SIZE bytes
+dir=$(mktemp -d /tmp/kvs.XXXXXX)
+server=
+cleanup() {
+    if [ -n "$server" ]; then
+        kill "$server" 2>/dev/null || true
+        wait "$server" 2>/dev/null || true
+    fi
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $*" >&2
+    if [ -s "$dir/server.err" ]; then
+        echo "--- server stderr" >&2
+        cat "$dir/server.err" >&2
+    fi
+    exit 1
+}
+
+# Runs kvsclient with the commands given on stdin.
+client() {
+    tools/kvsclient "$dir/server" "$dir/$1"
+}
+
+# Diffs a file against the expected output given on stdin.
+check() {
+    diff -u - "$1" || fail "unexpected output of $1"
+}
+
+# Waits up to 5s for a line of a file to appear.
+wait_for() {
+    for _ in $(seq 100); do
+        grep -qxF -- "$2" "$1" 2>/dev/null && return 0
+        sleep 0.05
+    done
+    fail "no \"$2\" in $1"
+}
+
+./kvs -S "$dir/server" 2>"$dir/server.err" &
+server=$!
+for _ in $(seq 100); do
+    [ -p "$dir/server" ] && break
+    sleep 0.05
+done
+[ -p "$dir/server" ] || fail "the server did not create its FIFO"
+
+# Basic operations
+client a >"$dir/a.out" <<'EOF'
+WRITE [(k1,v1)(k2,v2)(sub,0)]
+READ [k1,k2,k3]
+DELETE [k2,k3]
+READ [k1,k2]
+EOF
+check "$dir/a.out" <<'EOF'
+[(k1,v1)(k2,v2)(k3,KVSERROR)]
+[(k3,KVSMISSING)]
+[(k1,v1)(k2,KVSERROR)]
+EOF
+
+# Subscriptions: the subscriber gets its commands one at a time, so every
+# notification is waited for before the next change is made
+mkfifo "$dir/s.in"
+client s <"$dir/s.in" >"$dir/s.out" &
+subscriber=$!
+exec 3>"$dir/s.in"
+echo "SUBSCRIBE [sub,k1]" >&3
+wait_for "$dir/s.out" "[(sub,0)(k1,v1)]"
+echo "WRITE [(sub,1)]" | client w >"$dir/w.out"
+wait_for "$dir/s.out" "(sub,1)"
+echo "DELETE [sub]" | client w >>"$dir/w.out"
+wait_for "$dir/s.out" "(sub,DELETED)"
+echo "UNSUBSCRIBE [sub,k2]" >&3
+wait_for "$dir/s.out" "[(k2,KVSMISSING)]"
+echo "WRITE [(sub,2)(k1,v3)]" | client w >>"$dir/w.out"
+wait_for "$dir/s.out" "(k1,v3)"
+echo "READ [sub]" >&3
+exec 3>&-
+wait "$subscriber" || fail "the subscriber failed"
+check "$dir/w.out" </dev/null
+check "$dir/s.out" <<'EOF'
+[(sub,0)(k1,v1)]
+(sub,1)
+(sub,DELETED)
+[(k2,KVSMISSING)]
+(k1,v3)
+[(sub,2)]
+EOF
+
+# Concurrent writers, each also writing a key the other one writes
+writers=()
+for c in x y; do
+    for i in $(seq 200); do
+        echo "WRITE [($c$i,$i)(shared,$c$i)]"
+        echo "READ [$c$i]"
+    done >"$dir/$c.job"
+    client "$c" <"$dir/$c.job" >"$dir/$c.out" &
+    writers+=($!)
+done
+for pid in "${writers[@]}"; do
+    wait "$pid" || fail "a concurrent writer failed"
+done
+for c in x y; do
+    seq 200 | sed "s/.*/[($c&,&)]/" | check "$dir/$c.out"
+done
+echo "READ [x1,y1,x200,y200]" | client r >"$dir/r.out"
+check "$dir/r.out" <<'EOF'
+[(x1,1)(x200,200)(y1,1)(y200,200)]
+EOF
+echo "READ [shared]" | client r >"$dir/r.out"
+grep -qxE '\[\(shared,(x200|y200)\)\]' "$dir/r.out" || fail "shared is $(cat "$dir/r.out")"
+
+# Raw frames and coalescing
+python3 tests/rawclient.py coalesce "$dir/server" "$dir/c" || fail "coalesce"
+
+# A client that hangs up with responses pending
+python3 tests/rawclient.py hangup "$dir/server" "$dir/h" 2 >"$dir/h.out" &
+hangup=$!
+wait_for "$dir/h.out" "hung up"
+sleep 0.2
+before=$(awk '{print $14 + $15}' "/proc/$server/stat")
+sleep 1
+after=$(awk '{print $14 + $15}' "/proc/$server/stat")
+[ $((after - before)) -lt 30 ] || fail "the server used $((after - before)) ticks in 1s after a hangup"
+echo "READ [k1]" | client r >"$dir/r.out"
+check "$dir/r.out" <<'EOF'
+[(k1,v3)]
+EOF
+wait "$hangup" || fail "hangup"
+
+# Shutdown
+kill -INT "$server"
+status=0
+wait "$server" || status=$?
+server=
+[ "$status" -eq 0 ] || fail "the server exited with $status after SIGINT"
+[ ! -e "$dir/server" ] || fail "the server left its FIFO behind"
+if [ -s "$dir/server.err" ]; then
+    fail "the server wrote to stderr"
+fi
+
+echo "server ok"
@@ -0,0 +1,156 @@
+#include "tokenizer.h"
+
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define TOKENIZER_X86 1
+#else
+#define TOKENIZER_X86 0
+#endif
+
+static int is_structural(char ch) {
+  switch (ch) {
+    case ',':
+    case ')':
+    case ']':
+    case ' ':
+    case '\\':
+    case '\n':
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static size_t tokenize_scalar(const char *line, size_t len, size_t from, uint32_t *marks, size_t k, size_t max_marks) {
+  for (size_t i = from; i < len && k < max_marks; i++) {
+    if (is_structural(line[i])) {
+      marks[k++] = (uint32_t)i;
+    }
+  }
+  return k;
+}
+
+static size_t scan_scalar(const char *line, size_t len, uint32_t *marks, size_t max_marks) {
+  return tokenize_scalar(line, len, 0, marks, 0, max_marks);
+}
+
+#if TOKENIZER_X86
+
+// Appends the offsets of the bits set in a block mask. Returns the new count,
+// or max_marks once the array is full.
+static size_t emit_mask(uint32_t mask, size_t base, uint32_t *marks, size_t k, size_t max_marks) {
+  while (mask != 0) {
+    if (k == max_marks) {
+      return k;
+    }
+    marks[k++] = (uint32_t)(base + (size_t)__builtin_ctz(mask));
+    mask &= mask - 1;
+  }
+  return k;
+}
+
+static size_t scan_sse2(const char *line, size_t len, uint32_t *marks, size_t max_marks) {
+  const __m128i comma = _mm_set1_epi8(',');
+  const __m128i paren = _mm_set1_epi8(')');
+  const __m128i bracket = _mm_set1_epi8(']');
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i newline = _mm_set1_epi8('\n');
+
+  size_t i = 0;
+  size_t k = 0;
+  for (; i + 16 <= len && k < max_marks; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(const void *)(line + i));
+    __m128i hits = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(block, comma), _mm_cmpeq_epi8(block, paren)),
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, bracket), _mm_cmpeq_epi8(block, space)),
+                     _mm_or_si128(_mm_cmpeq_epi8(block, backslash), _mm_cmpeq_epi8(block, newline))));
+    k = emit_mask((uint32_t)_mm_movemask_epi8(hits), i, marks, k, max_marks);
+  }
+
+  return tokenize_scalar(line, len, i, marks, k, max_marks);
+}
+
+__attribute__((target("avx2"))) static size_t scan_avx2(const char *line, size_t len, uint32_t *marks,
+                                                         size_t max_marks) {
+  const __m256i comma = _mm256_set1_epi8(',');
+  const __m256i paren = _mm256_set1_epi8(')');
+  const __m256i bracket = _mm256_set1_epi8(']');
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i newline = _mm256_set1_epi8('\n');
+
+  size_t i = 0;
+  size_t k = 0;
+  for (; i + 32 <= len && k < max_marks; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(const void *)(line + i));
+    __m256i hits = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(block, comma), _mm256_cmpeq_epi8(block, paren)),
+        _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, bracket), _mm256_cmpeq_epi8(block, space)),
+                        _mm256_or_si256(_mm256_cmpeq_epi8(block, backslash), _mm256_cmpeq_epi8(block, newline))));
+    k = emit_mask((uint32_t)_mm256_movemask_epi8(hits), i, marks, k, max_marks);
+  }
+
+  return tokenize_scalar(line, len, i, marks, k, max_marks);
+}
+
+#endif
+
+typedef size_t (*scan_fn)(const char *, size_t, uint32_t *, size_t);
+
+static scan_fn scan = scan_scalar;
+static enum TokenizerKind selected = TOKENIZER_SCALAR;
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+
+static void select_best(void) {
+#if TOKENIZER_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scan = scan_avx2;
+    selected = TOKENIZER_AVX2;
+  } else {
+    scan = scan_sse2;
+    selected = TOKENIZER_SSE2;
+  }
+#endif
+}
+
+size_t tokenize_line(const char *line, size_t len, uint32_t *marks, size_t max_marks) {
+  pthread_once(&select_once, select_best);
+  return scan(line, len, marks, max_marks);
+}
+
+int tokenizer_select(enum TokenizerKind kind) {
+  pthread_once(&select_once, select_best);
+
+  switch (kind) {
+    case TOKENIZER_SCALAR:
+      scan = scan_scalar;
+      break;
+#if TOKENIZER_X86
+    case TOKENIZER_SSE2:
+      scan = scan_sse2;
+      break;
+    case TOKENIZER_AVX2:
+      if (!__builtin_cpu_supports("avx2")) {
+        return 1;
+      }
+      scan = scan_avx2;
+      break;
+#else
+    case TOKENIZER_SSE2:
+    case TOKENIZER_AVX2:
+      return 1;
+#endif
+  }
+
+  selected = kind;
+  return 0;
+}
+
+enum TokenizerKind tokenizer_selected(void) {
+  pthread_once(&select_once, select_best);
+  return selected;
+}
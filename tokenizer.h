@@ -0,0 +1,32 @@
+#ifndef KVS_TOKENIZER_H
+#define KVS_TOKENIZER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum TokenizerKind {
+  TOKENIZER_SCALAR,
+  TOKENIZER_SSE2,
+  TOKENIZER_AVX2,
+};
+
+/// Finds the structural characters of a line: the ',', ')' and ']' that end
+/// keys and values, the spaces and newlines that make them invalid and the
+/// backslashes that escape the next character.
+/// @param line Bytes to scan.
+/// @param len Number of bytes to scan.
+/// @param marks Receives the offsets of the structural characters, in order.
+/// @param max_marks Capacity of marks. Scanning stops once it is full.
+/// @return Number of offsets written to marks.
+size_t tokenize_line(const char *line, size_t len, uint32_t *marks, size_t max_marks);
+
+/// Chooses the implementation used by tokenize_line. By default the widest
+/// one the CPU supports is picked on first use.
+/// @param kind Implementation to use.
+/// @return 0 on success, 1 if the CPU or the build does not support it.
+int tokenizer_select(enum TokenizerKind kind);
+
+/// @return The implementation used by tokenize_line.
+enum TokenizerKind tokenizer_selected(void);
+
+#endif  // KVS_TOKENIZER_H
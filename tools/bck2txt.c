@@ -0,0 +1,28 @@
+// Rebuilds a backup from its .bck file and the backups it is based on, and
+// prints it in the text format of SHOW.
+//
+// Usage: tools/bck2txt <job>-<number>.bck
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "writer.h"
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <job>-<number>.bck\n", argv[0]);
+        return 2;
+    }
+
+    Writer out;
+    if (writer_init(&out, STDOUT_FILENO)) {
+        fprintf(stderr, "Failed to allocate the output buffer\n");
+        return 1;
+    }
+
+    int failed = backup_materialize(argv[1], &out);
+    failed |= writer_destroy(&out) != 0;
+
+    return failed;
+}
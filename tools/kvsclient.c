@@ -0,0 +1,185 @@
+// Runs job file commands from stdin against kvs in server mode, and prints
+// what the server answers in the format of the .out files. WAIT pauses the
+// client; SHOW and BACKUP only exist in batch mode. SUBSCRIBE [key,...] and
+// UNSUBSCRIBE [key,...] manage subscriptions, whose changes are printed as
+// they arrive.
+//
+// Usage: tools/kvsclient <server_fifo> <pipe_prefix> < commands.job
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "operations.h"
+#include "parser.h"
+#include "reader.h"
+#include "writer.h"
+
+// Prints every batch of notifications until the server closes the FIFO.
+static void *print_notifications(void *arg) {
+    KvsClient *client = arg;
+    char *text;
+    size_t length;
+
+    while (client_next_notification(client, &text, &length) == 0) {
+        write_exact(STDOUT_FILENO, text, length);
+        free(text);
+    }
+    return NULL;
+}
+
+// Sends one command and appends the text of its response to out.
+static int send_command(KvsClient *client, enum KvsOp op, size_t count, char keys[][MAX_STRING_SIZE],
+                        char values[][MAX_STRING_SIZE], Writer *out) {
+    char *reply = NULL;
+    size_t length = 0;
+    int result = client_request(client, op, count, keys, values, &reply, &length);
+    if (result < 0) {
+        fprintf(stderr, "Lost the connection to the server\n");
+        return 1;
+    }
+    if (result > 0) {
+        fprintf(stderr, "The server failed a command\n");
+    }
+    writer_put(out, reply, length);
+    free(reply);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <server_fifo> <pipe_prefix> < commands.job\n", argv[0]);
+        return 2;
+    }
+
+    // A server that goes away shows up as a failed request instead
+    signal(SIGPIPE, SIG_IGN);
+
+    KvsClient client;
+    if (client_connect(&client, argv[1], argv[2])) {
+        return 1;
+    }
+
+    pthread_t notifications;
+    if (pthread_create(&notifications, NULL, print_notifications, &client) != 0) {
+        fprintf(stderr, "Failed to start the notification thread\n");
+        client_disconnect(&client);
+        client_close(&client);
+        return 1;
+    }
+
+    Reader reader;
+    Writer out;
+    int failed = reader_init(&reader, STDIN_FILENO);
+    if (failed) {
+        fprintf(stderr, "Failed to allocate the input buffer\n");
+    } else if ((failed = writer_init(&out, STDOUT_FILENO)) != 0) {
+        fprintf(stderr, "Failed to allocate the output buffer\n");
+        reader_destroy(&reader);
+    }
+    if (failed) {
+        client_disconnect(&client);
+        pthread_join(notifications, NULL);
+        client_close(&client);
+        return 1;
+    }
+
+    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
+    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
+    unsigned int delay;
+    size_t num_pairs;
+    int lost = 0;
+    int subscribed = 0;
+
+    while (!lost) {
+        enum Command cmd = get_next(&reader);
+        if (cmd == EOC) {
+            break;
+        }
+
+        switch (cmd) {
+            case CMD_WRITE:
+                num_pairs = parse_write(&reader, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+                if (num_pairs == 0) {
+                    fprintf(stderr, "Invalid command. See HELP for usage\n");
+                    break;
+                }
+                lost = send_command(&client, OP_WRITE, num_pairs, keys, values, &out);
+                break;
+
+            case CMD_READ:
+            case CMD_DELETE:
+                num_pairs = parse_read_delete(&reader, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+                if (num_pairs == 0) {
+                    fprintf(stderr, "Invalid command. See HELP for usage\n");
+                    break;
+                }
+                lost = send_command(&client, cmd == CMD_READ ? OP_READ : OP_DELETE, num_pairs, keys, NULL, &out);
+                break;
+
+            case CMD_SUBSCRIBE:
+            case CMD_UNSUBSCRIBE:
+                num_pairs = parse_read_delete(&reader, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+                if (num_pairs == 0) {
+                    fprintf(stderr, "Invalid command. See HELP for usage\n");
+                    break;
+                }
+                subscribed = 1;
+                lost = send_command(&client, cmd == CMD_SUBSCRIBE ? OP_SUBSCRIBE : OP_UNSUBSCRIBE, num_pairs, keys,
+                                    NULL, &out);
+                break;
+
+            case CMD_WAIT:
+                if (parse_wait(&reader, &delay, NULL) == -1) {
+                    fprintf(stderr, "Invalid command. See HELP for usage\n");
+                    break;
+                }
+                if (delay > 0) {
+                    writer_puts(&out, "Waiting...\n");
+                    writer_flush(&out);
+                    kvs_wait(delay);
+                }
+                break;
+
+            case CMD_SHOW:
+            case CMD_BACKUP:
+                fprintf(stderr, "SHOW and BACKUP are not supported by the server\n");
+                break;
+
+            case CMD_INVALID:
+                fprintf(stderr, "Invalid command. See HELP for usage\n");
+                break;
+
+            case CMD_HELP:
+                printf("Available commands:\n"
+                       "  WRITE [(key,value)(key2,value2),...]\n"
+                       "  READ [key,key2,...]\n"
+                       "  DELETE [key,key2,...]\n"
+                       "  SUBSCRIBE [key,key2,...]\n"
+                       "  UNSUBSCRIBE [key,key2,...]\n"
+                       "  WAIT <delay_ms>\n"
+                       "  HELP\n");
+                break;
+
+            case CMD_EMPTY:
+            case EOC:
+                break;
+        }
+
+        // Notifications are printed as they come, so responses cannot wait
+        // in the buffer once there may be some
+        if (subscribed) {
+            writer_flush(&out);
+        }
+    }
+
+    failed = writer_destroy(&out) != 0;
+    reader_destroy(&reader);
+    failed |= client_disconnect(&client) && !lost;
+    pthread_join(notifications, NULL);
+    client_close(&client);
+    return failed || lost;
+}
@@ -0,0 +1,578 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "writer.h"
+
+#define FILE_HEADER_SIZE 8
+#define RECORD_HEADER_SIZE 24
+
+// Sequence number of the last record appended by the calling thread, which
+// wal_commit waits for.
+static _Thread_local uint64_t last_lsn;
+
+static void put16(unsigned char *p, size_t v) {
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+static void put64(unsigned char *p, uint64_t v) {
+  put32(p, (uint32_t)v);
+  put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static size_t get16(const unsigned char *p) {
+  return (size_t)p[0] | (size_t)p[1] << 8;
+}
+
+static uint32_t get32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get64(const unsigned char *p) {
+  return (uint64_t)get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+void wal_options_default(WalOptions *options) {
+  options->interval_ms = WAL_DEFAULT_INTERVAL_MS;
+  options->batch_bytes = WAL_DEFAULT_BATCH_BYTES;
+  options->checkpoint_bytes = WAL_DEFAULT_CHECKPOINT_BYTES;
+  options->wait_durable = 0;
+}
+
+// Writes a whole buffer to the log, retrying partial writes.
+static int write_bytes(int fd, const unsigned char *data, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      perror("Error writing to the log");
+      return 1;
+    }
+    data += written;
+    len -= (size_t)written;
+  }
+  return 0;
+}
+
+// Change logger of the table: appends one record to the pending buffer.
+static void append(void *ctx, enum ChangeKind kind, size_t count, const char *const keys[],
+                   const char *const values[]) {
+  Wal *wal = ctx;
+
+  size_t size = RECORD_HEADER_SIZE;
+  for (size_t k = 0; k < count; k++) {
+    size += 2 + strlen(keys[k]);
+    if (values != NULL) size += 2 + strlen(values[k]);
+  }
+
+  pthread_mutex_lock(&wal->lock);
+  if (wal->len + size > wal->capacity) {
+    size_t capacity = wal->capacity * 2;
+    while (capacity < wal->len + size) capacity *= 2;
+    unsigned char *buf = realloc(wal->buf, capacity);
+    if (buf == NULL) {
+      // The record is lost, so no later one may reach the log either
+      wal->failed = 1;
+      pthread_mutex_unlock(&wal->lock);
+      return;
+    }
+    wal->buf = buf;
+    wal->capacity = capacity;
+  }
+
+  unsigned char *record = wal->buf + wal->len;
+  unsigned char *p = record + RECORD_HEADER_SIZE;
+  for (size_t k = 0; k < count; k++) {
+    size_t len = strlen(keys[k]);
+    put16(p, len);
+    memcpy(p + 2, keys[k], len);
+    p += 2 + len;
+    if (values != NULL) {
+      len = strlen(values[k]);
+      put16(p, len);
+      memcpy(p + 2, values[k], len);
+      p += 2 + len;
+    }
+  }
+
+  last_lsn = wal->next_lsn++;
+  put32(record, (uint32_t)(size - RECORD_HEADER_SIZE));
+  put64(record + 8, last_lsn);
+  record[16] = (unsigned char)kind;
+  record[17] = record[18] = record[19] = 0;
+  put32(record + 20, (uint32_t)count);
+  put32(record + 4, backup_crc32(record + 8, size - 8));
+  wal->len += size;
+
+  if (wal->len >= wal->options.batch_bytes) {
+    pthread_cond_signal(&wal->wake);
+  }
+  pthread_mutex_unlock(&wal->lock);
+}
+
+// Writes and syncs the pending records. Called with the lock held, which is
+// released during the I/O so that writers keep appending to the other buffer.
+static void flush_pending(Wal *wal) {
+  if (wal->len == 0) return;
+
+  unsigned char *buf = wal->buf;
+  size_t len = wal->len;
+  size_t capacity = wal->capacity;
+  uint64_t upto = wal->next_lsn;
+  wal->buf = wal->spare;
+  wal->capacity = wal->spare_capacity;
+  wal->len = 0;
+  wal->flushing = 1;
+  pthread_mutex_unlock(&wal->lock);
+
+  int failed = write_bytes(wal->fd, buf, len);
+  if (!failed && fdatasync(wal->fd) != 0) {
+    perror("Error syncing the log");
+    failed = 1;
+  }
+
+  pthread_mutex_lock(&wal->lock);
+  wal->spare = buf;
+  wal->spare_capacity = capacity;
+  wal->file_size += len;
+  wal->failed |= failed;
+  wal->durable_lsn = upto;
+  wal->flushing = 0;
+  pthread_cond_broadcast(&wal->synced);
+}
+
+static int sync_file(const char *path, int fd) {
+  if (fsync(fd) != 0) {
+    perror(path);
+    return 1;
+  }
+  return 0;
+}
+
+// Copies the bytes of the log between two offsets to the end of another file.
+static int copy_range(Wal *wal, int fd, size_t pos, size_t end) {
+  unsigned char chunk[WRITER_FLUSH_SIZE];
+  while (pos < end) {
+    size_t want = end - pos < sizeof(chunk) ? end - pos : sizeof(chunk);
+    ssize_t n = pread(wal->fd, chunk, want, (off_t)pos);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) continue;
+      perror(wal->path);
+      return 1;
+    }
+    if (write_bytes(fd, chunk, (size_t)n)) return 1;
+    pos += (size_t)n;
+  }
+  return 0;
+}
+
+// Copies the records of the log from `from` on to a new log that replaces it.
+// What is on disk when it starts is copied and synced without the lock, so
+// writers keep appending and the flusher keeps syncing; the lock is only held
+// to copy what was flushed meanwhile and to swap the files. Only the
+// checkpointer, or wal_close once it stopped, replaces the log.
+static int truncate_front(Wal *wal, size_t from) {
+  size_t size = strlen(wal->path) + 5;
+  char *tmp = malloc(size);
+  if (tmp == NULL) return 1;
+  snprintf(tmp, size, "%s.tmp", wal->path);
+
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (fd < 0) {
+    perror(tmp);
+    free(tmp);
+    return 1;
+  }
+
+  unsigned char header[FILE_HEADER_SIZE];
+  memcpy(header, WAL_MAGIC, 4);
+  put32(header + 4, WAL_VERSION);
+  int failed = write_bytes(fd, header, FILE_HEADER_SIZE);
+
+  pthread_mutex_lock(&wal->lock);
+  size_t copied = wal->file_size;
+  pthread_mutex_unlock(&wal->lock);
+  failed = failed || copy_range(wal, fd, from, copied) || sync_file(tmp, fd);
+
+  pthread_mutex_lock(&wal->lock);
+  // A flush in progress writes to the old log, so it has to end first
+  while (wal->flushing) {
+    pthread_cond_wait(&wal->synced, &wal->lock);
+  }
+  failed = failed || copy_range(wal, fd, copied, wal->file_size) || sync_file(tmp, fd);
+  if (!failed && rename(tmp, wal->path) != 0) {
+    perror(wal->path);
+    failed = 1;
+  }
+
+  if (failed) {
+    close(fd);
+    unlink(tmp);
+  } else {
+    close(wal->fd);
+    wal->fd = fd;
+    wal->file_size = FILE_HEADER_SIZE + (wal->file_size - from);
+  }
+  wal->failed |= failed;
+  pthread_mutex_unlock(&wal->lock);
+
+  free(tmp);
+  return failed;
+}
+
+// Writes the table to the snapshot file and drops the records it holds from
+// the log.
+static int checkpoint(Wal *wal) {
+  pthread_mutex_lock(&wal->lock);
+  // Records before this offset were applied to the table before they were
+  // appended, so the snapshot holds them
+  size_t covered = wal->file_size;
+  pthread_mutex_unlock(&wal->lock);
+
+  TableSnapshot *snap = snapshot_table(wal->ht);
+  if (snap == NULL) {
+    fprintf(stderr, "Failed to take a snapshot for the log checkpoint\n");
+    return 1;
+  }
+
+  size_t size = strlen(wal->snap_path) + 5;
+  char *tmp = malloc(size);
+  int fd = -1;
+  if (tmp != NULL) {
+    snprintf(tmp, size, "%s.tmp", wal->snap_path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) perror(tmp);
+  }
+
+  Writer out;
+  int failed = fd < 0 || writer_init(&out, fd);
+  if (!failed) {
+    failed = backup_write(wal->ht, snap, 1, 1, NULL, &out);
+    failed |= writer_destroy(&out) != 0;
+    failed = failed || sync_file(tmp, fd);
+    if (!failed && rename(tmp, wal->snap_path) != 0) {
+      perror(wal->snap_path);
+      failed = 1;
+    }
+    if (failed) unlink(tmp);
+  }
+  if (fd >= 0) close(fd);
+  free(tmp);
+  snapshot_release(wal->ht, snap);
+
+  if (failed) {
+    pthread_mutex_lock(&wal->lock);
+    wal->failed = 1;
+    pthread_mutex_unlock(&wal->lock);
+    return 1;
+  }
+  return truncate_front(wal, covered);
+}
+
+// Takes the checkpoints the flusher asks for, on a thread of its own so that
+// records keep being flushed and synced while the snapshot is written.
+static void *checkpointer(void *arg) {
+  Wal *wal = arg;
+
+  pthread_mutex_lock(&wal->lock);
+  while (1) {
+    while (!wal->stop && !wal->checkpointing) {
+      pthread_cond_wait(&wal->due, &wal->lock);
+    }
+    if (wal->stop) break;
+    pthread_mutex_unlock(&wal->lock);
+    checkpoint(wal);
+    pthread_mutex_lock(&wal->lock);
+    wal->checkpointing = 0;
+  }
+  pthread_mutex_unlock(&wal->lock);
+
+  return NULL;
+}
+
+static void *flusher(void *arg) {
+  Wal *wal = arg;
+
+  pthread_mutex_lock(&wal->lock);
+  while (!wal->stop) {
+    if (wal->len < wal->options.batch_bytes) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += wal->options.interval_ms / 1000;
+      deadline.tv_nsec += (long)(wal->options.interval_ms % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&wal->wake, &wal->lock, &deadline);
+    }
+
+    flush_pending(wal);
+    if (!wal->stop && !wal->failed && !wal->checkpointing &&
+        wal->file_size >= wal->options.checkpoint_bytes) {
+      wal->checkpointing = 1;
+      pthread_cond_signal(&wal->due);
+    }
+  }
+  flush_pending(wal);
+  pthread_mutex_unlock(&wal->lock);
+
+  return NULL;
+}
+
+// Applies one record to the table. Returns 1 if its entries do not match
+// its length.
+static int apply(HashTable *ht, const unsigned char *record, size_t len) {
+  int kind = record[16];
+  size_t count = get32(record + 20);
+  const unsigned char *p = record + RECORD_HEADER_SIZE;
+  const unsigned char *end = p + len;
+
+  // Each entry takes at least two bytes, which also bounds the arrays
+  if ((kind != CHANGE_WRITE && kind != CHANGE_DELETE) || count == 0 || count > len / 2) {
+    return 1;
+  }
+
+  const char **keys = malloc(count * sizeof(char *));
+  const char **values = malloc(count * sizeof(char *));
+  char *strings = malloc(len + count * 2);
+  int failed = keys == NULL || values == NULL || strings == NULL;
+
+  char *s = strings;
+  for (size_t k = 0; !failed && k < count; k++) {
+    for (int field = 0; field < (kind == CHANGE_WRITE ? 2 : 1); field++) {
+      if (end - p < 2 || get16(p) > (size_t)(end - p) - 2) {
+        failed = 1;
+        break;
+      }
+      size_t n = get16(p);
+      memcpy(s, p + 2, n);
+      s[n] = '\0';
+      if (field == 0) keys[k] = s;
+      else values[k] = s;
+      s += n + 1;
+      p += 2 + n;
+    }
+  }
+  failed |= p != end;
+
+  if (!failed && kind == CHANGE_WRITE) {
+    write_pairs(ht, count, keys, values, NULL);
+  } else if (!failed) {
+    delete_pairs(ht, count, keys, NULL);
+  }
+
+  free(keys);
+  free(values);
+  free(strings);
+  return failed;
+}
+
+// Applies the records of the log in order and returns the offset after the
+// last valid one; whatever follows was torn by a crash.
+static size_t replay(Wal *wal, const unsigned char *data, size_t size) {
+  size_t pos = FILE_HEADER_SIZE;
+  uint64_t lsn = 0;
+
+  while (pos + RECORD_HEADER_SIZE <= size) {
+    const unsigned char *record = data + pos;
+    size_t len = get32(record);
+    uint64_t record_lsn = get64(record + 8);
+    if (len > size - pos - RECORD_HEADER_SIZE ||
+        get32(record + 4) != backup_crc32(record + 8, RECORD_HEADER_SIZE - 8 + len) ||
+        (lsn != 0 && record_lsn != lsn + 1) || apply(wal->ht, record, len)) {
+      break;
+    }
+    lsn = record_lsn;
+    pos += RECORD_HEADER_SIZE + len;
+    wal->replayed++;
+  }
+
+  if (pos < size) {
+    fprintf(stderr, "%s: dropping %zu bytes after the last valid record\n", wal->path, size - pos);
+  }
+  wal->next_lsn = lsn + 1;
+  return pos;
+}
+
+// Reads the log, rebuilding the table from it, and leaves it ready for
+// appending.
+static int load_log(Wal *wal) {
+  wal->fd = open(wal->path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  struct stat st;
+  if (wal->fd < 0 || fstat(wal->fd, &st) != 0) {
+    perror(wal->path);
+    return 1;
+  }
+
+  size_t size = (size_t)st.st_size;
+  if (size == 0) {
+    unsigned char header[FILE_HEADER_SIZE];
+    memcpy(header, WAL_MAGIC, 4);
+    put32(header + 4, WAL_VERSION);
+    wal->next_lsn = 1;
+    wal->file_size = FILE_HEADER_SIZE;
+    return write_bytes(wal->fd, header, FILE_HEADER_SIZE) || sync_file(wal->path, wal->fd);
+  }
+
+  unsigned char *data = malloc(size);
+  size_t done = 0;
+  while (data != NULL && done < size) {
+    ssize_t n = pread(wal->fd, data + done, size - done, (off_t)done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    done += (size_t)n;
+  }
+
+  int failed = data == NULL || done != size;
+  if (failed) {
+    perror(wal->path);
+  } else if (size < FILE_HEADER_SIZE || memcmp(data, WAL_MAGIC, 4) != 0 || get32(data + 4) != WAL_VERSION) {
+    fprintf(stderr, "%s: not a log file\n", wal->path);
+    failed = 1;
+  } else {
+    wal->file_size = replay(wal, data, size);
+    if (wal->file_size < size && ftruncate(wal->fd, (off_t)wal->file_size) != 0) {
+      perror(wal->path);
+      failed = 1;
+    }
+  }
+
+  free(data);
+  return failed;
+}
+
+static char *suffixed(const char *path, const char *suffix) {
+  size_t size = strlen(path) + strlen(suffix) + 1;
+  char *result = malloc(size);
+  if (result) {
+    snprintf(result, size, "%s%s", path, suffix);
+  }
+  return result;
+}
+
+static void free_wal(Wal *wal) {
+  if (wal->fd >= 0) close(wal->fd);
+  pthread_mutex_destroy(&wal->lock);
+  pthread_cond_destroy(&wal->wake);
+  pthread_cond_destroy(&wal->synced);
+  pthread_cond_destroy(&wal->due);
+  free(wal->buf);
+  free(wal->spare);
+  free(wal->path);
+  free(wal->snap_path);
+  free(wal);
+}
+
+static void stop_checkpointer(Wal *wal) {
+  pthread_mutex_lock(&wal->lock);
+  wal->stop = 1;
+  pthread_cond_signal(&wal->due);
+  pthread_mutex_unlock(&wal->lock);
+  pthread_join(wal->checkpointer, NULL);
+}
+
+Wal *wal_open(const char *path, HashTable *ht, const WalOptions *options) {
+  Wal *wal = calloc(1, sizeof(Wal));
+  if (wal == NULL) return NULL;
+
+  wal->ht = ht;
+  wal->fd = -1;
+  if (options != NULL) {
+    wal->options = *options;
+  } else {
+    wal_options_default(&wal->options);
+  }
+  if (wal->options.interval_ms == 0) wal->options.interval_ms = 1;
+  pthread_mutex_init(&wal->lock, NULL);
+  pthread_cond_init(&wal->wake, NULL);
+  pthread_cond_init(&wal->synced, NULL);
+  pthread_cond_init(&wal->due, NULL);
+
+  wal->capacity = wal->spare_capacity = WRITER_FLUSH_SIZE;
+  wal->buf = malloc(wal->capacity);
+  wal->spare = malloc(wal->spare_capacity);
+  wal->path = strdup(path);
+  wal->snap_path = suffixed(path, ".snap");
+  if (!wal->buf || !wal->spare || !wal->path || !wal->snap_path) {
+    free_wal(wal);
+    return NULL;
+  }
+
+  // The snapshot comes first; the log holds everything changed after it
+  if (access(wal->snap_path, F_OK) == 0 && backup_load(wal->snap_path, ht, 0)) {
+    fprintf(stderr, "%s: cannot restore the checkpoint\n", wal->snap_path);
+    free_wal(wal);
+    return NULL;
+  }
+  if (load_log(wal)) {
+    free_wal(wal);
+    return NULL;
+  }
+  wal->durable_lsn = wal->next_lsn;
+
+  if (pthread_create(&wal->checkpointer, NULL, checkpointer, wal) != 0) {
+    fprintf(stderr, "Failed to start the log checkpointer\n");
+    free_wal(wal);
+    return NULL;
+  }
+  set_change_logger(ht, append, wal);
+  if (pthread_create(&wal->flusher, NULL, flusher, wal) != 0) {
+    fprintf(stderr, "Failed to start the log flusher\n");
+    set_change_logger(ht, NULL, NULL);
+    stop_checkpointer(wal);
+    free_wal(wal);
+    return NULL;
+  }
+  return wal;
+}
+
+int wal_commit(Wal *wal) {
+  if (!wal->options.wait_durable) {
+    return __atomic_load_n(&wal->failed, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_lock(&wal->lock);
+  if (wal->durable_lsn <= last_lsn) {
+    pthread_cond_signal(&wal->wake);
+  }
+  while (!wal->failed && wal->durable_lsn <= last_lsn) {
+    pthread_cond_wait(&wal->synced, &wal->lock);
+  }
+  int failed = wal->failed;
+  pthread_mutex_unlock(&wal->lock);
+  return failed;
+}
+
+int wal_close(Wal *wal, int checkpoint_first) {
+  pthread_mutex_lock(&wal->lock);
+  wal->stop = 1;
+  pthread_cond_signal(&wal->wake);
+  pthread_mutex_unlock(&wal->lock);
+  pthread_join(wal->flusher, NULL);
+  stop_checkpointer(wal);
+
+  if (checkpoint_first && !wal->failed) {
+    checkpoint(wal);
+  }
+  set_change_logger(wal->ht, NULL, NULL);
+
+  int failed = wal->failed;
+  free_wal(wal);
+  return failed;
+}
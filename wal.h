@@ -0,0 +1,100 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "kvs.h"
+
+// The log is a file starting with "KVSW" and a version, followed by one
+// record per write_pairs or delete_pairs batch:
+//
+//   length of the entries, CRC-32 of everything after it, sequence number,
+//   kind, number of keys, then each key (and value, for writes) as a 16-bit
+//   length and its bytes
+//
+// A checkpoint writes the whole table to <log>.snap in the backup format
+// and then drops the records it covers from the log. Replaying the snapshot
+// and then every record left in the log, in order, rebuilds the table: a
+// record the snapshot already holds is applied again with the same result.
+
+#define WAL_MAGIC "KVSW"
+#define WAL_VERSION 1
+
+#define WAL_DEFAULT_INTERVAL_MS 10
+#define WAL_DEFAULT_BATCH_BYTES (1 << 20)
+#define WAL_DEFAULT_CHECKPOINT_BYTES ((size_t)64 << 20)
+
+typedef struct WalOptions {
+  // The flusher writes and syncs the pending records at least this often
+  unsigned interval_ms;
+  // Pending bytes that wake the flusher before the interval ends
+  size_t batch_bytes;
+  // Size of the log that makes the flusher take a checkpoint
+  size_t checkpoint_bytes;
+  // Whether wal_commit waits until the records of the thread are synced
+  int wait_durable;
+} WalOptions;
+
+// Records are appended to `buf` by the writers while they hold their stripe
+// locks; the flusher swaps it with `spare`, writes it and calls fdatasync,
+// so one sync covers every record appended meanwhile. Checkpoints run on the
+// checkpointer thread, so flushing goes on while the snapshot is written.
+typedef struct Wal {
+  HashTable *ht;
+  char *path;
+  char *snap_path;
+  int fd;
+  WalOptions options;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t synced;
+  pthread_cond_t due;
+  pthread_t flusher;
+  pthread_t checkpointer;
+  unsigned char *buf;
+  size_t len;
+  size_t capacity;
+  unsigned char *spare;
+  size_t spare_capacity;
+  uint64_t next_lsn;
+  uint64_t durable_lsn;
+  size_t file_size;
+  uint64_t replayed;
+  int stop;
+  int failed;
+  // Whether the flusher is writing outside the lock
+  int flushing;
+  // Whether the flusher asked for a checkpoint that did not end yet
+  int checkpointing;
+} Wal;
+
+/// Fills the default options: asynchronous commits synced every
+/// WAL_DEFAULT_INTERVAL_MS.
+/// @param options Options to fill.
+void wal_options_default(WalOptions *options);
+
+/// Rebuilds a table from a log and its last checkpoint, then logs every
+/// change made to the table from then on.
+/// @param path Path of the log; created if it does not exist.
+/// @param ht Empty table to rebuild.
+/// @param options Flush and checkpoint settings, NULL for the defaults.
+/// @return The log, NULL if it could not be opened or its checkpoint is
+///         corrupted. A torn record at the end of the log is dropped.
+Wal *wal_open(const char *path, HashTable *ht, const WalOptions *options);
+
+/// Waits until the records of the calling thread are synced, if the log
+/// was opened with wait_durable. Call after write_pairs or delete_pairs.
+/// @param wal Log of the table.
+/// @return 0 on success, 1 if the log could not be written.
+int wal_commit(Wal *wal);
+
+/// Syncs the pending records, stops logging and frees the log.
+/// @param wal Log to close.
+/// @param checkpoint Whether to write a checkpoint first, which leaves
+///                   the log empty.
+/// @return 0 on success, 1 if the log could not be written.
+int wal_close(Wal *wal, int checkpoint);
+
+#endif  // KVS_WAL_H
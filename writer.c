@@ -0,0 +1,125 @@
+#include "writer.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+int writer_init(Writer *w, int fd) {
+  w->fd = fd;
+  w->len = 0;
+  w->failed = 0;
+  w->capacity = WRITER_FLUSH_SIZE;
+  w->buf = malloc(WRITER_FLUSH_SIZE);
+  return w->buf == NULL;
+}
+
+int writer_init_memory(Writer *w) {
+  return writer_init(w, -1);
+}
+
+// Grows the buffer of a writer without a file so that len more bytes fit.
+static int reserve(Writer *w, size_t len) {
+  size_t capacity = w->capacity;
+  while (capacity < w->len + len) {
+    capacity *= 2;
+  }
+  char *buf = capacity == w->capacity ? w->buf : realloc(w->buf, capacity);
+  if (buf == NULL) {
+    w->failed = 1;
+    return -1;
+  }
+  w->buf = buf;
+  w->capacity = capacity;
+  return 0;
+}
+
+int writer_destroy(Writer *w) {
+  int result = writer_flush(w);
+  free(w->buf);
+  w->buf = NULL;
+  return result;
+}
+
+// Writes two buffers in order with as few syscalls as possible, retrying
+// partial writes.
+static int write_all(Writer *w, const char *first, size_t first_len, const char *second, size_t second_len) {
+  struct iovec iov[2] = {
+      {(void *)first, first_len},
+      {(void *)second, second_len},
+  };
+  struct iovec *next = iov;
+  int count = 2;
+
+  while (count > 0) {
+    if (next->iov_len == 0) {
+      next++;
+      count--;
+      continue;
+    }
+
+    ssize_t written = writev(w->fd, next, count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (!w->failed) {
+        perror("Error writing to file");
+      }
+      w->failed = 1;
+      return -1;
+    }
+
+    size_t done = (size_t)written;
+    metrics_written(done);
+    while (count > 0 && done >= next->iov_len) {
+      done -= next->iov_len;
+      next++;
+      count--;
+    }
+    if (count > 0) {
+      next->iov_base = (char *)next->iov_base + done;
+      next->iov_len -= done;
+    }
+  }
+
+  return 0;
+}
+
+int writer_put(Writer *w, const char *data, size_t len) {
+  if (w->fd < 0) {
+    if (reserve(w, len)) return -1;
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+    return 0;
+  }
+
+  if (w->len + len <= WRITER_FLUSH_SIZE) {
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+    return 0;
+  }
+
+  // The buffer and the new bytes go out in a single writev
+  int result = write_all(w, w->buf, w->len, data, len);
+  w->len = 0;
+  return result;
+}
+
+int writer_puts(Writer *w, const char *str) {
+  return writer_put(w, str, strlen(str));
+}
+
+int writer_flush(Writer *w) {
+  if (w->fd < 0) {
+    return 0;
+  }
+
+  int result = write_all(w, w->buf, w->len, NULL, 0);
+  w->len = 0;
+  return result;
+}
@@ -0,0 +1,56 @@
+#ifndef KVS_WRITER_H
+#define KVS_WRITER_H
+
+#include <stddef.h>
+
+// Buffered bytes that make a writer flush to its file.
+#define WRITER_FLUSH_SIZE 65536
+
+// Buffered writer over a file descriptor. Output of a job is accumulated in
+// `buf` and written in chunks of WRITER_FLUSH_SIZE bytes, or when the job
+// asks for it with writer_flush. A writer without a file (fd -1) keeps
+// everything in `buf`, growing it as needed.
+typedef struct Writer {
+  int fd;
+  char *buf;
+  size_t len;
+  size_t capacity;
+  int failed;
+} Writer;
+
+/// Initializes a writer over a file descriptor.
+/// @param w Writer to initialize.
+/// @param fd File descriptor to write to. Not closed by the writer.
+/// @return 0 on success, 1 if the buffer could not be allocated.
+int writer_init(Writer *w, int fd);
+
+/// Initializes a writer that keeps its output in memory, to be copied to
+/// another writer later.
+/// @param w Writer to initialize.
+/// @return 0 on success, 1 if the buffer could not be allocated.
+int writer_init_memory(Writer *w);
+
+/// Flushes and frees the buffer of a writer.
+/// @param w Writer to destroy.
+/// @return 0 if every byte was written, -1 otherwise.
+int writer_destroy(Writer *w);
+
+/// Appends bytes to the output.
+/// @param w Writer to append to.
+/// @param data Bytes to append.
+/// @param len Number of bytes to append.
+/// @return 0 on success, -1 if a flush failed.
+int writer_put(Writer *w, const char *data, size_t len);
+
+/// Appends a string to the output.
+/// @param w Writer to append to.
+/// @param str String to append, without its terminator.
+/// @return 0 on success, -1 if a flush failed.
+int writer_puts(Writer *w, const char *str);
+
+/// Writes every buffered byte to the file. Does nothing without a file.
+/// @param w Writer to flush.
+/// @return 0 on success, -1 if a write failed.
+int writer_flush(Writer *w);
+
+#endif  // KVS_WRITER_H